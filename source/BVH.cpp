@@ -0,0 +1,257 @@
+#include "pch.h"
+#include <array>
+#include <numeric>
+#include <random>
+#include "BVH.h"
+#include "Camera.h"
+
+namespace {
+	float GetBoxArea(const Vector3& boundsMin, const Vector3& boundsMax) {
+		const Vector3 size{ boundsMax - boundsMin };
+		return 2.0f * (size.x * size.y + size.y * size.z + size.z * size.x);
+	}
+
+	void GrowBox(Vector3& boundsMin, Vector3& boundsMax, const Vector3& pointMin, const Vector3& pointMax) {
+		boundsMin = { std::min(boundsMin.x, pointMin.x), std::min(boundsMin.y, pointMin.y), std::min(boundsMin.z, pointMin.z) };
+		boundsMax = { std::max(boundsMax.x, pointMax.x), std::max(boundsMax.y, pointMax.y), std::max(boundsMax.z, pointMax.z) };
+	}
+}
+
+void BVH::Build(const std::vector<Vector3>& centers, const std::vector<float>& radii) {
+
+	const uint32_t itemCount{ uint32_t(centers.size()) };
+	m_Items.resize(itemCount);
+	std::iota(m_Items.begin(), m_Items.end(), 0u);
+
+	m_Spheres.resize(itemCount);
+	for (uint32_t item{ 0 }; item < itemCount; ++item) {
+		m_Spheres[item] = { centers[item], radii[item] };
+	}
+
+	// A binary tree never has more than 2n - 1 nodes, reserving them keeps node references valid during the build
+	m_Nodes.clear();
+	m_Nodes.reserve(size_t(std::max(itemCount, 1u)) * 2 - 1);
+	if (itemCount > 0) {
+		m_Nodes.push_back({ {}, {}, 0, itemCount });
+		UpdateNodeBounds(m_Nodes.front());
+		Subdivide(0, 0);
+	}
+
+	m_SurfaceArea = GetSurfaceArea();
+	m_BuiltSurfaceArea = m_SurfaceArea;
+}
+
+void BVH::Subdivide(uint32_t nodeIndex, int depth) {
+
+	Node& node{ m_Nodes[nodeIndex] };
+	if (node.count <= MaxLeafSize || depth >= MaxDepth) {
+		return;
+	}
+
+	// Split along the longest axis of the item centers
+	Vector3 centerMin{ FLT_MAX, FLT_MAX, FLT_MAX };
+	Vector3 centerMax{ -FLT_MAX, -FLT_MAX, -FLT_MAX };
+	for (uint32_t index{ node.first }; index < node.first + node.count; ++index) {
+		GrowBox(centerMin, centerMax, m_Spheres[index].center, m_Spheres[index].center);
+	}
+
+	const Vector3 centerExtent{ centerMax - centerMin };
+	int axis{ 0 };
+	if (centerExtent.y > centerExtent[axis]) axis = 1;
+	if (centerExtent.z > centerExtent[axis]) axis = 2;
+	if (centerExtent[axis] <= 0.0f) {
+		return;
+	}
+
+	// Bin the items by center, then sweep the bins from both sides for the cheapest split
+	struct Bin
+	{
+		Vector3 boundsMin{ FLT_MAX, FLT_MAX, FLT_MAX };
+		Vector3 boundsMax{ -FLT_MAX, -FLT_MAX, -FLT_MAX };
+		uint32_t count{};
+	};
+	std::array<Bin, BinCount> bins{};
+
+	const float binScale{ BinCount / centerExtent[axis] };
+	const auto getBin{ [&](const ItemSphere& sphere) {
+		return std::min(int((sphere.center[axis] - centerMin[axis]) * binScale), BinCount - 1);
+	} };
+
+	for (uint32_t index{ node.first }; index < node.first + node.count; ++index) {
+		const ItemSphere& sphere{ m_Spheres[index] };
+		const Vector3 extent{ sphere.radius, sphere.radius, sphere.radius };
+		Bin& bin{ bins[getBin(sphere)] };
+		GrowBox(bin.boundsMin, bin.boundsMax, sphere.center - extent, sphere.center + extent);
+		++bin.count;
+	}
+
+	std::array<float, BinCount - 1> leftCosts{};
+	Vector3 sweepMin{ FLT_MAX, FLT_MAX, FLT_MAX };
+	Vector3 sweepMax{ -FLT_MAX, -FLT_MAX, -FLT_MAX };
+	uint32_t sweepCount{ 0 };
+	for (int split{ 0 }; split < BinCount - 1; ++split) {
+		sweepCount += bins[split].count;
+		GrowBox(sweepMin, sweepMax, bins[split].boundsMin, bins[split].boundsMax);
+		leftCosts[split] = (sweepCount > 0) ? sweepCount * GetBoxArea(sweepMin, sweepMax) : 0.0f;
+	}
+
+	int bestSplit{ -1 };
+	float bestCost{ FLT_MAX };
+	sweepMin = { FLT_MAX, FLT_MAX, FLT_MAX };
+	sweepMax = { -FLT_MAX, -FLT_MAX, -FLT_MAX };
+	sweepCount = 0;
+	for (int split{ BinCount - 2 }; split >= 0; --split) {
+		sweepCount += bins[split + 1].count;
+		GrowBox(sweepMin, sweepMax, bins[split + 1].boundsMin, bins[split + 1].boundsMax);
+		const float cost{ leftCosts[split] + ((sweepCount > 0) ? sweepCount * GetBoxArea(sweepMin, sweepMax) : 0.0f) };
+		if (cost < bestCost) {
+			bestCost = cost;
+			bestSplit = split;
+		}
+	}
+
+	// Small nodes stay a leaf when no split is cheaper than testing all their items
+	if (bestCost >= node.count * GetBoxArea(node.boundsMin, node.boundsMax) && node.count <= 4 * MaxLeafSize) {
+		return;
+	}
+
+	// Partition the items and their spheres together
+	uint32_t left{ node.first };
+	uint32_t right{ node.first + node.count };
+	while (left < right) {
+		if (getBin(m_Spheres[left]) <= bestSplit) {
+			++left;
+		}
+		else {
+			--right;
+			std::swap(m_Spheres[left], m_Spheres[right]);
+			std::swap(m_Items[left], m_Items[right]);
+		}
+	}
+
+	const uint32_t leftCount{ left - node.first };
+	if (leftCount == 0 || leftCount == node.count) {
+		return;
+	}
+
+	const uint32_t childIndex{ uint32_t(m_Nodes.size()) };
+	m_Nodes.push_back({ {}, {}, node.first, leftCount });
+	m_Nodes.push_back({ {}, {}, left, node.count - leftCount });
+	node.first = childIndex;
+	node.count = 0;
+
+	UpdateNodeBounds(m_Nodes[childIndex]);
+	UpdateNodeBounds(m_Nodes[childIndex + 1]);
+	Subdivide(childIndex, depth + 1);
+	Subdivide(childIndex + 1, depth + 1);
+}
+
+void BVH::Refit(const std::vector<Vector3>& centers, const std::vector<float>& radii) {
+
+	assert(centers.size() == m_Items.size() && "Refit needs the items the tree was built with");
+
+	for (size_t index{ 0 }; index < m_Items.size(); ++index) {
+		m_Spheres[index] = { centers[m_Items[index]], radii[m_Items[index]] };
+	}
+
+	// Children always come after their parent, so walking backwards updates them first
+	for (size_t nodeIndex{ m_Nodes.size() }; nodeIndex-- > 0;) {
+		UpdateNodeBounds(m_Nodes[nodeIndex]);
+	}
+
+	m_SurfaceArea = GetSurfaceArea();
+}
+
+void BVH::UpdateNodeBounds(Node& node) const {
+
+	node.boundsMin = { FLT_MAX, FLT_MAX, FLT_MAX };
+	node.boundsMax = { -FLT_MAX, -FLT_MAX, -FLT_MAX };
+
+	if (node.count == 0) {
+		for (uint32_t child{ node.first }; child < node.first + 2; ++child) {
+			GrowBox(node.boundsMin, node.boundsMax, m_Nodes[child].boundsMin, m_Nodes[child].boundsMax);
+		}
+		return;
+	}
+
+	for (uint32_t index{ node.first }; index < node.first + node.count; ++index) {
+		const ItemSphere& sphere{ m_Spheres[index] };
+		const Vector3 extent{ sphere.radius, sphere.radius, sphere.radius };
+		GrowBox(node.boundsMin, node.boundsMax, sphere.center - extent, sphere.center + extent);
+	}
+}
+
+float BVH::GetSurfaceArea() const {
+	float surfaceArea{ 0.0f };
+	for (const Node& node : m_Nodes) {
+		surfaceArea += GetBoxArea(node.boundsMin, node.boundsMax);
+	}
+	return surfaceArea;
+}
+
+BVH::Containment BVH::ClassifyFrustum(const Camera& camera, const Vector3& center, float radius) {
+
+	const Vector3 viewCenter{ camera.viewMatrix.TransformPoint(center) };
+	if (camera.IsSphereOutsideFrustum(viewCenter, radius)) {
+		return Containment::outside;
+	}
+	return camera.IsSphereInsideFrustum(viewCenter, radius) ? Containment::inside : Containment::partial;
+}
+
+void BVH::RunBenchmark(const Camera& camera) {
+
+	// Average milliseconds per call over a few repetitions
+	const auto measure{ [](int repetitions, const auto& function) {
+		const uint64_t start{ SDL_GetPerformanceCounter() };
+		for (int repetition{ 0 }; repetition < repetitions; ++repetition) {
+			function();
+		}
+		return 1000.0f * float(SDL_GetPerformanceCounter() - start) / SDL_GetPerformanceFrequency() / repetitions;
+	} };
+
+	std::cout << "BVH benchmark, milliseconds per call\n";
+	for (uint32_t itemCount : { 1000u, 10000u, 100000u }) {
+
+		// Spheres spread through a cube around the camera reaching past the far plane
+		std::mt19937 generator{ itemCount };
+		std::uniform_real_distribution<float> position{ -camera.zFar, camera.zFar };
+		std::uniform_real_distribution<float> size{ 0.5f, 2.0f };
+		std::uniform_real_distribution<float> jitter{ -0.5f, 0.5f };
+
+		std::vector<Vector3> centers(itemCount);
+		std::vector<float> radii(itemCount);
+		for (uint32_t item{ 0 }; item < itemCount; ++item) {
+			centers[item] = camera.origin + Vector3{ position(generator), position(generator), position(generator) };
+			radii[item] = size(generator);
+		}
+
+		BVH bvh{};
+		const float buildTime{ measure(5, [&]() { bvh.Build(centers, radii); }) };
+
+		// Every item moves a little before the refit
+		for (Vector3& center : centers) {
+			center += Vector3{ jitter(generator), jitter(generator), jitter(generator) };
+		}
+		const float refitTime{ measure(10, [&]() { bvh.Refit(centers, radii); }) };
+
+		uint32_t visibleCount{ 0 };
+		const float queryTime{ measure(20, [&]() {
+			visibleCount = 0;
+			bvh.Query([&camera](const Vector3& center, float radius) { return ClassifyFrustum(camera, center, radius); },
+				[&visibleCount](uint32_t) { ++visibleCount; });
+		}) };
+
+		uint32_t bruteForceCount{ 0 };
+		const float bruteForceTime{ measure(20, [&]() {
+			bruteForceCount = 0;
+			for (uint32_t item{ 0 }; item < itemCount; ++item) {
+				if (!camera.IsSphereOutsideFrustum(camera.viewMatrix.TransformPoint(centers[item]), radii[item])) {
+					++bruteForceCount;
+				}
+			}
+		}) };
+
+		std::cout << itemCount << " objects: build " << buildTime << ", refit " << refitTime << " (" << bvh.GetNodeCount() << " nodes), query "
+			<< queryTime << " (" << visibleCount << " visible), every object " << bruteForceTime << " (" << bruteForceCount << " visible)\n";
+	}
+}
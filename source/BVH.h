@@ -0,0 +1,119 @@
+#pragma once
+#include <vector>
+#include "Math.h"
+
+using namespace dae;
+
+struct Camera;
+
+// Bounding volume hierarchy over spheres, built with a binned surface area heuristic.
+// Moving items are handled by refitting the boxes in place, the tree is rebuilt once refitting has loosened it too much.
+class BVH final
+{
+public:
+	static constexpr uint32_t MaxLeafSize{ 4 };
+	static constexpr int BinCount{ 12 };
+
+	// Deeper nodes become leaves whatever their size, keeps the query stack bounded
+	static constexpr int MaxDepth{ 48 };
+
+	// Surface area of all boxes after a refit relative to right after the build
+	static constexpr float RebuildThreshold{ 1.5f };
+
+	// Result of a node or item test, inside accepts the whole subtree without testing it further
+	enum class Containment
+	{
+		outside,
+		partial,
+		inside
+	};
+
+	void Build(const std::vector<Vector3>& centers, const std::vector<float>& radii);
+	void Refit(const std::vector<Vector3>& centers, const std::vector<float>& radii);
+	bool NeedsRebuild() const { return m_SurfaceArea > m_BuiltSurfaceArea * RebuildThreshold; }
+
+	// Calls classify(center, radius) on the bounding sphere of every reached node and item, then visit(item) for the accepted items
+	template<typename Classify, typename Visit>
+	void Query(const Classify& classify, const Visit& visit) const;
+
+	uint32_t GetItemCount() const { return uint32_t(m_Items.size()); }
+	uint32_t GetNodeCount() const { return uint32_t(m_Nodes.size()); }
+
+	// Bounding sphere in world space against the camera's frustum
+	static Containment ClassifyFrustum(const Camera& camera, const Vector3& center, float radius);
+
+	// Times build, refit and frustum query against testing every item at a few scene sizes, printed to the console
+	static void RunBenchmark(const Camera& camera);
+
+private:
+	// Children of an inner node are stored next to each other after their parent, a leaf holds a range of m_Items
+	struct Node
+	{
+		Vector3 boundsMin{};
+		Vector3 boundsMax{};
+		uint32_t first{};
+		uint32_t count{};
+	};
+
+	// Item spheres in leaf order, so a leaf reads one contiguous range
+	struct ItemSphere
+	{
+		Vector3 center{};
+		float radius{};
+	};
+
+	void Subdivide(uint32_t nodeIndex, int depth);
+	void UpdateNodeBounds(Node& node) const;
+	float GetSurfaceArea() const;
+
+	std::vector<Node> m_Nodes{};
+	std::vector<uint32_t> m_Items{};
+	std::vector<ItemSphere> m_Spheres{};
+	float m_BuiltSurfaceArea{};
+	float m_SurfaceArea{};
+};
+
+template<typename Classify, typename Visit>
+void BVH::Query(const Classify& classify, const Visit& visit) const {
+
+	if (m_Nodes.empty()) {
+		return;
+	}
+
+	// Nodes waiting to be visited with whether an ancestor was already fully accepted
+	struct Entry
+	{
+		uint32_t node;
+		bool isAccepted;
+	};
+	Entry stack[64]{};
+	int stackSize{ 0 };
+	stack[stackSize++] = { 0, false };
+
+	while (stackSize > 0) {
+		const Entry entry{ stack[--stackSize] };
+		const Node& node{ m_Nodes[entry.node] };
+
+		bool isAccepted{ entry.isAccepted };
+		if (!isAccepted) {
+			const Vector3 center{ (node.boundsMin + node.boundsMax) * 0.5f };
+			const Containment containment{ classify(center, Vector3{ node.boundsMin, node.boundsMax }.Magnitude() * 0.5f) };
+			if (containment == Containment::outside) {
+				continue;
+			}
+			isAccepted = containment == Containment::inside;
+		}
+
+		if (node.count == 0) {
+			stack[stackSize++] = { node.first + 1, isAccepted };
+			stack[stackSize++] = { node.first, isAccepted };
+			continue;
+		}
+
+		for (uint32_t index{ node.first }; index < node.first + node.count; ++index) {
+			if (isAccepted || classify(m_Spheres[index].center, m_Spheres[index].radius) != Containment::outside) {
+				visit(m_Items[index]);
+			}
+		}
+	}
+}
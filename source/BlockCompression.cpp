@@ -0,0 +1,436 @@
+#include "pch.h"
+#include "BlockCompression.h"
+#include <cstring>
+
+namespace dae
+{
+	namespace BlockCompression
+	{
+		constexpr int TexelsPerBlock{ BlockSize * BlockSize };
+
+		// Endpoint weights in sixths for each 2 bit colour index, four colour blocks and three colour blocks with black
+		constexpr int FourColorWeights[4][2]{ { 6, 0 }, { 0, 6 }, { 4, 2 }, { 2, 4 } };
+		constexpr int ThreeColorWeights[4][2]{ { 6, 0 }, { 0, 6 }, { 3, 3 }, { 0, 0 } };
+
+		// The decoder's weight pairs packed the way _mm_madd_epi16 takes them, the low half scales endpoint 0.
+		// Colour blocks in sixths, three colour blocks first. Channel blocks in fifths for six value blocks, whose fixed extremes
+		// at index 6 and 7 reuse the weights of 0 and 1, and in sevenths for eight value blocks.
+		constexpr int PackedColorWeights[2][4]{ { 6, 6 << 16, 3 | (3 << 16), 0 }, { 6, 6 << 16, 4 | (2 << 16), 2 | (4 << 16) } };
+		constexpr int PackedChannelWeights[2][8]{
+			{ 5, 5 << 16, 4 | (1 << 16), 3 | (2 << 16), 2 | (3 << 16), 1 | (4 << 16), 5, 5 << 16 },
+			{ 7, 7 << 16, 6 | (1 << 16), 5 | (2 << 16), 4 | (3 << 16), 3 | (4 << 16), 2 | (5 << 16), 1 | (6 << 16) } };
+		constexpr float ChannelReciprocals[2]{ 1.0f / 5.0f, 1.0f / 7.0f };
+
+		// Rounds to nearest for either sign, the signed channels interpolate negative values
+		int DivideRounded(int numerator, int denominator) {
+			return (numerator >= 0) ? (numerator + denominator / 2) / denominator : -((-numerator + denominator / 2) / denominator);
+		}
+
+		uint16_t ReadUInt16(const uint8_t* pBytes) {
+			return uint16_t(pBytes[0] | (pBytes[1] << 8));
+		}
+
+		// R5G6B5 to R8G8B8A8, opaque, the top bits are repeated into the new low bits
+		uint32_t ExpandColor(uint16_t color) {
+			const uint32_t red{ (color >> 11) & 0x1F };
+			const uint32_t green{ (color >> 5) & 0x3F };
+			const uint32_t blue{ color & 0x1F };
+			return ((red << 3) | (red >> 2)) | (((green << 2) | (green >> 4)) << 8) | (((blue << 3) | (blue >> 2)) << 16) | 0xFF000000;
+		}
+
+		uint16_t QuantizeColor(const float* pColor) {
+			const auto quantize{ [](float value, int maximum) { return uint16_t(Clamp(int(value * maximum / 255.0f + 0.5f), 0, maximum)); } };
+			return uint16_t((quantize(pColor[0], 31) << 11) | (quantize(pColor[1], 63) << 5) | quantize(pColor[2], 31));
+		}
+
+		// The decoder's palette, so the encoder measures the colours that will come out
+		void BuildColorPalette(uint16_t color0, uint16_t color1, bool isFourColor, uint32_t* pPalette) {
+			const uint32_t endpoint0{ ExpandColor(color0) };
+			const uint32_t endpoint1{ ExpandColor(color1) };
+			const auto& weights{ isFourColor ? FourColorWeights : ThreeColorWeights };
+
+			for (int index{ 0 }; index < 4; ++index) {
+				uint32_t color{ 0 };
+				for (int shift{ 0 }; shift < 32; shift += 8) {
+					const int sum{ int((endpoint0 >> shift) & 0xFF) * weights[index][0] + int((endpoint1 >> shift) & 0xFF) * weights[index][1] };
+					color |= uint32_t((sum + 3) / 6) << shift;
+				}
+				pPalette[index] = color;
+			}
+		}
+
+		int GetColorDistance(uint32_t color0, uint32_t color1) {
+			int distance{ 0 };
+			for (int shift{ 0 }; shift < 24; shift += 8) {
+				const int difference{ int((color0 >> shift) & 0xFF) - int((color1 >> shift) & 0xFF) };
+				distance += difference * difference;
+			}
+			return distance;
+		}
+
+		// Nearest palette entry per texel, returns the summed squared error
+		int ChooseColorIndices(const uint32_t* pTexels, const uint32_t* pPalette, uint32_t& indices) {
+			indices = 0;
+			int error{ 0 };
+			for (int texel{ 0 }; texel < TexelsPerBlock; ++texel) {
+				int bestIndex{ 0 };
+				int bestDistance{ INT_MAX };
+				for (int index{ 0 }; index < 4; ++index) {
+					const int distance{ GetColorDistance(pTexels[texel], pPalette[index]) };
+					if (distance < bestDistance) {
+						bestDistance = distance;
+						bestIndex = index;
+					}
+				}
+				indices |= uint32_t(bestIndex) << (2 * texel);
+				error += bestDistance;
+			}
+			return error;
+		}
+
+		// Always a four colour block, equal endpoints only use index 0 so they decode the same in BC1 and BC3
+		int WriteColorBlock(const uint32_t* pTexels, uint16_t color0, uint16_t color1, uint8_t* pBlock) {
+			if (color0 < color1) {
+				std::swap(color0, color1);
+			}
+
+			uint32_t indices{ 0 };
+			int error{ 0 };
+			uint32_t palette[4]{};
+			BuildColorPalette(color0, color1, true, palette);
+			if (color0 == color1) {
+				for (int texel{ 0 }; texel < TexelsPerBlock; ++texel) {
+					error += GetColorDistance(pTexels[texel], palette[0]);
+				}
+			}
+			else {
+				error = ChooseColorIndices(pTexels, palette, indices);
+			}
+
+			pBlock[0] = uint8_t(color0);
+			pBlock[1] = uint8_t(color0 >> 8);
+			pBlock[2] = uint8_t(color1);
+			pBlock[3] = uint8_t(color1 >> 8);
+			std::memcpy(pBlock + 4, &indices, sizeof(indices));
+			return error;
+		}
+
+		void EncodeColorBlock(const uint32_t* pTexels, uint8_t* pBlock) {
+
+			float colors[TexelsPerBlock][3]{};
+			float mean[3]{};
+			for (int texel{ 0 }; texel < TexelsPerBlock; ++texel) {
+				for (int channel{ 0 }; channel < 3; ++channel) {
+					colors[texel][channel] = float((pTexels[texel] >> (8 * channel)) & 0xFF);
+					mean[channel] += colors[texel][channel] / TexelsPerBlock;
+				}
+			}
+
+			// Principal axis of the colours by power iteration on their covariance
+			float covariance[3][3]{};
+			for (int texel{ 0 }; texel < TexelsPerBlock; ++texel) {
+				for (int row{ 0 }; row < 3; ++row) {
+					for (int column{ 0 }; column < 3; ++column) {
+						covariance[row][column] += (colors[texel][row] - mean[row]) * (colors[texel][column] - mean[column]);
+					}
+				}
+			}
+
+			float axis[3]{ 1.0f, 1.0f, 1.0f };
+			for (int iteration{ 0 }; iteration < 8; ++iteration) {
+				float next[3]{};
+				for (int row{ 0 }; row < 3; ++row) {
+					next[row] = covariance[row][0] * axis[0] + covariance[row][1] * axis[1] + covariance[row][2] * axis[2];
+				}
+				const float length{ sqrtf(next[0] * next[0] + next[1] * next[1] + next[2] * next[2]) };
+				if (length < 1e-6f) {
+					break;
+				}
+				for (int channel{ 0 }; channel < 3; ++channel) {
+					axis[channel] = next[channel] / length;
+				}
+			}
+
+			// The extreme projections on the axis become the endpoints
+			float minProjection{ FLT_MAX };
+			float maxProjection{ -FLT_MAX };
+			for (int texel{ 0 }; texel < TexelsPerBlock; ++texel) {
+				float projection{ 0.0f };
+				for (int channel{ 0 }; channel < 3; ++channel) {
+					projection += (colors[texel][channel] - mean[channel]) * axis[channel];
+				}
+				minProjection = std::min(minProjection, projection);
+				maxProjection = std::max(maxProjection, projection);
+			}
+
+			float endpoint0[3]{}, endpoint1[3]{};
+			for (int channel{ 0 }; channel < 3; ++channel) {
+				endpoint0[channel] = mean[channel] + axis[channel] * maxProjection;
+				endpoint1[channel] = mean[channel] + axis[channel] * minProjection;
+			}
+			int error{ WriteColorBlock(pTexels, QuantizeColor(endpoint0), QuantizeColor(endpoint1), pBlock) };
+			if (error == 0) {
+				return;
+			}
+
+			// One least squares pass fits the endpoints to the chosen indices, kept when it lowers the error
+			uint32_t indices{};
+			std::memcpy(&indices, pBlock + 4, sizeof(indices));
+			float sumAA{}, sumAB{}, sumBB{};
+			float sumAX[3]{}, sumBX[3]{};
+			for (int texel{ 0 }; texel < TexelsPerBlock; ++texel) {
+				const int index{ int((indices >> (2 * texel)) & 3) };
+				const float a{ FourColorWeights[index][0] / 6.0f };
+				const float b{ 1.0f - a };
+				sumAA += a * a;
+				sumAB += a * b;
+				sumBB += b * b;
+				for (int channel{ 0 }; channel < 3; ++channel) {
+					sumAX[channel] += a * colors[texel][channel];
+					sumBX[channel] += b * colors[texel][channel];
+				}
+			}
+
+			const float determinant{ sumAA * sumBB - sumAB * sumAB };
+			if (std::abs(determinant) < 1e-6f) {
+				return;
+			}
+			for (int channel{ 0 }; channel < 3; ++channel) {
+				endpoint0[channel] = (sumAX[channel] * sumBB - sumBX[channel] * sumAB) / determinant;
+				endpoint1[channel] = (sumBX[channel] * sumAA - sumAX[channel] * sumAB) / determinant;
+			}
+
+			uint8_t refined[8]{};
+			if (WriteColorBlock(pTexels, QuantizeColor(endpoint0), QuantizeColor(endpoint1), refined) < error) {
+				std::memcpy(pBlock, refined, sizeof(refined));
+			}
+		}
+
+		// Single channel block with eight interpolated values, signed values end up as two's complement bytes
+		void EncodeChannelBlock(const int* pValues, uint8_t* pBlock) {
+
+			int minValue{ INT_MAX };
+			int maxValue{ INT_MIN };
+			for (int texel{ 0 }; texel < TexelsPerBlock; ++texel) {
+				minValue = std::min(minValue, pValues[texel]);
+				maxValue = std::max(maxValue, pValues[texel]);
+			}
+
+			pBlock[0] = uint8_t(maxValue);
+			pBlock[1] = uint8_t(minValue);
+
+			uint64_t indices{ 0 };
+			if (maxValue > minValue) {
+				int palette[8]{ maxValue, minValue };
+				for (int index{ 2 }; index < 8; ++index) {
+					palette[index] = DivideRounded((8 - index) * maxValue + (index - 1) * minValue, 7);
+				}
+
+				for (int texel{ 0 }; texel < TexelsPerBlock; ++texel) {
+					int bestIndex{ 0 };
+					for (int index{ 1 }; index < 8; ++index) {
+						if (std::abs(pValues[texel] - palette[index]) < std::abs(pValues[texel] - palette[bestIndex])) {
+							bestIndex = index;
+						}
+					}
+					indices |= uint64_t(bestIndex) << (3 * texel);
+				}
+			}
+
+			for (int byte{ 0 }; byte < 6; ++byte) {
+				pBlock[2 + byte] = uint8_t(indices >> (8 * byte));
+			}
+		}
+
+		int DecodeChannel(const uint8_t* pBlock, bool isSigned, int texel) {
+
+			const int value0{ isSigned ? std::max(int(int8_t(pBlock[0])), -127) : int(pBlock[0]) };
+			const int value1{ isSigned ? std::max(int(int8_t(pBlock[1])), -127) : int(pBlock[1]) };
+
+			// Bit offset 3 * texel of the 48 index bits, at most two bytes are touched
+			const int bit{ 3 * texel };
+			const int index{ ((pBlock[2 + bit / 8] | ((bit % 8 > 5) ? pBlock[3 + bit / 8] << 8 : 0)) >> (bit % 8)) & 7 };
+
+			if (index < 2) {
+				return (index == 0) ? value0 : value1;
+			}
+			if (value0 > value1) {
+				return DivideRounded((8 - index) * value0 + (index - 1) * value1, 7);
+			}
+			if (index < 6) {
+				return DivideRounded((6 - index) * value0 + (index - 1) * value1, 5);
+			}
+			return (index == 6) ? (isSigned ? -127 : 0) : (isSigned ? 127 : 255);
+		}
+
+		uint32_t DecodeColor(const uint8_t* pBlock, bool isFourColor, int texel) {
+			const uint16_t color0{ ReadUInt16(pBlock) };
+			const uint16_t color1{ ReadUInt16(pBlock + 2) };
+			const int index{ (pBlock[4 + texel / 4] >> (2 * (texel % 4))) & 3 };
+			const auto& weights{ (isFourColor || color0 > color1) ? FourColorWeights : ThreeColorWeights };
+
+			const uint32_t endpoint0{ ExpandColor(color0) };
+			const uint32_t endpoint1{ ExpandColor(color1) };
+			uint32_t color{ 0 };
+			for (int shift{ 0 }; shift < 32; shift += 8) {
+				const int sum{ int((endpoint0 >> shift) & 0xFF) * weights[index][0] + int((endpoint1 >> shift) & 0xFF) * weights[index][1] };
+				color |= uint32_t((sum + 3) / 6) << shift;
+			}
+			return color;
+		}
+
+		uint32_t PackSignedPair(int x, int y) {
+			return uint32_t(uint8_t(int8_t(x))) | (uint32_t(uint8_t(int8_t(y))) << 8) | (127u << 24);
+		}
+
+		void EncodeBlock(TextureCompression compression, const uint32_t* pTexels, uint8_t* pBlock) {
+
+			int channels[2][TexelsPerBlock]{};
+			switch (compression) {
+				case TextureCompression::bc1:
+					EncodeColorBlock(pTexels, pBlock);
+					break;
+				case TextureCompression::bc3:
+					for (int texel{ 0 }; texel < TexelsPerBlock; ++texel) {
+						channels[0][texel] = int(pTexels[texel] >> 24);
+					}
+					EncodeChannelBlock(channels[0], pBlock);
+					EncodeColorBlock(pTexels, pBlock + 8);
+					break;
+				case TextureCompression::bc5:
+					for (int texel{ 0 }; texel < TexelsPerBlock; ++texel) {
+						channels[0][texel] = std::max(int(int8_t(pTexels[texel] & 0xFF)), -127);
+						channels[1][texel] = std::max(int(int8_t((pTexels[texel] >> 8) & 0xFF)), -127);
+					}
+					EncodeChannelBlock(channels[0], pBlock);
+					EncodeChannelBlock(channels[1], pBlock + 8);
+					break;
+				default:
+					break;
+			}
+		}
+
+		uint32_t DecodeTexel(TextureCompression compression, const uint8_t* pBlock, int x, int y) {
+			const int texel{ x + y * BlockSize };
+			switch (compression) {
+				case TextureCompression::bc1:
+					return DecodeColor(pBlock, false, texel);
+				case TextureCompression::bc3:
+					return (DecodeColor(pBlock + 8, true, texel) & 0x00FFFFFF) | (uint32_t(DecodeChannel(pBlock, false, texel)) << 24);
+				case TextureCompression::bc5:
+					return PackSignedPair(DecodeChannel(pBlock, true, texel), DecodeChannel(pBlock + 8, true, texel));
+				default:
+					return 0;
+			}
+		}
+
+		void DecodeBlock(TextureCompression compression, const uint8_t* pBlock, uint32_t* pTexels) {
+			for (int texel{ 0 }; texel < TexelsPerBlock; ++texel) {
+				pTexels[texel] = DecodeTexel(compression, pBlock, texel % BlockSize, texel / BlockSize);
+			}
+		}
+
+		// Endpoints and weights of one texel of a channel block as pairs for _mm_madd_epi16, with the divisor as a reciprocal.
+		// The six value blocks' fixed extremes become an endpoint pair, so every index is a weighted sum.
+		// Modes and indices are too random to predict, so the selects are left to conditional moves.
+		void GatherChannel(const uint8_t* pBlock, bool isSigned, int texel, int& endpoints, int& weights, float& reciprocal) {
+
+			uint64_t bits{};
+			std::memcpy(&bits, pBlock, sizeof(bits));
+			const int index{ int((bits >> (16 + 3 * texel)) & 7) };
+
+			int value0{ isSigned ? std::max(int(int8_t(bits)), -127) : int(uint8_t(bits)) };
+			int value1{ isSigned ? std::max(int(int8_t(bits >> 8)), -127) : int(uint8_t(bits >> 8)) };
+			const int isEightValue{ value0 > value1 };
+			const bool isExtreme{ !isEightValue && index >= 6 };
+			value0 = isExtreme ? (isSigned ? -127 : 0) : value0;
+			value1 = isExtreme ? (isSigned ? 127 : 255) : value1;
+
+			endpoints = int(uint16_t(value0) | (uint32_t(uint16_t(value1)) << 16));
+			weights = PackedChannelWeights[isEightValue][index];
+			reciprocal = ChannelReciprocals[isEightValue];
+		}
+
+		// Four gathered channel values as 32 bit lanes. Odd numerators never land halfway, so rounding the float is exact.
+		__m128i InterpolateChannels(const int* pEndpoints, const int* pWeights, const float* pReciprocals) {
+			const __m128i sums{ _mm_madd_epi16(_mm_setr_epi32(pEndpoints[0], pEndpoints[1], pEndpoints[2], pEndpoints[3]),
+				_mm_setr_epi32(pWeights[0], pWeights[1], pWeights[2], pWeights[3])) };
+			return _mm_cvtps_epi32(_mm_mul_ps(_mm_cvtepi32_ps(sums), _mm_setr_ps(pReciprocals[0], pReciprocals[1], pReciprocals[2], pReciprocals[3])));
+		}
+
+		__m128i DecodeFootprint(TextureCompression compression, const uint8_t* const* pBlocks, const int* pX, const int* pY) {
+
+			if (compression == TextureCompression::bc5) {
+				int endpoints[8]{};
+				int weights[8]{};
+				float reciprocals[8]{};
+				for (int texel{ 0 }; texel < 4; ++texel) {
+					const int index{ pX[texel] + pY[texel] * BlockSize };
+					for (int channel{ 0 }; channel < 2; ++channel) {
+						const int slot{ 2 * texel + channel };
+						GatherChannel(pBlocks[texel] + 8 * channel, true, index, endpoints[slot], weights[slot], reciprocals[slot]);
+					}
+				}
+
+				// x and y of each texel narrowed to signed bytes, then the zero and the full alpha PackSignedPair writes
+				const __m128i words{ _mm_packs_epi32(InterpolateChannels(endpoints, weights, reciprocals),
+					InterpolateChannels(endpoints + 4, weights + 4, reciprocals + 4)) };
+				return _mm_unpacklo_epi16(_mm_packs_epi16(words, words), _mm_set1_epi16(127 << 8));
+			}
+
+			// Each block's endpoint pair goes in one lane and each texel's weight pair in the matching lane, one multiply add per channel
+			const bool hasAlpha{ compression == TextureCompression::bc3 };
+			const int colorOffset{ hasAlpha ? 8 : 0 };
+			int endpoints[4]{};
+			int weights[4]{};
+			for (int texel{ 0 }; texel < 4; ++texel) {
+				uint64_t bits{};
+				std::memcpy(&bits, pBlocks[texel] + colorOffset, sizeof(bits));
+				const uint32_t colors{ uint32_t(bits) };
+				const int isFourColor{ hasAlpha || (colors & 0xFFFF) > (colors >> 16) };
+				const int index{ int((bits >> (32 + 2 * (pX[texel] + pY[texel] * BlockSize))) & 3) };
+
+				endpoints[texel] = int(colors);
+				weights[texel] = PackedColorWeights[isFourColor][index];
+			}
+
+			// R5G6B5 expanded in 16 bit lanes the same way as ExpandColor
+			const __m128i colors{ _mm_setr_epi32(endpoints[0], endpoints[1], endpoints[2], endpoints[3]) };
+			const __m128i pairWeights{ _mm_setr_epi32(weights[0], weights[1], weights[2], weights[3]) };
+			const __m128i red{ _mm_srli_epi16(colors, 11) };
+			const __m128i green{ _mm_and_si128(_mm_srli_epi16(colors, 5), _mm_set1_epi16(0x3F)) };
+			const __m128i blue{ _mm_and_si128(colors, _mm_set1_epi16(0x1F)) };
+
+			const __m128i rounding{ _mm_set1_epi32(3) };
+			const __m128i divideBySix{ _mm_set1_epi32(10923) };
+			const auto interpolate{ [&](__m128i channel) {
+				return _mm_mulhi_epu16(_mm_add_epi32(_mm_madd_epi16(channel, pairWeights), rounding), divideBySix);
+			} };
+
+			__m128i texels{ interpolate(_mm_or_si128(_mm_slli_epi16(red, 3), _mm_srli_epi16(red, 2))) };
+			texels = _mm_or_si128(texels, _mm_slli_epi32(interpolate(_mm_or_si128(_mm_slli_epi16(green, 2), _mm_srli_epi16(green, 4))), 8));
+			texels = _mm_or_si128(texels, _mm_slli_epi32(interpolate(_mm_or_si128(_mm_slli_epi16(blue, 3), _mm_srli_epi16(blue, 2))), 16));
+
+			if (!hasAlpha) {
+				return _mm_or_si128(texels, _mm_set1_epi32(int(0xFF000000)));
+			}
+
+			int alphaEndpoints[4]{};
+			int alphaWeights[4]{};
+			float reciprocals[4]{};
+			for (int texel{ 0 }; texel < 4; ++texel) {
+				GatherChannel(pBlocks[texel], false, pX[texel] + pY[texel] * BlockSize, alphaEndpoints[texel], alphaWeights[texel], reciprocals[texel]);
+			}
+			return _mm_or_si128(texels, _mm_slli_epi32(InterpolateChannels(alphaEndpoints, alphaWeights, reciprocals), 24));
+		}
+
+		void EncodeBC3FromBC1(const uint8_t* pBC1Block, const uint8_t* pAlphas, uint8_t* pBC3Block) {
+			int alphas[TexelsPerBlock]{};
+			for (int texel{ 0 }; texel < TexelsPerBlock; ++texel) {
+				alphas[texel] = pAlphas[texel];
+			}
+			EncodeChannelBlock(alphas, pBC3Block);
+			std::memcpy(pBC3Block + 8, pBC1Block, 8);
+		}
+	}
+}
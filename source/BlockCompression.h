@@ -0,0 +1,33 @@
+#pragma once
+#include <emmintrin.h>
+#include "DataTypes.h"
+
+namespace dae
+{
+	// 4x4 texel blocks in the BC formats the hardware samples natively, so one copy of the blocks serves both render paths.
+	// Texels go in and out as R8G8B8A8 with red in the lowest byte, BC5 reads and writes signed bytes like the normal maps.
+	namespace BlockCompression
+	{
+		constexpr int BlockSize{ 4 };
+
+		// Bytes per block, BC1 packs a texel in 4 bits and the others in 8
+		constexpr int GetBlockBytes(TextureCompression compression) {
+			return (compression == TextureCompression::bc1) ? 8 : 16;
+		}
+
+		// Texels in row major order, 16 in and one block out
+		void EncodeBlock(TextureCompression compression, const uint32_t* pTexels, uint8_t* pBlock);
+		void DecodeBlock(TextureCompression compression, const uint8_t* pBlock, uint32_t* pTexels);
+
+		// Single texel at x, y inside the block
+		uint32_t DecodeTexel(TextureCompression compression, const uint8_t* pBlock, int x, int y);
+
+		// Bilinear footprint, one texel from each block in pBlocks at the matching x, y, in one register of four texels.
+		// BC1 and BC3 colours are interpolated for all four texels at once.
+		__m128i DecodeFootprint(TextureCompression compression, const uint8_t* const* pBlocks, const int* pX, const int* pY);
+
+		// Copies the colour half of BC1 blocks into BC3 blocks and encodes the given alpha values next to it.
+		// The BC1 blocks have to be four colour blocks, which are the only ones EncodeBlock writes.
+		void EncodeBC3FromBC1(const uint8_t* pBC1Block, const uint8_t* pAlphas, uint8_t* pBC3Block);
+	}
+}
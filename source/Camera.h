@@ -37,6 +37,9 @@ struct Camera
 	Matrix viewMatrix{};
 	Matrix projectionMatrix{};
 
+	// Set when the last Update moved or turned the camera
+	bool hasChanged{ true };
+
 	const float movementSpeed{ 15 };
 	const float rotationSpeed{ 10 * TO_RADIANS };
 
@@ -49,6 +52,7 @@ struct Camera
 		aspectRatio = _aspectRatio;
 
 		CalculateProjectionMatrix();
+		hasChanged = true;
 	}
 
 	void CalculateViewMatrix()
@@ -66,10 +70,36 @@ struct Camera
 		projectionMatrix = Matrix::CreatePerspectiveFovLH(fov, aspectRatio, zNear, zFar);
 	}
 
+	// Bounding sphere in view space against the side planes through the eye, then the near and far planes
+	bool IsSphereOutsideFrustum(const Vector3& viewCenter, float radius) const
+	{
+		const float tanX{ fov * aspectRatio };
+		const float tanY{ fov };
+		const float sideX{ (abs(viewCenter.x) - viewCenter.z * tanX) / sqrtf(1 + tanX * tanX) };
+		const float sideY{ (abs(viewCenter.y) - viewCenter.z * tanY) / sqrtf(1 + tanY * tanY) };
+
+		return sideX > radius || sideY > radius || viewCenter.z + radius < zNear || viewCenter.z - radius > zFar;
+	}
+
+	// Same planes, true when the whole sphere lies on the inner side of all of them
+	bool IsSphereInsideFrustum(const Vector3& viewCenter, float radius) const
+	{
+		const float tanX{ fov * aspectRatio };
+		const float tanY{ fov };
+		const float sideX{ (abs(viewCenter.x) - viewCenter.z * tanX) / sqrtf(1 + tanX * tanX) };
+		const float sideY{ (abs(viewCenter.y) - viewCenter.z * tanY) / sqrtf(1 + tanY * tanY) };
+
+		return sideX < -radius && sideY < -radius && viewCenter.z - radius > zNear && viewCenter.z + radius < zFar;
+	}
+
 	void Update(const Timer* pTimer)
 	{
 		const float deltaTime = pTimer->GetElapsed();
 
+		const Vector3 previousOrigin{ origin };
+		const float previousPitch{ totalPitch };
+		const float previousYaw{ totalYaw };
+
 		//Keyboard Input
 		const uint8_t* pKeyboardState = SDL_GetKeyboardState(nullptr);
 
@@ -120,6 +150,9 @@ struct Camera
 
 		//Update Matrices
 		CalculateViewMatrix();
+
+		hasChanged = origin.x != previousOrigin.x || origin.y != previousOrigin.y || origin.z != previousOrigin.z
+			|| totalPitch != previousPitch || totalYaw != previousYaw;
 	}
 };
 
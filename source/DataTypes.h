@@ -11,6 +11,11 @@ struct Vertex_Out
 	Vector3 normal{};
 	Vector3 tangent{};
 	Vector3 viewDirection{};
+	Vector3 worldPosition{};
+
+	// Screen space derivatives of uv, set per fragment to pick the mip level
+	Vector2 uvDdx{};
+	Vector2 uvDdy{};
 };
 
 struct VertexUV {
@@ -22,6 +27,24 @@ struct VertexUV {
 
 enum class PrimitiveTopology { TriangleList, TriangleStrip };
 enum class Filtering { point, linear, anisotropic };
+enum class TexelFormat { color, normal };
+enum class TextureCompression { none, bc1, bc3, bc5 };
 enum class RenderMode { software, hardware };
 enum class CullMode{ back, front, none};
 enum class ShadingMode { observerdArea, diffuse, specular, combined };
+enum class ShadingRate { rate1x1, rate1x2, rate2x2, rate4x4 };
+enum class LightType { directional, point, spot };
+
+struct Light
+{
+	LightType type{ LightType::directional };
+	Vector3 position{};
+	Vector3 direction{ 0.577f, -0.577f, 0.577f };
+	ColorRGB color{ 1.0f, 1.0f, 1.0f };
+	float intensity{ 7.0f };
+
+	// Point and spot lights fade out at range, spot lights also between the inner and outer cone
+	float range{ 10.0f };
+	float cosInnerCone{ 0.95f };
+	float cosOuterCone{ 0.85f };
+};
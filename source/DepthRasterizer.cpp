@@ -0,0 +1,127 @@
+#include "pch.h"
+#include <emmintrin.h>
+#include "DepthRasterizer.h"
+
+void DepthRasterizer::Resize(int width, int height) {
+	m_Width = width;
+	m_Height = height;
+	m_Stride = (width + 3) & ~3;
+	m_Depths.resize(size_t(m_Stride) * height);
+}
+
+void DepthRasterizer::Clear(float depth) {
+	std::fill(m_Depths.begin(), m_Depths.end(), depth);
+	m_TriangleCount = 0;
+}
+
+void DepthRasterizer::RasterizeMesh(const std::vector<VertexUV>& vertices, const std::vector<uint32_t>& indices, uint32_t indexOffset, uint32_t indexCount,
+	PrimitiveTopology topology, const Matrix& WVPMatrix) {
+
+	// Transform every vertex once, the index buffer shares them between triangles
+	m_ScreenVertices.resize(vertices.size());
+	for (size_t index{ 0 }; index < vertices.size(); ++index) {
+		Vector4 position{ WVPMatrix.TransformPoint(Vector4{ vertices[index].position.x, vertices[index].position.y, vertices[index].position.z, 1.0f }) };
+
+		if (position.w <= 0.0f) {
+			m_ScreenVertices[index].w = -1.0f;
+			continue;
+		}
+
+		position.x /= position.w;
+		position.y /= position.w;
+		position.z /= position.w;
+
+		m_ScreenVertices[index] = {
+			(position.x + 1) * m_Width / 2,
+			(-position.y + 1) * m_Height / 2,
+			position.z,
+			(position.z < 0.0f || position.z > 1.0f) ? -1.0f : 1.0f
+		};
+	}
+
+	const uint32_t indexEnd{ indexOffset + indexCount };
+	const uint32_t step{ (topology == PrimitiveTopology::TriangleList) ? 3u : 1u };
+	for (uint32_t index{ indexOffset }; index + 2 < indexEnd; index += step) {
+
+		const uint32_t index0{ indices[index] }, index1{ indices[index + 1] }, index2{ indices[index + 2] };
+		if (index0 == index1 || index1 == index2 || index2 == index0) {
+			continue;
+		}
+
+		const Vector4& v0{ m_ScreenVertices[index0] };
+		const Vector4& v1{ m_ScreenVertices[index1] };
+		const Vector4& v2{ m_ScreenVertices[index2] };
+		if (v0.w < 0.0f || v1.w < 0.0f || v2.w < 0.0f) {
+			continue;
+		}
+
+		// Both faces are drawn, so the strip's alternating winding doesn't matter
+		RasterizeTriangle(Vector3{ v0.x, v0.y, v0.z }, Vector3{ v1.x, v1.y, v1.z }, Vector3{ v2.x, v2.y, v2.z });
+	}
+}
+
+void DepthRasterizer::RasterizeTriangle(const Vector3& v0, const Vector3& v1, const Vector3& v2) {
+
+	// Edge functions as A * x + B * y + C, positive inside
+	float area{ (v1.x - v0.x) * (v2.y - v0.y) - (v1.y - v0.y) * (v2.x - v0.x) };
+	if (area == 0.0f) {
+		return;
+	}
+
+	const float sign{ (area > 0.0f) ? 1.0f : -1.0f };
+	area *= sign;
+
+	const float A0{ sign * (v1.y - v2.y) }, B0{ sign * (v2.x - v1.x) }, C0{ sign * (v1.x * v2.y - v1.y * v2.x) };
+	const float A1{ sign * (v2.y - v0.y) }, B1{ sign * (v0.x - v2.x) }, C1{ sign * (v2.x * v0.y - v2.y * v0.x) };
+	const float A2{ sign * (v0.y - v1.y) }, B2{ sign * (v1.x - v0.x) }, C2{ sign * (v0.x * v1.y - v0.y * v1.x) };
+
+	// Depth is affine in screen space after the perspective divide, a plane through the three vertices
+	const float inverseArea{ 1.0f / area };
+	const float depthA{ (A0 * v0.z + A1 * v1.z + A2 * v2.z) * inverseArea };
+	const float depthB{ (B0 * v0.z + B1 * v1.z + B2 * v2.z) * inverseArea };
+	const float depthC{ (C0 * v0.z + C1 * v1.z + C2 * v2.z) * inverseArea };
+
+	// Bounding box, starting on a multiple of four so every group of pixels is a whole SSE register
+	const int minX{ std::max(int(std::min({ v0.x, v1.x, v2.x })), 0) & ~3 };
+	const int maxX{ std::min(int(std::max({ v0.x, v1.x, v2.x })), m_Width - 1) };
+	const int minY{ std::max(int(std::min({ v0.y, v1.y, v2.y })), 0) };
+	const int maxY{ std::min(int(std::max({ v0.y, v1.y, v2.y })), m_Height - 1) };
+	if (minX > maxX || minY > maxY) {
+		return;
+	}
+
+	++m_TriangleCount;
+
+	const __m128 zero{ _mm_setzero_ps() };
+	const __m128 laneOffsets{ _mm_setr_ps(0.5f, 1.5f, 2.5f, 3.5f) };
+	const __m128 edgeA0{ _mm_set1_ps(A0) }, edgeA1{ _mm_set1_ps(A1) }, edgeA2{ _mm_set1_ps(A2) };
+	const __m128 planeA{ _mm_set1_ps(depthA) };
+
+	for (int py{ minY }; py <= maxY; ++py) {
+		const float centerY{ py + 0.5f };
+		const __m128 rowE0{ _mm_set1_ps(B0 * centerY + C0) };
+		const __m128 rowE1{ _mm_set1_ps(B1 * centerY + C1) };
+		const __m128 rowE2{ _mm_set1_ps(B2 * centerY + C2) };
+		const __m128 rowDepth{ _mm_set1_ps(depthB * centerY + depthC) };
+
+		float* pRow{ &m_Depths[size_t(py) * m_Stride] };
+		for (int px{ minX }; px <= maxX; px += 4) {
+			const __m128 centerX{ _mm_add_ps(_mm_set1_ps(float(px)), laneOffsets) };
+
+			// Coverage of the four pixels
+			const __m128 e0{ _mm_add_ps(_mm_mul_ps(edgeA0, centerX), rowE0) };
+			const __m128 e1{ _mm_add_ps(_mm_mul_ps(edgeA1, centerX), rowE1) };
+			const __m128 e2{ _mm_add_ps(_mm_mul_ps(edgeA2, centerX), rowE2) };
+			const __m128 inside{ _mm_and_ps(_mm_and_ps(_mm_cmpge_ps(e0, zero), _mm_cmpge_ps(e1, zero)), _mm_cmpge_ps(e2, zero)) };
+			if (_mm_movemask_ps(inside) == 0) {
+				continue;
+			}
+
+			// Depth test, the lanes past the row end land in the padding
+			const __m128 depth{ _mm_add_ps(_mm_mul_ps(planeA, centerX), rowDepth) };
+			const __m128 stored{ _mm_loadu_ps(pRow + px) };
+			const __m128 write{ _mm_and_ps(inside, _mm_cmplt_ps(depth, stored)) };
+			_mm_storeu_ps(pRow + px, _mm_or_ps(_mm_and_ps(write, depth), _mm_andnot_ps(write, stored)));
+		}
+	}
+}
@@ -0,0 +1,35 @@
+#pragma once
+#include <vector>
+#include "DataTypes.h"
+
+// Rasterizer that only writes depth: positions are transformed and nothing else is interpolated.
+// Coverage and depth are evaluated four pixels at a time with SSE, rows are padded to a multiple of four for it.
+// Both faces are drawn, it serves shadow maps and any other pass that only needs the nearest depth.
+class DepthRasterizer
+{
+public:
+	void Resize(int width, int height);
+	void Clear(float depth = FLT_MAX);
+
+	// Draws a range of the index buffer with the given world view projection, triangles crossing the near or far plane are skipped
+	void RasterizeMesh(const std::vector<VertexUV>& vertices, const std::vector<uint32_t>& indices, uint32_t indexOffset, uint32_t indexCount,
+		PrimitiveTopology topology, const Matrix& WVPMatrix);
+
+	// Triangle in screen space: x and y in pixels, z the depth to store
+	void RasterizeTriangle(const Vector3& v0, const Vector3& v1, const Vector3& v2);
+
+	float GetDepth(int x, int y) const { return m_Depths[x + y * m_Stride]; }
+	int GetWidth() const { return m_Width; }
+	int GetHeight() const { return m_Height; }
+	uint32_t GetTriangleCount() const { return m_TriangleCount; }
+
+private:
+	int m_Width{};
+	int m_Height{};
+	int m_Stride{};
+	std::vector<float> m_Depths{};
+
+	// Screen positions of the mesh being drawn, w < 0 marks vertices outside the depth range
+	std::vector<Vector4> m_ScreenVertices{};
+	uint32_t m_TriangleCount{};
+};
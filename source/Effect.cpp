@@ -106,7 +106,7 @@ Effect_Vertex::Effect_Vertex(ID3D11Device* pDevice)
 void Effect_Vertex::BuildInputLayout() {
 
 	// Vertex layout
-	static constexpr uint32_t numElements{ 4 };
+	static constexpr uint32_t numElements{ 8 };
 	D3D11_INPUT_ELEMENT_DESC vertexDesc[numElements]{};
 
 	vertexDesc[0].SemanticName = "POSITION";
@@ -129,6 +129,18 @@ void Effect_Vertex::BuildInputLayout() {
 	vertexDesc[3].AlignedByteOffset = 32;
 	vertexDesc[3].InputSlotClass = D3D11_INPUT_PER_VERTEX_DATA;
 
+	// Instance world matrix, one row per element from the second buffer
+	for (uint32_t row{ 0 }; row < 4; ++row) {
+		D3D11_INPUT_ELEMENT_DESC& instanceDesc{ vertexDesc[4 + row] };
+		instanceDesc.SemanticName = "WORLD";
+		instanceDesc.SemanticIndex = row;
+		instanceDesc.Format = DXGI_FORMAT_R32G32B32A32_FLOAT;
+		instanceDesc.InputSlot = 1;
+		instanceDesc.AlignedByteOffset = row * 16;
+		instanceDesc.InputSlotClass = D3D11_INPUT_PER_INSTANCE_DATA;
+		instanceDesc.InstanceDataStepRate = 1;
+	}
+
 	// Input layout
 	D3DX11_PASS_DESC passDesc{};
 	m_pTechnique->GetPassByIndex(0)->GetDesc(&passDesc);
@@ -171,10 +183,10 @@ void Effect_Vertex::BuildVariables() {
 		std::wcout << L"m_pSamplerPointVariable not valid!\n";
 	}
 
-	// World Matrix
-	m_pMatWorldVariable = m_pEffect->GetVariableByName("gWorldMat")->AsMatrix();
-	if (!m_pMatWorldVariable->IsValid()) {
-		std::wcout << L"m_pMatWorldVariable not valid!\n";
+	// View Projection Matrix
+	m_pMatViewProjVariable = m_pEffect->GetVariableByName("gViewProjMat")->AsMatrix();
+	if (!m_pMatViewProjVariable->IsValid()) {
+		std::wcout << L"m_pMatViewProjVariable not valid!\n";
 	}
 
 	// World View Projection Matrix
@@ -182,6 +194,32 @@ void Effect_Vertex::BuildVariables() {
 	if (!m_pMatViewInvVariable->IsValid()) {
 		std::wcout << L"m_pMatViewInvVariable not valid!\n";
 	}
+
+	// Lights
+	m_pLightPositionsVariable = m_pEffect->GetVariableByName("gLightPositions")->AsVector();
+	if (!m_pLightPositionsVariable->IsValid()) {
+		std::wcout << L"m_pLightPositionsVariable not valid!\n";
+	}
+
+	m_pLightDirectionsVariable = m_pEffect->GetVariableByName("gLightDirections")->AsVector();
+	if (!m_pLightDirectionsVariable->IsValid()) {
+		std::wcout << L"m_pLightDirectionsVariable not valid!\n";
+	}
+
+	m_pLightColorsVariable = m_pEffect->GetVariableByName("gLightColors")->AsVector();
+	if (!m_pLightColorsVariable->IsValid()) {
+		std::wcout << L"m_pLightColorsVariable not valid!\n";
+	}
+
+	m_pLightConesVariable = m_pEffect->GetVariableByName("gLightCones")->AsVector();
+	if (!m_pLightConesVariable->IsValid()) {
+		std::wcout << L"m_pLightConesVariable not valid!\n";
+	}
+
+	m_pLightCountVariable = m_pEffect->GetVariableByName("gLightCount")->AsScalar();
+	if (!m_pLightCountVariable->IsValid()) {
+		std::wcout << L"m_pLightCountVariable not valid!\n";
+	}
 }
 
 void Effect_Vertex::SetMaps(Texture* pDiffuseMap, Texture* pNormalMap, Texture* pSpecularMap, Texture* pGlossyMap) {
@@ -202,12 +240,12 @@ void Effect_Vertex::SetMaps(Texture* pDiffuseMap, Texture* pNormalMap, Texture*
 	}
 }
 
-void Effect_Vertex::SetWorldMatrix(const Matrix& worldMatrix) {
+void Effect_Vertex::SetViewProjMatrix(const Matrix& viewProjMatrix) {
 
 	float matrix[16]{};
-	worldMatrix.ConvertToFloatArray(matrix);
+	viewProjMatrix.ConvertToFloatArray(matrix);
 
-	m_pMatWorldVariable->SetMatrix(matrix);
+	m_pMatViewProjVariable->SetMatrix(matrix);
 }
 
 void Effect_Vertex::SetViewInvMatrix(const Matrix& viewInvMatrix) {
@@ -218,6 +256,49 @@ void Effect_Vertex::SetViewInvMatrix(const Matrix& viewInvMatrix) {
 	m_pMatViewInvVariable->SetMatrix(matrix);
 }
 
+void Effect_Vertex::SetLights(const std::vector<Light>& lights) {
+
+	// The shader has a fixed number of slots, lights past them are left out
+	const int lightCount{ std::min(int(lights.size()), MaxLights) };
+
+	float positions[MaxLights * 4]{};
+	float directions[MaxLights * 4]{};
+	float colors[MaxLights * 4]{};
+	float cones[MaxLights * 4]{};
+
+	for (int index{ 0 }; index < lightCount; ++index) {
+		const Light& light{ lights[index] };
+		float* pPosition{ &positions[index * 4] };
+		float* pDirection{ &directions[index * 4] };
+		float* pColor{ &colors[index * 4] };
+		float* pCone{ &cones[index * 4] };
+
+		pPosition[0] = light.position.x;
+		pPosition[1] = light.position.y;
+		pPosition[2] = light.position.z;
+		pPosition[3] = float(light.type);
+
+		pDirection[0] = light.direction.x;
+		pDirection[1] = light.direction.y;
+		pDirection[2] = light.direction.z;
+		pDirection[3] = light.range;
+
+		pColor[0] = light.color.r;
+		pColor[1] = light.color.g;
+		pColor[2] = light.color.b;
+		pColor[3] = light.intensity;
+
+		pCone[0] = light.cosInnerCone;
+		pCone[1] = light.cosOuterCone;
+	}
+
+	m_pLightPositionsVariable->SetFloatVectorArray(positions, 0, lightCount);
+	m_pLightDirectionsVariable->SetFloatVectorArray(directions, 0, lightCount);
+	m_pLightColorsVariable->SetFloatVectorArray(colors, 0, lightCount);
+	m_pLightConesVariable->SetFloatVectorArray(cones, 0, lightCount);
+	m_pLightCountVariable->SetInt(lightCount);
+}
+
 // Diffuse Alpha Effect
 
 Effect_DiffuseAlpha::Effect_DiffuseAlpha(ID3D11Device* pDevice)
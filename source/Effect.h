@@ -40,8 +40,12 @@ class Effect_Vertex : public Effect
 
 		void SetMaps(Texture* pDiffuseMap, Texture* pNormalMap, Texture* pSpecularMap, Texture* pGlossyMap);
 
-		void SetWorldMatrix(const Matrix& WorldMatrix);
+		void SetViewProjMatrix(const Matrix& ViewProjMatrix);
 		void SetViewInvMatrix(const Matrix& ViewInvMatrix);
+		void SetLights(const std::vector<Light>& lights);
+
+		// Size of the light arrays, matches MAX_LIGHTS in Vertex3D.fx
+		static constexpr int MaxLights{ 32 };
 
 	private:
 		virtual void BuildInputLayout() override;
@@ -52,8 +56,14 @@ class Effect_Vertex : public Effect
 		ID3DX11EffectShaderResourceVariable* m_pSpecularMapVariable;
 		ID3DX11EffectShaderResourceVariable* m_pGlossyMapVariable;
 
-		ID3DX11EffectMatrixVariable* m_pMatWorldVariable;
+		ID3DX11EffectMatrixVariable* m_pMatViewProjVariable;
 		ID3DX11EffectMatrixVariable* m_pMatViewInvVariable;
+
+		ID3DX11EffectVectorVariable* m_pLightPositionsVariable;
+		ID3DX11EffectVectorVariable* m_pLightDirectionsVariable;
+		ID3DX11EffectVectorVariable* m_pLightColorsVariable;
+		ID3DX11EffectVectorVariable* m_pLightConesVariable;
+		ID3DX11EffectScalarVariable* m_pLightCountVariable;
 };
 
 class Effect_DiffuseAlpha : public Effect
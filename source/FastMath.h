@@ -0,0 +1,118 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <emmintrin.h>
+#include "Vector3.h"
+
+// The software shading path uses the approximations below, a reference build defines USE_FAST_MATH 0
+// to get the library functions back with the same call sites.
+#ifndef USE_FAST_MATH
+#define USE_FAST_MATH 1
+#endif
+
+namespace dae
+{
+	namespace FastMath
+	{
+		// 1 / sqrt(x) for x > 0: SSE estimate (12 bits) refined by one Newton-Raphson step.
+		// Max error 4 ulp over the normal float range.
+		inline float RSqrt(float x)
+		{
+#if USE_FAST_MATH
+			const float estimate{ _mm_cvtss_f32(_mm_rsqrt_ss(_mm_set_ss(x))) };
+			return estimate * (1.5f - 0.5f * x * estimate * estimate);
+#else
+			return 1.0f / sqrtf(x);
+#endif
+		}
+
+		// 1 / x for x != 0: SSE estimate (12 bits) refined by one Newton-Raphson step.
+		// Max error 3 ulp over the normal float range.
+		inline float Reciprocal(float x)
+		{
+#if USE_FAST_MATH
+			const float estimate{ _mm_cvtss_f32(_mm_rcp_ss(_mm_set_ss(x))) };
+			return estimate * (2.0f - x * estimate);
+#else
+			return 1.0f / x;
+#endif
+		}
+
+		// 2^x, the integer part goes straight into the exponent bits and 2^f, f in [-0.5, 0.5], is a degree 6 polynomial.
+		// Max error 3 ulp for x in [-126, 127], results beyond that range are clamped.
+		inline float Exp2(float x)
+		{
+#if USE_FAST_MATH
+			x = (x < -126.0f) ? -126.0f : ((x > 127.0f) ? 127.0f : x);
+
+			const float integerPart{ floorf(x + 0.5f) };
+			const float f{ x - integerPart };
+
+			// Taylor series of e^(f * ln2), coefficients ln2^n / n!
+			const float polynomial{ 1.0f + f * (0.693147181f + f * (0.240226507f + f * (0.0555041087f
+				+ f * (0.00961812911f + f * (0.00133335581f + f * 0.000154035304f))))) };
+
+			const uint32_t exponentBits{ uint32_t(int32_t(integerPart) + 127) << 23 };
+			float scale{};
+			std::memcpy(&scale, &exponentBits, sizeof(scale));
+			return polynomial * scale;
+#else
+			return exp2f(x);
+#endif
+		}
+
+		// log2(x) for x > 0, the exponent bits give the integer part and the mantissa m, reduced to [sqrt(0.5), sqrt(2)),
+		// goes through the odd series of 2 * atanh((m - 1) / (m + 1)).
+		// Max error 4 ulp where |log2(x)| > 0.01, closer to x = 1 the result goes to 0 and the error is 2e-9 absolute.
+		inline float Log2(float x)
+		{
+#if USE_FAST_MATH
+			uint32_t bits{};
+			std::memcpy(&bits, &x, sizeof(bits));
+
+			int exponent{ int((bits >> 23) & 0xFF) - 127 };
+			bits = (bits & 0x007FFFFF) | 0x3F800000;
+			float mantissa{};
+			std::memcpy(&mantissa, &bits, sizeof(mantissa));
+
+			if (mantissa > 1.41421356f) {
+				mantissa *= 0.5f;
+				++exponent;
+			}
+
+			const float t{ (mantissa - 1.0f) * Reciprocal(mantissa + 1.0f) };
+			const float t2{ t * t };
+
+			// 2 / ln2 * (t + t^3 / 3 + t^5 / 5 + t^7 / 7 + t^9 / 9)
+			const float series{ t * (2.88539008f + t2 * (0.961796694f + t2 * (0.577078016f + t2 * (0.412198583f + t2 * 0.320598898f)))) };
+			return float(exponent) + series;
+#else
+			return log2f(x);
+#endif
+		}
+
+		// x^y for x >= 0 through Exp2(y * Log2(x)), 2e-7 absolute for x in [0, 1] and y up to 60
+		inline float Pow(float x, float y)
+		{
+#if USE_FAST_MATH
+			if (x <= 0.0f) {
+				return (y == 0.0f) ? 1.0f : 0.0f;
+			}
+			return Exp2(y * Log2(x));
+#else
+			return powf(x, y);
+#endif
+		}
+
+		inline Vector3 Normalized(const Vector3& v)
+		{
+			const float inverseMagnitude{ RSqrt(v.x * v.x + v.y * v.y + v.z * v.z) };
+			return { v.x * inverseMagnitude, v.y * inverseMagnitude, v.z * inverseMagnitude };
+		}
+
+		inline void Normalize(Vector3& v)
+		{
+			v = Normalized(v);
+		}
+	}
+}
@@ -2,12 +2,29 @@
 #include "Mesh.h"
 #include "Effect.h"
 #include "Texture.h"
+#include "MeshOptimizer.h"
+#include "MeshSimplifier.h"
+#include "FastMath.h"
+#include "ShadowMap.h"
+#include "Scene.h"
+#include <cstring>
 
-Mesh::Mesh(ID3D11Device* pDevice, std::vector<VertexUV> vertices, std::vector<uint32_t> indices) {
+Mesh::Mesh(ID3D11Device* pDevice, std::vector<VertexUV> vertices, std::vector<uint32_t> indices) :
+	m_pDevice{ pDevice }
+{
+
+	// Weld and reorder for the post-transform cache, shared by both pipelines
+	const MeshOptimizer::OptimizeStats stats{ MeshOptimizer::Optimize(vertices, indices) };
+	std::cout << "Mesh optimized: " << stats.verticesBefore << " -> " << stats.verticesAfter << " vertices, ACMR "
+		<< stats.ACMRBefore << " -> " << stats.ACMRAfter << "\n";
+
+	// Simplified levels are appended to the index buffer
+	BuildLODs(vertices, indices);
 
 	// Software variables
 	m_Vertices = vertices;
 	m_Indices = indices;
+	m_SpecularTable.Build(m_Shininess);
 
 	// Vertex buffer
 	D3D11_BUFFER_DESC bd{};
@@ -36,22 +53,23 @@ Mesh::Mesh(ID3D11Device* pDevice, std::vector<VertexUV> vertices, std::vector<ui
 	if (FAILED(result)) {
 		return;
 	}
-
-	m_WorldMatrix = Matrix::CreateTranslation(0, 0, 0);
 }
 
-void Mesh::RenderHardware(ID3D11DeviceContext* pDeviceContext, Camera camera, ID3D11SamplerState* samplerState) {
+void Mesh::RenderHardware(ID3D11DeviceContext* pDeviceContext, Camera camera, ID3D11SamplerState* samplerState, const std::vector<Light>& lights) {
+
+	if (m_Instances.empty()) {
+		return;
+	}
 
-	// Set World View Projection Matrix
-	Matrix WVPMatrix{ m_WorldMatrix * camera.viewMatrix * camera.projectionMatrix };
-	m_pEffect->SetWVPMatrix(WVPMatrix);
 	m_pEffect->SetSampleMethod(samplerState);
 
-	// Set other matrices
+	// Set other matrices, the instanced effect takes the world matrices from the instance buffer
 	Effect_Vertex* pEffectVertex = dynamic_cast<Effect_Vertex*>(m_pEffect);
 	if (pEffectVertex) {
-		pEffectVertex->SetWorldMatrix(m_WorldMatrix);
+		pEffectVertex->SetViewProjMatrix(camera.viewMatrix * camera.projectionMatrix);
 		pEffectVertex->SetViewInvMatrix(camera.invViewMatrix);
+		pEffectVertex->SetLights(lights);
+		UpdateInstanceBuffer(pDeviceContext);
 	}
 
 	// Set Primitive Technology
@@ -60,10 +78,11 @@ void Mesh::RenderHardware(ID3D11DeviceContext* pDeviceContext, Camera camera, ID
 	// Set Input Layout
 	pDeviceContext->IASetInputLayout(m_pEffect->GetInputLayout());
 
-	// Set Vertex Buffer
-	constexpr UINT stride = sizeof(VertexUV);
-	constexpr UINT offset = 0;
-	pDeviceContext->IASetVertexBuffers(0, 1, &m_pVertexBuffer, &stride, &offset);
+	// Set Vertex and Instance Buffers
+	ID3D11Buffer* buffers[2]{ m_pVertexBuffer, m_pInstanceBuffer };
+	constexpr UINT strides[2]{ sizeof(VertexUV), sizeof(float) * 16 };
+	constexpr UINT offsets[2]{ 0, 0 };
+	pDeviceContext->IASetVertexBuffers(0, 2, buffers, strides, offsets);
 
 	// Set Index Buffer
 	pDeviceContext->IASetIndexBuffer(m_pIndexBuffer, DXGI_FORMAT_R32_UINT, 0);
@@ -72,45 +91,187 @@ void Mesh::RenderHardware(ID3D11DeviceContext* pDeviceContext, Camera camera, ID
 	D3DX11_TECHNIQUE_DESC techDesc{};
 	m_pEffect->GetTechnique()->GetDesc(&techDesc);
 
-	for (UINT p{ 0 }; p < techDesc.Passes; ++p) {
-		m_pEffect->GetTechnique()->GetPassByIndex(p)->Apply(0, pDeviceContext);
-		pDeviceContext->DrawIndexed(m_NumIndices, 0, 0);
+	if (pEffectVertex) {
+		for (UINT p{ 0 }; p < techDesc.Passes; ++p) {
+			m_pEffect->GetTechnique()->GetPassByIndex(p)->Apply(0, pDeviceContext);
+			pDeviceContext->DrawIndexedInstanced(GetCurrentLOD().indexCount, GetInstanceCount(), GetCurrentLOD().indexOffset, 0, 0);
+		}
+		return;
+	}
+
+	// Effects without the instance layout draw once per instance
+	for (const Matrix& worldMatrix : m_Instances) {
+		m_pEffect->SetWVPMatrix(worldMatrix * camera.viewMatrix * camera.projectionMatrix);
+
+		for (UINT p{ 0 }; p < techDesc.Passes; ++p) {
+			m_pEffect->GetTechnique()->GetPassByIndex(p)->Apply(0, pDeviceContext);
+			pDeviceContext->DrawIndexed(GetCurrentLOD().indexCount, GetCurrentLOD().indexOffset, 0);
+		}
+	}
+}
+
+void Mesh::UpdateInstanceBuffer(ID3D11DeviceContext* pDeviceContext) {
+
+	const uint32_t instanceCount{ GetInstanceCount() };
+	if (instanceCount > m_InstanceCapacity) {
+		if (m_pInstanceBuffer) {
+			m_pInstanceBuffer->Release();
+			m_pInstanceBuffer = nullptr;
+		}
+
+		D3D11_BUFFER_DESC bd{};
+		bd.Usage = D3D11_USAGE_DYNAMIC;
+		bd.ByteWidth = sizeof(float) * 16 * instanceCount;
+		bd.BindFlags = D3D11_BIND_VERTEX_BUFFER;
+		bd.CPUAccessFlags = D3D11_CPU_ACCESS_WRITE;
+		bd.MiscFlags = 0;
+
+		const HRESULT result{ m_pDevice->CreateBuffer(&bd, nullptr, &m_pInstanceBuffer) };
+		if (FAILED(result)) {
+			m_InstanceCapacity = 0;
+			return;
+		}
+		m_InstanceCapacity = instanceCount;
+	}
+
+	// The instances move every frame, so the whole buffer is rewritten
+	D3D11_MAPPED_SUBRESOURCE mapped{};
+	if (FAILED(pDeviceContext->Map(m_pInstanceBuffer, 0, D3D11_MAP_WRITE_DISCARD, 0, &mapped))) {
+		return;
+	}
+
+	float* pMatrices{ static_cast<float*>(mapped.pData) };
+	for (uint32_t instance{ 0 }; instance < instanceCount; ++instance) {
+		m_Instances[instance].ConvertToFloatArray(pMatrices + instance * 16);
 	}
+
+	pDeviceContext->Unmap(m_pInstanceBuffer, 0);
+}
+
+void Mesh::SetInstances(const std::vector<Matrix>& instanceMatrices) {
+
+	// The cached normals are in world space, they only hold while a single instance keeps its transform
+	if (!m_ShadingCache.stamps.empty()) {
+		const bool isSameTransform{ instanceMatrices.size() == 1 && m_Instances.size() == 1
+			&& std::memcmp(&instanceMatrices.front(), &m_Instances.front(), sizeof(Matrix)) == 0 };
+		if (!isSameTransform) {
+			InvalidateShadingCache();
+		}
+	}
+
+	m_Instances = instanceMatrices;
 }
 
 Mesh::~Mesh() {
+	if (m_pInstanceBuffer) {
+		m_pInstanceBuffer->Release();
+	}
 	m_pIndexBuffer->Release();
 	m_pVertexBuffer->Release();
-	delete m_pEffect;
-	delete m_pDiffuseMap;
-	delete m_pNormalMap;
-	delete m_pSpecularMap;
-	delete m_pGlossyMap;
 }
 
-void Mesh::Update(float deltaTime) {
-	m_CurrentAngle += m_RotationSpeedRad * deltaTime;
-	if (m_CurrentAngle < 0) {
-		m_CurrentAngle += PI_2;
+void Mesh::BuildLODs(const std::vector<VertexUV>& vertices, std::vector<uint32_t>& indices) {
+
+	constexpr size_t maxLODs{ 5 };
+	constexpr size_t minIndexCount{ 64 * 3 };
+	constexpr float maxErrorRatio{ 0.1f };
+
+	// Bounding sphere
+	Vector3 minPosition{ FLT_MAX, FLT_MAX, FLT_MAX };
+	Vector3 maxPosition{ -FLT_MAX, -FLT_MAX, -FLT_MAX };
+	for (const VertexUV& vertex : vertices) {
+		minPosition = { std::min(minPosition.x, vertex.position.x), std::min(minPosition.y, vertex.position.y), std::min(minPosition.z, vertex.position.z) };
+		maxPosition = { std::max(maxPosition.x, vertex.position.x), std::max(maxPosition.y, vertex.position.y), std::max(maxPosition.z, vertex.position.z) };
 	}
-	if (m_CurrentAngle >= PI_2) {
-		m_CurrentAngle -= PI_2;
+
+	m_BoundingCenter = (minPosition + maxPosition) * 0.5f;
+	m_BoundingRadius = 0.0f;
+	for (const VertexUV& vertex : vertices) {
+		m_BoundingRadius = std::max(m_BoundingRadius, Vector3{ m_BoundingCenter, vertex.position }.Magnitude());
 	}
 
-	m_WorldMatrix = Matrix::CreateRotationY(m_CurrentAngle) * Matrix::CreateTranslation(m_Position);
+	m_LODs.clear();
+	m_LODs.push_back(MeshLOD{ 0, uint32_t(indices.size()), 0.0f });
+
+	// Every level halves the triangle count of the full mesh until it stops paying off or deforms too much
+	const std::vector<uint32_t> fullIndices{ indices };
+	size_t targetIndexCount{ fullIndices.size() };
+
+	while (m_LODs.size() < maxLODs) {
+		targetIndexCount /= 2;
+		if (targetIndexCount < minIndexCount) {
+			break;
+		}
+
+		float error{};
+		std::vector<uint32_t> lodIndices{ MeshSimplifier::Simplify(vertices, fullIndices, targetIndexCount, m_BoundingRadius * maxErrorRatio, &error) };
+		if (lodIndices.size() > m_LODs.back().indexCount * 9 / 10) {
+			break;
+		}
+
+		MeshOptimizer::OptimizeVertexCache(lodIndices, vertices.size());
+
+		m_LODs.push_back(MeshLOD{ uint32_t(indices.size()), uint32_t(lodIndices.size()), error });
+		indices.insert(indices.end(), lodIndices.begin(), lodIndices.end());
+	}
+
+	// Split every level into meshlets
+	m_Meshlets.clear();
+	for (MeshLOD& lod : m_LODs) {
+		lod.meshletOffset = uint32_t(m_Meshlets.size());
+		MeshOptimizer::BuildMeshlets(vertices, indices, lod.indexOffset, lod.indexCount, m_Meshlets);
+		lod.meshletCount = uint32_t(m_Meshlets.size()) - lod.meshletOffset;
+	}
+
+	std::cout << "Mesh LODs:";
+	for (const MeshLOD& lod : m_LODs) {
+		std::cout << " " << lod.indexCount / 3;
+	}
+	std::cout << " triangles, " << m_LODs.front().meshletCount << " meshlets\n";
 }
 
+void Mesh::SelectLOD(const Camera& camera, float screenHeight) {
+
+	// Distance to the closest point of the nearest instance's bounding sphere
+	float distance{ camera.zFar };
+	for (const Matrix& worldMatrix : m_Instances) {
+		const Vector3 center{ worldMatrix.TransformPoint(m_BoundingCenter) };
+		distance = std::min(distance, Vector3{ camera.origin, center }.Magnitude() - m_BoundingRadius);
+	}
+	distance = std::max(distance, camera.zNear);
+
+	// Pick the coarsest level whose error stays below the pixel threshold on screen
+	const float pixelsPerUnit{ screenHeight / (2.0f * distance * camera.fov) };
+
+	m_CurrentLOD = 0;
+	while (m_CurrentLOD + 1 < m_LODs.size() && m_LODs[m_CurrentLOD + 1].error * pixelsPerUnit <= m_MaxLODPixelError) {
+		++m_CurrentLOD;
+	}
+}
 
-void Mesh::SetMaps(Texture* diffuseMap, Texture* normalMap, Texture* specularMap, Texture* glossyMap) {
-	m_pDiffuseMap = diffuseMap;
-	m_pNormalMap = normalMap;
-	m_pSpecularMap = specularMap;
-	m_pGlossyMap = glossyMap;
+void Mesh::SetShininess(float shininess) {
+	if (shininess != m_Shininess) {
+		m_Shininess = shininess;
+		m_SpecularTable.Build(m_Shininess);
+	}
 }
 
+void Mesh::SetMaterial(const Material& material) {
+
+	// The cache holds the old maps' texels
+	if ((material.pDiffuseMap != m_pDiffuseMap || material.pNormalSpecularMap != m_pNormalSpecularMap) && !m_ShadingCache.stamps.empty()) {
+		m_ShadingCache.stamps.clear();
+		m_ShadingCache.texels.clear();
+	}
 
-void Mesh::SetEffect(Effect* effect) {
-	m_pEffect = effect;
+	m_pDiffuseMap = material.pDiffuseMap;
+	m_pNormalMap = material.pNormalMap;
+	m_pSpecularMap = material.pSpecularMap;
+	m_pGlossyMap = material.pGlossyMap;
+	m_pDiffuseGlossMap = material.pDiffuseGlossMap;
+	m_pNormalSpecularMap = material.pNormalSpecularMap;
+	m_pEffect = material.pEffect;
+	SetShininess(material.shininess);
 
 	// Link texture to effect
 	Effect_Vertex* pEffectVertex = dynamic_cast<Effect_Vertex*>(m_pEffect);
@@ -126,63 +287,212 @@ void Mesh::SetEffect(Effect* effect) {
 }
 
 
-ColorRGB Mesh::PixelShading(const Vertex_Out& v, ShadingMode mode, bool UseNormalMap) const {
+ColorRGB Mesh::PixelShading(const Vertex_Out& v, ShadingMode mode, bool UseNormalMap, Filtering filtering, const std::vector<Light>& lights, const std::vector<uint32_t>& lightIndices,
+	const ShadowMap* pShadowMap, bool useShadingCache) const {
 
-	const Vector3 lightDirection{ 0.577f, -0.577f, 0.577f };
-	const float lightIntensity{ 7.0f };
-	const float shininess{ 25.0f };
 	ColorRGB finalColor{ 0,0,0 };
 	ColorRGB ambientColor{ 0.025f, 0.025f, 0.025f };
 
 	Vector3 sampledNomal{ v.normal };
+	ColorRGB diffuseColor{};
+
+	// The cache keeps one entry per level 0 texel, so it is filled from level 0 only
+	const Vector2 uvDdx{ useShadingCache ? Vector2{} : v.uvDdx };
+	const Vector2 uvDdy{ useShadingCache ? Vector2{} : v.uvDdy };
+
+	// Packed maps serve the four inputs in two fetches, each made at most once per pixel.
+	// Either can be missing, compressed normal maps have no packed copy, and the separate maps stand in for it.
+	const bool useDiffuseGloss{ m_pDiffuseGlossMap != nullptr };
+	const bool useNormalSpecular{ m_pNormalSpecularMap != nullptr };
+	Vector4 diffuseGloss{};
+	Vector4 normalSpecular{};
+	bool hasDiffuseGloss{ false };
+	bool hasNormalSpecular{ false };
+
+	// The texel cache holds the view and light independent part: the normal mapped world normal and the lambert albedo
+	int texelIndex{ -1 };
+	bool isCached{ false };
+	if (useShadingCache) {
+		if (m_ShadingCache.stamps.empty() || m_ShadingCache.useNormalMap != UseNormalMap) {
+			m_ShadingCache.stamps.resize(size_t(m_pDiffuseMap->GetWidth()) * m_pDiffuseMap->GetHeight(), 0);
+			m_ShadingCache.texels.resize(m_ShadingCache.stamps.size());
+			m_ShadingCache.useNormalMap = UseNormalMap;
+			InvalidateShadingCache();
+		}
 
-	// Normal map calculations
-	if (UseNormalMap) {
-		Vector3 binormal{ Vector3::Cross(v.normal, v.tangent) };
-		Matrix tangentSpaceAxis{ Matrix{v.tangent, binormal, v.normal, Vector3::Zero} };
-
-		ColorRGB normalColor{ m_pNormalMap->Sample(v.uv) };
-		sampledNomal = { normalColor.r, normalColor.g, normalColor.b };
-		sampledNomal = (2.0f * sampledNomal) - Vector3{ 1.0f, 1.0f, 1.0f };
-		sampledNomal = tangentSpaceAxis.TransformVector(sampledNomal);
+		texelIndex = m_pDiffuseMap->GetTexelIndex(v.uv);
+		const ShadingCacheTexel& texel{ m_ShadingCache.texels[texelIndex] };
+		isCached = m_ShadingCache.stamps[texelIndex] == m_ShadingCache.currentStamp
+			&& Vector3::Dot(texel.surfaceNormal, v.normal) >= ShadingCacheSurfaceTolerance
+			&& Vector3::Dot(texel.surfaceTangent, v.tangent) >= ShadingCacheSurfaceTolerance;
+		if (isCached) {
+			sampledNomal = texel.normal;
+			diffuseColor = texel.diffuseColor;
+		}
 	}
 
-	// Cosine law
-	float observedArea{ Vector3::Dot(sampledNomal, -lightDirection) };
+	if (!isCached) {
+
+		// Normal map calculations
+		if (UseNormalMap) {
+			Vector3 binormal{ Vector3::Cross(v.normal, v.tangent) };
+			Matrix tangentSpaceAxis{ Matrix{v.tangent, binormal, v.normal, Vector3::Zero} };
+
+			// The map holds decoded tangent space vectors, the packed one only x and y of them
+			if (useNormalSpecular) {
+				normalSpecular = m_pNormalSpecularMap->SampleChannels(v.uv, uvDdx, uvDdy, filtering);
+				hasNormalSpecular = true;
+				const float tangentZ{ sqrtf(std::max(1.0f - normalSpecular.x * normalSpecular.x - normalSpecular.y * normalSpecular.y, 0.0f)) };
+				sampledNomal = { normalSpecular.x, normalSpecular.y, tangentZ };
+			}
+			else {
+				const ColorRGB tangentNormal{ m_pNormalMap->Sample(v.uv, uvDdx, uvDdy, filtering) };
+				sampledNomal = { tangentNormal.r, tangentNormal.g, tangentNormal.b };
+			}
+			sampledNomal = tangentSpaceAxis.TransformVector(sampledNomal);
+		}
 
-	if (observedArea > 0) {
+		// Diffuse lambert color, scaled by every light's intensity below
+		if (useDiffuseGloss) {
+			diffuseGloss = m_pDiffuseGlossMap->SampleChannels(v.uv, uvDdx, uvDdy, filtering);
+			hasDiffuseGloss = true;
+			diffuseColor = ColorRGB{ diffuseGloss.x, diffuseGloss.y, diffuseGloss.z } / PI;
+		}
+		else {
+			diffuseColor = m_pDiffuseMap->Sample(v.uv, uvDdx, uvDdy, filtering) / PI;
+		}
 
-		// Diffuse lambert color
-		ColorRGB diffuseColor = lightIntensity * m_pDiffuseMap->Sample(v.uv) / PI;
+		// Missed the cache, fill the texel for the next fragments reading it, a texel shared by another surface is taken over
+		if (useShadingCache) {
+			m_ShadingCache.texels[texelIndex] = { sampledNomal, diffuseColor, v.normal, v.tangent };
+			m_ShadingCache.stamps[texelIndex] = m_ShadingCache.currentStamp;
+		}
+	}
+
+	// Specular maps are sampled once, by the first light reaching the pixel
+	bool isLit{ false };
+	ColorRGB ks{};
+	float gloss{};
+
+	for (uint32_t lightIndex : lightIndices) {
+		const Light& light{ lights[lightIndex] };
+
+		Vector3 lightDirection{ light.direction };
+		float attenuation{ 1.0f };
+
+		if (light.type != LightType::directional) {
+			lightDirection = v.worldPosition - light.position;
+
+			// Smooth falloff reaching zero at range
+			const float distanceSquared{ lightDirection.SqrMagnitude() };
+			const float rangeSquared{ light.range * light.range };
+			if (distanceSquared >= rangeSquared || distanceSquared <= 0.0f) {
+				continue;
+			}
+
+			lightDirection *= FastMath::RSqrt(distanceSquared);
+			const float falloff{ 1.0f - distanceSquared / rangeSquared };
+			attenuation = falloff * falloff;
+
+			if (light.type == LightType::spot) {
+				const float spotCosine{ Vector3::Dot(lightDirection, light.direction) };
+				attenuation *= Saturate((spotCosine - light.cosOuterCone) / (light.cosInnerCone - light.cosOuterCone));
+				if (attenuation <= 0.0f) {
+					continue;
+				}
+			}
+		}
+
+		// Cosine law
+		float observedArea{ Vector3::Dot(sampledNomal, -lightDirection) };
+		if (observedArea <= 0) {
+			continue;
+		}
 
 		// Specular Color
-		const ColorRGB ks{ m_pSpecularMap->Sample(v.uv) };
-		const float exp{ m_pGlossyMap->Sample(v.uv).r * shininess };
+		if (!isLit) {
+			if (useNormalSpecular) {
+				if (!hasNormalSpecular) {
+					normalSpecular = m_pNormalSpecularMap->SampleChannels(v.uv, uvDdx, uvDdy, filtering);
+				}
+				ks = ColorRGB{ normalSpecular.z, normalSpecular.z, normalSpecular.z };
+			}
+			else {
+				ks = m_pSpecularMap->Sample(v.uv, uvDdx, uvDdy, filtering);
+			}
+
+			if (useDiffuseGloss) {
+				if (!hasDiffuseGloss) {
+					diffuseGloss = m_pDiffuseGlossMap->SampleChannels(v.uv, uvDdx, uvDdy, filtering);
+				}
+				gloss = diffuseGloss.w;
+			}
+			else {
+				gloss = m_pGlossyMap->Sample(v.uv, uvDdx, uvDdy, filtering).r;
+			}
+			isLit = true;
+		}
 
-		float dotproduct{ std::max(Vector3::Dot(sampledNomal,-lightDirection),0.0f) };
-		Vector3 r{ (-lightDirection) - 2 * dotproduct * sampledNomal };
+		// Facing the light but blocked, the ambient term still applies
+		if (pShadowMap && int(lightIndex) == pShadowMap->GetLightIndex()) {
+			attenuation *= pShadowMap->Lookup(v.worldPosition, v.normal, v.position.w);
+			if (attenuation <= 0.0f) {
+				continue;
+			}
+		}
+
+		Vector3 r{ (-lightDirection) - 2 * observedArea * sampledNomal };
 		float cosine{ std::max(Vector3::Dot(r,v.viewDirection),0.0f) };
-		ColorRGB specularPhong{ ks * powf(cosine,exp) };
+		ColorRGB specularPhong{ ks * m_SpecularTable.Sample(cosine, gloss) };
+
+		const ColorRGB radiance{ light.color * (attenuation * observedArea) };
 
 		// Final color
 		switch (mode) {
 		case ShadingMode::observerdArea:
-			finalColor = ColorRGB{ observedArea, observedArea,observedArea };
+			finalColor += ColorRGB{ observedArea, observedArea,observedArea } * attenuation;
 			break;
 
 		case ShadingMode::diffuse:
-			finalColor = diffuseColor * observedArea;
+			finalColor += diffuseColor * light.intensity * radiance;
 			break;
 
 		case ShadingMode::specular:
-			finalColor = specularPhong * observedArea;
+			finalColor += specularPhong * radiance;
 			break;
 
 		case ShadingMode::combined:
-			finalColor = (diffuseColor + specularPhong) * observedArea + ambientColor;
+			finalColor += (diffuseColor * light.intensity + specularPhong) * radiance;
 			break;
 		}
 	}
 
+	if (isLit && mode == ShadingMode::combined) {
+		finalColor += ambientColor;
+	}
+
 	return finalColor;
+}
+
+void Mesh::PrefetchTexels(const Vertex_Out& v, bool UseNormalMap) const {
+
+	(m_pDiffuseGlossMap ? m_pDiffuseGlossMap : m_pDiffuseMap)->Prefetch(v.uv, v.uvDdx, v.uvDdy);
+
+	// The packed normal map also holds the specular mask, so it is read whether normal mapping is on or not
+	if (m_pNormalSpecularMap) {
+		m_pNormalSpecularMap->Prefetch(v.uv, v.uvDdx, v.uvDdy);
+	}
+	else if (UseNormalMap) {
+		m_pNormalMap->Prefetch(v.uv, v.uvDdx, v.uvDdy);
+	}
+}
+
+void Mesh::InvalidateShadingCache() const {
+
+	// A new stamp drops every cached texel without touching the buffers
+	++m_ShadingCache.currentStamp;
+	if (m_ShadingCache.currentStamp == 0) {
+		std::fill(m_ShadingCache.stamps.begin(), m_ShadingCache.stamps.end(), 0);
+		m_ShadingCache.currentStamp = 1;
+	}
 }
\ No newline at end of file
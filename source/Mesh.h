@@ -2,50 +2,122 @@
 #include "DataTypes.h"
 #include "Camera.h"
 #include "ColorRGB.h"
+#include "MeshOptimizer.h"
+#include "SpecularTable.h"
 
 class Texture;
 class Effect;
+class ShadowMap;
+struct Material;
 
 using namespace dae;
 
+// Range of the index buffer holding one level of detail
+struct MeshLOD
+{
+	uint32_t indexOffset{};
+	uint32_t indexCount{};
+	float error{};
+	uint32_t meshletOffset{};
+	uint32_t meshletCount{};
+};
+
 class Mesh
 {
 	public:
 		Mesh(ID3D11Device* pDevice, std::vector<VertexUV> vertices, std::vector<uint32_t> indices);
 		~Mesh();
 
-		void Update(float deltaTime);
-		void RenderHardware(ID3D11DeviceContext* pDeviceContext, Camera camera, ID3D11SamplerState* samplerState);
+		void RenderHardware(ID3D11DeviceContext* pDeviceContext, Camera camera, ID3D11SamplerState* samplerState, const std::vector<Light>& lights);
+
+		// Maps and effect for the next draws, the material keeps ownership
+		void SetMaterial(const Material& material);
+		void SetShininess(float shininess);
 
-		void SetMaps(Texture* diffuseMap, Texture* normalMap = nullptr, Texture* specularMap = nullptr, Texture* glossyMap = nullptr);
-		void SetEffect(Effect* effect);
-		void SetPosition(const Vector3& pos) { m_Position = pos; }
-		ColorRGB PixelShading(const Vertex_Out& v, ShadingMode mode, bool UseNormalMap) const;
+		// World matrices of the copies drawn by the next draw, the mesh data is shared between them
+		void SetInstances(const std::vector<Matrix>& instanceMatrices);
+		void SelectLOD(const Camera& camera, float screenHeight);
+		// Sums the lights at lightIndices, the indices come from the tile culling so only lights reaching the pixel are listed.
+		// The shadow map, when given, shadows the light it was rendered for.
+		ColorRGB PixelShading(const Vertex_Out& v, ShadingMode mode, bool UseNormalMap, Filtering filtering, const std::vector<Light>& lights, const std::vector<uint32_t>& lightIndices,
+			const ShadowMap* pShadowMap = nullptr, bool useShadingCache = false) const;
 
-		std::vector<VertexUV> GetVertices() const { return m_Vertices; }
-		std::vector<uint32_t> GetIndices() const { return m_Indices; }
-		Matrix GetWorldMatrix() const { return m_WorldMatrix; }
+		// Starts loading the diffuse and normal texels PixelShading will read for v
+		void PrefetchTexels(const Vertex_Out& v, bool UseNormalMap) const;
+
+		const std::vector<VertexUV>& GetVertices() const { return m_Vertices; }
+		const std::vector<uint32_t>& GetIndices() const { return m_Indices; }
+		const MeshLOD& GetCurrentLOD() const { return m_LODs[m_CurrentLOD]; }
+		const SpecularTable& GetSpecularTable() const { return m_SpecularTable; }
+		const std::vector<MeshOptimizer::Meshlet>& GetMeshlets() const { return m_Meshlets; }
+		const Vector3& GetBoundingCenter() const { return m_BoundingCenter; }
+		float GetBoundingRadius() const { return m_BoundingRadius; }
+		uint32_t GetInstanceCount() const { return uint32_t(m_Instances.size()); }
+		const Matrix& GetInstanceWorldMatrix(uint32_t instance) const { return m_Instances[instance]; }
 		
 		PrimitiveTopology primitiveTopology{ PrimitiveTopology::TriangleList };
 
 	private:
 
+		void BuildLODs(const std::vector<VertexUV>& vertices, std::vector<uint32_t>& indices);
+		void InvalidateShadingCache() const;
+		void UpdateInstanceBuffer(ID3D11DeviceContext* pDeviceContext);
+
+		ID3D11Device* m_pDevice;
 		Effect* m_pEffect;
 		ID3D11Buffer* m_pVertexBuffer;
 		ID3D11Buffer* m_pIndexBuffer;
+
+		// Per instance world matrices for the hardware draw, grown to the largest instance count
+		ID3D11Buffer* m_pInstanceBuffer{ nullptr };
+		uint32_t m_InstanceCapacity{ 0 };
 		uint32_t m_NumIndices;
-		Matrix m_WorldMatrix;
 
 		Texture* m_pDiffuseMap;
 		Texture* m_pNormalMap;
 		Texture* m_pSpecularMap;
 		Texture* m_pGlossyMap;
 
-		float m_CurrentAngle{ 0.0f };
-		float m_RotationSpeedRad{ PI_DIV_2 };
+		// Packed copies of the four maps, sampled instead of them by the software path when the material has them
+		Texture* m_pDiffuseGlossMap{ nullptr };
+		Texture* m_pNormalSpecularMap{ nullptr };
+
+		// Specular exponent at full gloss, the software shader reads powf from the table built for it
+		float m_Shininess{ 25.0f };
+		SpecularTable m_SpecularTable{};
 
 		std::vector<VertexUV> m_Vertices{};
 		std::vector<uint32_t> m_Indices{};
 
-		Vector3 m_Position{ 0.0f,0.0f,0.0f };
+		std::vector<Matrix> m_Instances{};
+
+		// Level of detail
+		std::vector<MeshLOD> m_LODs{};
+		uint32_t m_CurrentLOD{ 0 };
+		Vector3 m_BoundingCenter{};
+		float m_BoundingRadius{};
+		float m_MaxLODPixelError{ 1.0f };
+
+		// Clusters of every level of detail for the software culling
+		std::vector<MeshOptimizer::Meshlet> m_Meshlets{};
+
+		// Texture-space shading cache over the diffuse map's texels, filled on first use by a fragment.
+		// Mirrored or shared UV islands put several surfaces on one texel, so an entry also keeps the surface normal and tangent
+		// it was shaded for, and only fragments on a surface facing the same way within the tolerance reuse it.
+		static constexpr float ShadingCacheSurfaceTolerance{ 0.98f };
+		struct ShadingCacheTexel
+		{
+			Vector3 normal{};
+			ColorRGB diffuseColor{};
+			Vector3 surfaceNormal{};
+			Vector3 surfaceTangent{};
+		};
+		struct ShadingCache
+		{
+			std::vector<ShadingCacheTexel> texels{};
+			std::vector<uint32_t> stamps{};
+			uint32_t currentStamp{ 0 };
+			bool useNormalMap{ true };
+		};
+		mutable ShadingCache m_ShadingCache{};
 };
\ No newline at end of file
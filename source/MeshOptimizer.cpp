@@ -0,0 +1,489 @@
+#include "pch.h"
+#include "MeshOptimizer.h"
+#include <unordered_map>
+#include <cstring>
+
+namespace dae
+{
+	namespace MeshOptimizer
+	{
+		// Forsyth scoring constants, see "Linear-Speed Vertex Cache Optimisation"
+		constexpr int ScoringCacheSize{ 32 };
+		constexpr float CacheDecayPower{ 1.5f };
+		constexpr float LastTriScore{ 0.75f };
+		constexpr float ValenceBoostScale{ 2.0f };
+		constexpr float ValenceBoostPower{ 0.5f };
+
+		constexpr uint32_t InvalidIndex{ UINT32_MAX };
+
+		// Triangles bending further than this (1 - cosine) from a meshlet's average normal start a new meshlet
+		constexpr float MeshletMaxNormalSpread{ 0.3f };
+
+		struct WeldKey
+		{
+			float values[8];
+
+			bool operator==(const WeldKey& other) const {
+				return std::memcmp(values, other.values, sizeof(values)) == 0;
+			}
+		};
+
+		struct WeldKeyHash
+		{
+			size_t operator()(const WeldKey& key) const {
+				size_t hash{ 0 };
+				for (float value : key.values) {
+					uint32_t bits{};
+					std::memcpy(&bits, &value, sizeof(bits));
+					hash = (hash ^ bits) * 1099511628211ull;
+				}
+				return hash;
+			}
+		};
+
+		static float VertexScore(int cachePosition, uint32_t activeTriangles) {
+			if (activeTriangles == 0) {
+				return -1.0f;
+			}
+
+			float score{ 0.0f };
+			if (cachePosition >= 0) {
+				if (cachePosition < 3) {
+					// The last triangle's vertices get a fixed score so they aren't favoured too much
+					score = LastTriScore;
+				}
+				else {
+					const float scaler{ 1.0f / (ScoringCacheSize - 3) };
+					score = powf(1.0f - (cachePosition - 3) * scaler, CacheDecayPower);
+				}
+			}
+
+			// Boost vertices with few triangles left so lone triangles don't get stranded
+			score += ValenceBoostScale * powf(float(activeTriangles), -ValenceBoostPower);
+			return score;
+		}
+
+		void WeldVertices(std::vector<VertexUV>& vertices, std::vector<uint32_t>& indices) {
+
+			std::unordered_map<WeldKey, uint32_t, WeldKeyHash> lookup{};
+			lookup.reserve(vertices.size());
+
+			std::vector<VertexUV> weldedVertices{};
+			std::vector<Vector3> tangentSums{};
+			std::vector<uint32_t> remap(vertices.size());
+
+			for (size_t i{ 0 }; i < vertices.size(); ++i) {
+				const VertexUV& vertex{ vertices[i] };
+				const WeldKey key{ {
+					vertex.position.x, vertex.position.y, vertex.position.z,
+					vertex.uv.x, vertex.uv.y,
+					vertex.normal.x, vertex.normal.y, vertex.normal.z } };
+
+				auto it{ lookup.find(key) };
+				if (it == lookup.end()) {
+					it = lookup.emplace(key, uint32_t(weldedVertices.size())).first;
+					weldedVertices.push_back(vertex);
+					tangentSums.push_back(vertex.tangent);
+				}
+				else {
+					tangentSums[it->second] += vertex.tangent;
+				}
+				remap[i] = it->second;
+			}
+
+			// Average the tangents of the merged vertices
+			for (size_t i{ 0 }; i < weldedVertices.size(); ++i) {
+				const Vector3 tangent{ Vector3::Reject(tangentSums[i], weldedVertices[i].normal) };
+				if (tangent.SqrMagnitude() > FLT_EPSILON) {
+					weldedVertices[i].tangent = tangent.Normalized();
+				}
+			}
+
+			for (uint32_t& index : indices) {
+				index = remap[index];
+			}
+
+			vertices = std::move(weldedVertices);
+		}
+
+		void OptimizeVertexCache(std::vector<uint32_t>& indices, size_t vertexCount) {
+
+			const size_t triangleCount{ indices.size() / 3 };
+			if (triangleCount == 0) {
+				return;
+			}
+
+			// Build vertex to triangle adjacency
+			std::vector<uint32_t> activeTriangles(vertexCount, 0);
+			for (uint32_t index : indices) {
+				++activeTriangles[index];
+			}
+
+			std::vector<uint32_t> adjacencyOffsets(vertexCount + 1, 0);
+			for (size_t v{ 0 }; v < vertexCount; ++v) {
+				adjacencyOffsets[v + 1] = adjacencyOffsets[v] + activeTriangles[v];
+			}
+
+			std::vector<uint32_t> adjacency(indices.size());
+			std::vector<uint32_t> fillCount(vertexCount, 0);
+			for (size_t t{ 0 }; t < triangleCount; ++t) {
+				for (size_t c{ 0 }; c < 3; ++c) {
+					const uint32_t v{ indices[t * 3 + c] };
+					adjacency[adjacencyOffsets[v] + fillCount[v]++] = uint32_t(t);
+				}
+			}
+
+			// Initial scores
+			std::vector<int> cachePositions(vertexCount, -1);
+			std::vector<float> vertexScores(vertexCount);
+			for (size_t v{ 0 }; v < vertexCount; ++v) {
+				vertexScores[v] = VertexScore(-1, activeTriangles[v]);
+			}
+
+			std::vector<float> triangleScores(triangleCount);
+			std::vector<bool> triangleAdded(triangleCount, false);
+			uint32_t bestTriangle{ InvalidIndex };
+			float bestScore{ -1.0f };
+			for (size_t t{ 0 }; t < triangleCount; ++t) {
+				triangleScores[t] = vertexScores[indices[t * 3]] + vertexScores[indices[t * 3 + 1]] + vertexScores[indices[t * 3 + 2]];
+				if (triangleScores[t] > bestScore) {
+					bestScore = triangleScores[t];
+					bestTriangle = uint32_t(t);
+				}
+			}
+
+			std::vector<uint32_t> optimizedIndices{};
+			optimizedIndices.reserve(indices.size());
+
+			std::vector<uint32_t> cache{};
+			std::vector<uint32_t> newCache{};
+			cache.reserve(ScoringCacheSize + 3);
+			newCache.reserve(ScoringCacheSize + 3);
+
+			size_t scanPosition{ 0 };
+
+			for (size_t emitted{ 0 }; emitted < triangleCount; ++emitted) {
+
+				// No candidate left in the cache, pick the best remaining triangle
+				if (bestTriangle == InvalidIndex) {
+					bestScore = -1.0f;
+					while (scanPosition < triangleCount && triangleAdded[scanPosition]) {
+						++scanPosition;
+					}
+					for (size_t t{ scanPosition }; t < triangleCount; ++t) {
+						if (!triangleAdded[t] && triangleScores[t] > bestScore) {
+							bestScore = triangleScores[t];
+							bestTriangle = uint32_t(t);
+						}
+					}
+				}
+
+				// Emit triangle
+				const uint32_t* triangle{ &indices[size_t(bestTriangle) * 3] };
+				triangleAdded[bestTriangle] = true;
+				optimizedIndices.insert(optimizedIndices.end(), triangle, triangle + 3);
+
+				// Remove it from the active adjacency of its vertices
+				for (size_t c{ 0 }; c < 3; ++c) {
+					const uint32_t v{ triangle[c] };
+					uint32_t* begin{ &adjacency[adjacencyOffsets[v]] };
+					uint32_t* end{ begin + activeTriangles[v] };
+					uint32_t* found{ std::find(begin, end, bestTriangle) };
+					if (found != end) {
+						std::swap(*found, *(end - 1));
+						--activeTriangles[v];
+					}
+				}
+
+				// Push the triangle's vertices to the front of the LRU cache
+				newCache.clear();
+				newCache.insert(newCache.end(), triangle, triangle + 3);
+				for (uint32_t v : cache) {
+					if (v != triangle[0] && v != triangle[1] && v != triangle[2]) {
+						newCache.push_back(v);
+					}
+				}
+
+				// Update scores of every vertex that was or is in the cache
+				for (size_t i{ 0 }; i < newCache.size(); ++i) {
+					const uint32_t v{ newCache[i] };
+					cachePositions[v] = (i < ScoringCacheSize) ? int(i) : -1;
+					vertexScores[v] = VertexScore(cachePositions[v], activeTriangles[v]);
+				}
+
+				bestTriangle = InvalidIndex;
+				bestScore = -1.0f;
+				for (size_t i{ 0 }; i < newCache.size(); ++i) {
+					const uint32_t v{ newCache[i] };
+					for (uint32_t a{ 0 }; a < activeTriangles[v]; ++a) {
+						const uint32_t t{ adjacency[adjacencyOffsets[v] + a] };
+						triangleScores[t] = vertexScores[indices[size_t(t) * 3]] + vertexScores[indices[size_t(t) * 3 + 1]] + vertexScores[indices[size_t(t) * 3 + 2]];
+						if (triangleScores[t] > bestScore) {
+							bestScore = triangleScores[t];
+							bestTriangle = t;
+						}
+					}
+				}
+
+				if (newCache.size() > ScoringCacheSize) {
+					newCache.resize(ScoringCacheSize);
+				}
+				std::swap(cache, newCache);
+			}
+
+			indices = std::move(optimizedIndices);
+		}
+
+		void OptimizeVertexFetch(std::vector<VertexUV>& vertices, std::vector<uint32_t>& indices) {
+
+			std::vector<uint32_t> remap(vertices.size(), InvalidIndex);
+			std::vector<VertexUV> orderedVertices{};
+			orderedVertices.reserve(vertices.size());
+
+			for (uint32_t& index : indices) {
+				if (remap[index] == InvalidIndex) {
+					remap[index] = uint32_t(orderedVertices.size());
+					orderedVertices.push_back(vertices[index]);
+				}
+				index = remap[index];
+			}
+
+			vertices = std::move(orderedVertices);
+		}
+
+		float CalculateACMR(const std::vector<uint32_t>& indices, size_t vertexCount, uint32_t cacheSize) {
+
+			const size_t triangleCount{ indices.size() / 3 };
+			if (triangleCount == 0) {
+				return 0.0f;
+			}
+
+			// Store the time at which each vertex entered the FIFO
+			std::vector<size_t> insertTime(vertexCount, 0);
+			size_t time{ cacheSize + 1 };
+			size_t misses{ 0 };
+
+			for (uint32_t index : indices) {
+				if (time - insertTime[index] > cacheSize) {
+					insertTime[index] = time++;
+					++misses;
+				}
+			}
+
+			return float(misses) / triangleCount;
+		}
+
+		static void FinishMeshlet(const std::vector<VertexUV>& vertices, const std::vector<uint32_t>& indices, Meshlet& meshlet) {
+
+			const std::vector<uint32_t> meshletVertices(indices.begin() + meshlet.indexOffset, indices.begin() + meshlet.indexOffset + meshlet.indexCount);
+
+			// Bounding sphere around the box center
+			Vector3 minPosition{ FLT_MAX, FLT_MAX, FLT_MAX };
+			Vector3 maxPosition{ -FLT_MAX, -FLT_MAX, -FLT_MAX };
+			for (uint32_t index : meshletVertices) {
+				const Vector3& p{ vertices[index].position };
+				minPosition = { std::min(minPosition.x, p.x), std::min(minPosition.y, p.y), std::min(minPosition.z, p.z) };
+				maxPosition = { std::max(maxPosition.x, p.x), std::max(maxPosition.y, p.y), std::max(maxPosition.z, p.z) };
+			}
+
+			meshlet.center = (minPosition + maxPosition) * 0.5f;
+			meshlet.radius = 0.0f;
+			for (uint32_t index : meshletVertices) {
+				meshlet.radius = std::max(meshlet.radius, Vector3{ meshlet.center, vertices[index].position }.Magnitude());
+			}
+
+			// Normal cone, triangles are culled on their averaged vertex normal like the rasterizer does
+			std::vector<Vector3> normals{};
+			normals.reserve(meshlet.indexCount / 3);
+			Vector3 axis{};
+			for (uint32_t i{ meshlet.indexOffset }; i < meshlet.indexOffset + meshlet.indexCount; i += 3) {
+				Vector3 normal{ vertices[indices[i]].normal + vertices[indices[i + 1]].normal + vertices[indices[i + 2]].normal };
+				if (normal.SqrMagnitude() > FLT_EPSILON) {
+					normal.Normalize();
+					normals.push_back(normal);
+					axis += normal;
+				}
+			}
+
+			meshlet.coneSin = 2.0f;
+			if (normals.empty() || axis.SqrMagnitude() <= FLT_EPSILON) {
+				return;
+			}
+
+			axis.Normalize();
+			float minCosine{ 1.0f };
+			for (const Vector3& normal : normals) {
+				minCosine = std::min(minCosine, Vector3::Dot(normal, axis));
+			}
+
+			meshlet.coneAxis = axis;
+			if (minCosine > 0.0f) {
+				meshlet.coneSin = sqrtf(1.0f - minCosine * minCosine);
+			}
+		}
+
+		void BuildMeshlets(const std::vector<VertexUV>& vertices, std::vector<uint32_t>& indices,
+			uint32_t indexOffset, uint32_t indexCount, std::vector<Meshlet>& meshlets) {
+
+			const uint32_t triangleCount{ indexCount / 3 };
+			const uint32_t* triangles{ &indices[indexOffset] };
+			const size_t firstMeshlet{ meshlets.size() };
+
+			// Triangles are connected through shared positions so uv and normal seams don't split meshlets
+			std::unordered_map<WeldKey, uint32_t, WeldKeyHash> positionLookup{};
+			std::vector<uint32_t> positionIds(vertices.size(), InvalidIndex);
+			auto getPositionId = [&](uint32_t index) {
+				if (positionIds[index] == InvalidIndex) {
+					const Vector3& p{ vertices[index].position };
+					positionIds[index] = positionLookup.emplace(WeldKey{ { p.x, p.y, p.z } }, uint32_t(positionLookup.size())).first->second;
+				}
+				return positionIds[index];
+			};
+
+			// Triangle normals as the rasterizer culls them and position to triangle adjacency
+			std::vector<Vector3> triangleNormals(triangleCount);
+			std::vector<Vector3> triangleCentroids(triangleCount);
+			std::unordered_map<uint32_t, std::vector<uint32_t>> vertexTriangles{};
+			for (uint32_t t{ 0 }; t < triangleCount; ++t) {
+				triangleCentroids[t] = (vertices[triangles[t * 3]].position + vertices[triangles[t * 3 + 1]].position + vertices[triangles[t * 3 + 2]].position) / 3.0f;
+
+				Vector3 normal{ vertices[triangles[t * 3]].normal + vertices[triangles[t * 3 + 1]].normal + vertices[triangles[t * 3 + 2]].normal };
+				if (normal.SqrMagnitude() > FLT_EPSILON) {
+					normal.Normalize();
+				}
+				triangleNormals[t] = normal;
+
+				for (uint32_t c{ 0 }; c < 3; ++c) {
+					vertexTriangles[getPositionId(triangles[t * 3 + c])].push_back(t);
+				}
+			}
+
+			std::vector<bool> triangleUsed(triangleCount, false);
+			std::vector<uint32_t> orderedIndices{};
+			orderedIndices.reserve(indexCount);
+
+			std::vector<uint32_t> meshletVertices{};
+			meshletVertices.reserve(MeshletMaxVertices);
+
+			auto countNewVertices = [&](uint32_t t) {
+				uint32_t newVertices{ 0 };
+				for (uint32_t c{ 0 }; c < 3; ++c) {
+					const uint32_t index{ triangles[t * 3 + c] };
+					const bool isDuplicate{ (c > 0 && index == triangles[t * 3]) || (c > 1 && index == triangles[t * 3 + 1]) };
+					if (!isDuplicate && std::find(meshletVertices.begin(), meshletVertices.end(), index) == meshletVertices.end()) {
+						++newVertices;
+					}
+				}
+				return newVertices;
+			};
+
+			uint32_t seed{ 0 };
+			while (true) {
+
+				// Seed in the cache optimized order so meshlets keep the vertex locality
+				while (seed < triangleCount && triangleUsed[seed]) {
+					++seed;
+				}
+				if (seed == triangleCount) {
+					break;
+				}
+
+				Meshlet meshlet{ indexOffset + uint32_t(orderedIndices.size()), 0 };
+				meshletVertices.clear();
+				Vector3 normalSum{};
+				Vector3 centroidSum{};
+
+				uint32_t next{ seed };
+				while (next != InvalidIndex) {
+
+					// Add triangle
+					triangleUsed[next] = true;
+					normalSum += triangleNormals[next];
+					centroidSum += triangleCentroids[next];
+					for (uint32_t c{ 0 }; c < 3; ++c) {
+						const uint32_t index{ triangles[next * 3 + c] };
+						orderedIndices.push_back(index);
+						if (std::find(meshletVertices.begin(), meshletVertices.end(), index) == meshletVertices.end()) {
+							meshletVertices.push_back(index);
+						}
+					}
+					meshlet.indexCount += 3;
+
+					if (meshlet.indexCount / 3 >= MeshletMaxTriangles) {
+						break;
+					}
+
+					// Grow over connected triangles, preferring shared vertices and then a tight normal cone
+					Vector3 axis{ normalSum };
+					if (axis.SqrMagnitude() > FLT_EPSILON) {
+						axis.Normalize();
+					}
+
+					next = InvalidIndex;
+					float bestScore{ FLT_MAX };
+					for (uint32_t vertex : meshletVertices) {
+						for (uint32_t candidate : vertexTriangles[getPositionId(vertex)]) {
+							if (triangleUsed[candidate]) {
+								continue;
+							}
+
+							const uint32_t newVertices{ countNewVertices(candidate) };
+							const float spread{ 1.0f - Vector3::Dot(triangleNormals[candidate], axis) };
+							if (meshletVertices.size() + newVertices > MeshletMaxVertices || spread > MeshletMaxNormalSpread) {
+								continue;
+							}
+
+							const float score{ newVertices + spread * 4.0f };
+							if (score < bestScore) {
+								bestScore = score;
+								next = candidate;
+							}
+						}
+					}
+
+
+					// Nothing connected fits, continue with the closest loose triangle so small parts share meshlets
+					if (next == InvalidIndex) {
+						const Vector3 center{ centroidSum / float(meshlet.indexCount / 3) };
+						float bestDistance{ FLT_MAX };
+						for (uint32_t candidate{ seed }; candidate < triangleCount; ++candidate) {
+							if (triangleUsed[candidate] || 1.0f - Vector3::Dot(triangleNormals[candidate], axis) > MeshletMaxNormalSpread ||
+								meshletVertices.size() + countNewVertices(candidate) > MeshletMaxVertices) {
+								continue;
+							}
+
+							const float distance{ Vector3{ center, triangleCentroids[candidate] }.SqrMagnitude() };
+							if (distance < bestDistance) {
+								bestDistance = distance;
+								next = candidate;
+							}
+						}
+					}
+				}
+
+				meshlets.push_back(meshlet);
+			}
+
+			std::copy(orderedIndices.begin(), orderedIndices.end(), indices.begin() + indexOffset);
+
+			for (size_t m{ firstMeshlet }; m < meshlets.size(); ++m) {
+				FinishMeshlet(vertices, indices, meshlets[m]);
+			}
+		}
+
+		OptimizeStats Optimize(std::vector<VertexUV>& vertices, std::vector<uint32_t>& indices) {
+
+			OptimizeStats stats{};
+			stats.verticesBefore = vertices.size();
+			stats.ACMRBefore = CalculateACMR(indices, vertices.size());
+
+			WeldVertices(vertices, indices);
+			OptimizeVertexCache(indices, vertices.size());
+			OptimizeVertexFetch(vertices, indices);
+
+			stats.verticesAfter = vertices.size();
+			stats.ACMRAfter = CalculateACMR(indices, vertices.size());
+			return stats;
+		}
+	}
+}
@@ -0,0 +1,58 @@
+#pragma once
+#include "DataTypes.h"
+
+namespace dae
+{
+	namespace MeshOptimizer
+	{
+		// Size of the FIFO cache used to measure the post-transform cache efficiency
+		constexpr uint32_t ACMRCacheSize{ 16 };
+
+		// Meshlet limits, sized for the software cluster culling
+		constexpr uint32_t MeshletMaxVertices{ 64 };
+		constexpr uint32_t MeshletMaxTriangles{ 124 };
+
+		// Cluster of consecutive triangles in the index buffer with its culling bounds
+		struct Meshlet
+		{
+			uint32_t indexOffset{};
+			uint32_t indexCount{};
+
+			// Bounding sphere in object space
+			Vector3 center{};
+			float radius{};
+
+			// Cone around every triangle normal, coneSin > 1 when the cone can't be culled
+			Vector3 coneAxis{};
+			float coneSin{};
+		};
+
+		struct OptimizeStats
+		{
+			size_t verticesBefore{};
+			size_t verticesAfter{};
+			float ACMRBefore{};
+			float ACMRAfter{};
+		};
+
+		// Merges vertices sharing position, uv and normal and rebuilds their tangents
+		void WeldVertices(std::vector<VertexUV>& vertices, std::vector<uint32_t>& indices);
+
+		// Reorders the triangles of a triangle list for post-transform cache reuse (Forsyth)
+		void OptimizeVertexCache(std::vector<uint32_t>& indices, size_t vertexCount);
+
+		// Reorders the vertices in first-use order of the index buffer, drops unreferenced vertices
+		void OptimizeVertexFetch(std::vector<VertexUV>& vertices, std::vector<uint32_t>& indices);
+
+		// Average cache miss ratio: transformed vertices per triangle with a FIFO cache
+		float CalculateACMR(const std::vector<uint32_t>& indices, size_t vertexCount, uint32_t cacheSize = ACMRCacheSize);
+
+		// Splits a cache optimized triangle list range into meshlets of connected triangles with similar normals.
+		// The triangles of the range are reordered so every meshlet is contiguous, the meshlets are appended.
+		void BuildMeshlets(const std::vector<VertexUV>& vertices, std::vector<uint32_t>& indices,
+			uint32_t indexOffset, uint32_t indexCount, std::vector<Meshlet>& meshlets);
+
+		// Runs the full load-time pass on a triangle list
+		OptimizeStats Optimize(std::vector<VertexUV>& vertices, std::vector<uint32_t>& indices);
+	}
+}
@@ -0,0 +1,404 @@
+#include "pch.h"
+#include "MeshSimplifier.h"
+#include <unordered_map>
+#include <queue>
+#include <cstring>
+
+namespace dae
+{
+	namespace MeshSimplifier
+	{
+		// Border edges get a perpendicular plane with this weight so open silhouettes keep their shape
+		constexpr double BorderWeight{ 10.0 };
+
+		// Collapses that turn a triangle by more than this (cosine) are rejected
+		constexpr float MinNormalCosine{ 0.2f };
+
+		constexpr uint32_t InvalidIndex{ UINT32_MAX };
+
+		struct Quadric
+		{
+			double a2{}, ab{}, ac{}, ad{};
+			double b2{}, bc{}, bd{};
+			double c2{}, cd{};
+			double d2{};
+
+			// Sum of the plane weights, dividing by it turns the weighted sum back into a distance
+			double weight{};
+
+			static Quadric FromPlane(double a, double b, double c, double d, double weight) {
+				return Quadric{
+					a * a * weight, a * b * weight, a * c * weight, a * d * weight,
+					b * b * weight, b * c * weight, b * d * weight,
+					c * c * weight, c * d * weight,
+					d * d * weight,
+					weight };
+			}
+
+			Quadric& operator+=(const Quadric& q) {
+				a2 += q.a2; ab += q.ab; ac += q.ac; ad += q.ad;
+				b2 += q.b2; bc += q.bc; bd += q.bd;
+				c2 += q.c2; cd += q.cd;
+				d2 += q.d2;
+				weight += q.weight;
+				return *this;
+			}
+
+			// Weighted sum of squared distances of p to every accumulated plane
+			double Evaluate(const Vector3& p) const {
+				const double x{ p.x }, y{ p.y }, z{ p.z };
+				return a2 * x * x + 2 * ab * x * y + 2 * ac * x * z + 2 * ad * x
+					+ b2 * y * y + 2 * bc * y * z + 2 * bd * y
+					+ c2 * z * z + 2 * cd * z
+					+ d2;
+			}
+
+			// Weighted mean squared distance of p to the planes, in world units whatever the plane weights are
+			double EvaluateSqrDistance(const Vector3& p) const {
+				return (weight > 0.0) ? Evaluate(p) / weight : 0.0;
+			}
+		};
+
+		struct Face
+		{
+			uint32_t corners[3]{};
+			bool hasTwin{ false };
+			bool alive{ true };
+		};
+
+		struct Collapse
+		{
+			double cost{};
+			uint32_t from{};
+			uint32_t to{};
+			uint32_t fromStamp{};
+			uint32_t toStamp{};
+
+			bool operator>(const Collapse& other) const { return cost > other.cost; }
+		};
+
+		static uint64_t EdgeKey(uint32_t a, uint32_t b) {
+			if (a > b) {
+				std::swap(a, b);
+			}
+			return (uint64_t(a) << 32) | b;
+		}
+
+		static Vector3 FaceNormal(const Vector3& p0, const Vector3& p1, const Vector3& p2) {
+			return Vector3::Cross(p1 - p0, p2 - p0);
+		}
+
+		std::vector<uint32_t> Simplify(const std::vector<VertexUV>& vertices, const std::vector<uint32_t>& indices,
+			size_t targetIndexCount, float maxError, float* pResultError) {
+
+			if (pResultError) {
+				*pResultError = 0.0f;
+			}
+
+			// Group vertices by position, collapses happen between groups
+			std::unordered_map<uint64_t, std::vector<uint32_t>> positionBuckets{};
+			std::vector<uint32_t> vertexGroup(vertices.size(), InvalidIndex);
+			std::vector<Vector3> groupPositions{};
+			std::vector<std::vector<uint32_t>> groupMembers{};
+
+			for (uint32_t v{ 0 }; v < vertices.size(); ++v) {
+				const Vector3& p{ vertices[v].position };
+				uint32_t bits[3]{};
+				std::memcpy(bits, &p.x, sizeof(float));
+				std::memcpy(bits + 1, &p.y, sizeof(float));
+				std::memcpy(bits + 2, &p.z, sizeof(float));
+				const uint64_t hash{ (uint64_t(bits[0]) * 73856093u) ^ (uint64_t(bits[1]) * 19349663u) ^ (uint64_t(bits[2]) * 83492791u) };
+
+				std::vector<uint32_t>& bucket{ positionBuckets[hash] };
+				for (uint32_t group : bucket) {
+					const Vector3& other{ groupPositions[group] };
+					if (other.x == p.x && other.y == p.y && other.z == p.z) {
+						vertexGroup[v] = group;
+						break;
+					}
+				}
+
+				if (vertexGroup[v] == InvalidIndex) {
+					vertexGroup[v] = uint32_t(groupPositions.size());
+					bucket.push_back(vertexGroup[v]);
+					groupPositions.push_back(p);
+					groupMembers.emplace_back();
+				}
+				groupMembers[vertexGroup[v]].push_back(v);
+			}
+
+			const size_t groupCount{ groupPositions.size() };
+
+			// Unique faces, the double sided copies made by the OBJ parser are kept as twins
+			std::vector<Face> faces{};
+			std::unordered_map<uint64_t, uint32_t> faceLookup{};
+			faces.reserve(indices.size() / 3);
+
+			for (size_t i{ 0 }; i + 2 < indices.size(); i += 3) {
+				uint32_t sorted[3]{ indices[i], indices[i + 1], indices[i + 2] };
+				std::sort(sorted, sorted + 3);
+				const uint64_t key{ (uint64_t(sorted[0]) << 42) ^ (uint64_t(sorted[1]) << 21) ^ sorted[2] };
+
+				auto it{ faceLookup.find(key) };
+				if (it != faceLookup.end()) {
+					const Face& existing{ faces[it->second] };
+					uint32_t existingSorted[3]{ existing.corners[0], existing.corners[1], existing.corners[2] };
+					std::sort(existingSorted, existingSorted + 3);
+					if (std::equal(sorted, sorted + 3, existingSorted)) {
+						faces[it->second].hasTwin = true;
+						continue;
+					}
+				}
+
+				faceLookup[key] = uint32_t(faces.size());
+				faces.push_back(Face{ { indices[i], indices[i + 1], indices[i + 2] } });
+			}
+
+			size_t liveIndexCount{ 0 };
+			for (const Face& face : faces) {
+				liveIndexCount += face.hasTwin ? 6 : 3;
+			}
+
+			// Plane quadrics and face adjacency per group
+			std::vector<Quadric> quadrics(groupCount);
+			std::vector<std::vector<uint32_t>> groupFaces(groupCount);
+			std::unordered_map<uint64_t, uint32_t> edgeFaceCount{};
+
+			for (uint32_t f{ 0 }; f < faces.size(); ++f) {
+				const uint32_t g0{ vertexGroup[faces[f].corners[0]] };
+				const uint32_t g1{ vertexGroup[faces[f].corners[1]] };
+				const uint32_t g2{ vertexGroup[faces[f].corners[2]] };
+
+				Vector3 normal{ FaceNormal(groupPositions[g0], groupPositions[g1], groupPositions[g2]) };
+				const float doubleArea{ normal.Magnitude() };
+				if (doubleArea > 0.0f) {
+					normal /= doubleArea;
+					const Quadric q{ Quadric::FromPlane(normal.x, normal.y, normal.z, -Vector3::Dot(normal, groupPositions[g0]), doubleArea * 0.5) };
+					quadrics[g0] += q;
+					quadrics[g1] += q;
+					quadrics[g2] += q;
+				}
+
+				const uint32_t groups[3]{ g0, g1, g2 };
+				for (size_t c{ 0 }; c < 3; ++c) {
+					groupFaces[groups[c]].push_back(f);
+					++edgeFaceCount[EdgeKey(groups[c], groups[(c + 1) % 3])];
+				}
+			}
+
+			// Border constraints
+			for (const Face& face : faces) {
+				const uint32_t groups[3]{ vertexGroup[face.corners[0]], vertexGroup[face.corners[1]], vertexGroup[face.corners[2]] };
+				const Vector3 faceNormal{ FaceNormal(groupPositions[groups[0]], groupPositions[groups[1]], groupPositions[groups[2]]) };
+
+				for (size_t c{ 0 }; c < 3; ++c) {
+					const uint32_t a{ groups[c] };
+					const uint32_t b{ groups[(c + 1) % 3] };
+					if (edgeFaceCount[EdgeKey(a, b)] != 1) {
+						continue;
+					}
+
+					const Vector3 edge{ groupPositions[b] - groupPositions[a] };
+					Vector3 normal{ Vector3::Cross(edge, faceNormal) };
+					const float length{ normal.Magnitude() };
+					if (length > 0.0f) {
+						normal /= length;
+						const Quadric q{ Quadric::FromPlane(normal.x, normal.y, normal.z, -Vector3::Dot(normal, groupPositions[a]), edge.SqrMagnitude() * BorderWeight) };
+						quadrics[a] += q;
+						quadrics[b] += q;
+					}
+				}
+			}
+
+			// Collapse queue, entries go stale when one of their groups changes
+			std::vector<uint32_t> groupStamps(groupCount, 0);
+			std::vector<bool> groupAlive(groupCount, true);
+			std::priority_queue<Collapse, std::vector<Collapse>, std::greater<Collapse>> queue{};
+
+			std::vector<uint32_t> neighbours{};
+			auto gatherNeighbours = [&](uint32_t group) {
+				neighbours.clear();
+				for (uint32_t f : groupFaces[group]) {
+					if (!faces[f].alive) {
+						continue;
+					}
+					for (uint32_t corner : faces[f].corners) {
+						const uint32_t other{ vertexGroup[corner] };
+						if (other != group && std::find(neighbours.begin(), neighbours.end(), other) == neighbours.end()) {
+							neighbours.push_back(other);
+						}
+					}
+				}
+			};
+
+			auto pushCollapses = [&](uint32_t group) {
+				gatherNeighbours(group);
+				for (uint32_t other : neighbours) {
+					Quadric q{ quadrics[group] };
+					q += quadrics[other];
+
+					const double toOther{ q.EvaluateSqrDistance(groupPositions[other]) };
+					const double toGroup{ q.EvaluateSqrDistance(groupPositions[group]) };
+					if (toOther <= toGroup) {
+						queue.push(Collapse{ toOther, group, other, groupStamps[group], groupStamps[other] });
+					}
+					else {
+						queue.push(Collapse{ toGroup, other, group, groupStamps[other], groupStamps[group] });
+					}
+				}
+			};
+
+			for (uint32_t g{ 0 }; g < groupCount; ++g) {
+				pushCollapses(g);
+			}
+
+			// Would moving group 'from' onto 'to' flip or squash any remaining triangle
+			auto flipsFaces = [&](uint32_t from, uint32_t to) {
+				for (uint32_t f : groupFaces[from]) {
+					const Face& face{ faces[f] };
+					if (!face.alive) {
+						continue;
+					}
+
+					Vector3 before[3]{};
+					Vector3 after[3]{};
+					bool collapses{ false };
+					for (size_t c{ 0 }; c < 3; ++c) {
+						const uint32_t group{ vertexGroup[face.corners[c]] };
+						collapses |= (group == to);
+						before[c] = groupPositions[group];
+						after[c] = (group == from) ? groupPositions[to] : before[c];
+					}
+
+					if (collapses) {
+						continue;
+					}
+
+					const Vector3 normalBefore{ FaceNormal(before[0], before[1], before[2]) };
+					const Vector3 normalAfter{ FaceNormal(after[0], after[1], after[2]) };
+					const float lengths{ normalBefore.Magnitude() * normalAfter.Magnitude() };
+					if (lengths <= 0.0f || Vector3::Dot(normalBefore, normalAfter) < MinNormalCosine * lengths) {
+						return true;
+					}
+				}
+				return false;
+			};
+
+			// Picks the vertex of 'to' that continues the attributes of vertex 'from'
+			auto findTargetVertex = [&](uint32_t vertex, uint32_t fromGroup, uint32_t toGroup) {
+				for (uint32_t f : groupFaces[fromGroup]) {
+					const Face& face{ faces[f] };
+					if (!face.alive || std::find(face.corners, face.corners + 3, vertex) == face.corners + 3) {
+						continue;
+					}
+					for (uint32_t corner : face.corners) {
+						if (vertexGroup[corner] == toGroup) {
+							return corner;
+						}
+					}
+				}
+
+				// Not connected, fall back to the closest uv with a similar normal
+				uint32_t best{ groupMembers[toGroup].front() };
+				float bestDistance{ FLT_MAX };
+				for (uint32_t candidate : groupMembers[toGroup]) {
+					const float uvDistance{ (vertices[candidate].uv - vertices[vertex].uv).SqrMagnitude() };
+					const float normalPenalty{ 1.0f - Vector3::Dot(vertices[candidate].normal, vertices[vertex].normal) };
+					if (uvDistance + normalPenalty < bestDistance) {
+						bestDistance = uvDistance + normalPenalty;
+						best = candidate;
+					}
+				}
+				return best;
+			};
+
+			const double maxCost{ double(maxError) * maxError };
+			double resultCost{ 0.0 };
+
+			while (liveIndexCount > targetIndexCount && !queue.empty()) {
+				const Collapse collapse{ queue.top() };
+				queue.pop();
+
+				if (!groupAlive[collapse.from] || !groupAlive[collapse.to] ||
+					groupStamps[collapse.from] != collapse.fromStamp || groupStamps[collapse.to] != collapse.toStamp) {
+					continue;
+				}
+
+				if (collapse.cost > maxCost) {
+					break;
+				}
+
+				if (flipsFaces(collapse.from, collapse.to)) {
+					continue;
+				}
+
+				// Move every vertex of the removed group onto a vertex of the kept group
+				std::vector<std::pair<uint32_t, uint32_t>> vertexRemap{};
+				for (uint32_t vertex : groupMembers[collapse.from]) {
+					vertexRemap.emplace_back(vertex, findTargetVertex(vertex, collapse.from, collapse.to));
+				}
+
+				for (uint32_t f : groupFaces[collapse.from]) {
+					Face& face{ faces[f] };
+					if (!face.alive) {
+						continue;
+					}
+
+					bool degenerate{ false };
+					for (uint32_t& corner : face.corners) {
+						if (vertexGroup[corner] == collapse.to) {
+							degenerate = true;
+						}
+						for (const auto& remap : vertexRemap) {
+							if (corner == remap.first) {
+								corner = remap.second;
+								break;
+							}
+						}
+					}
+
+					if (degenerate) {
+						face.alive = false;
+						liveIndexCount -= face.hasTwin ? 6 : 3;
+					}
+					else {
+						groupFaces[collapse.to].push_back(f);
+					}
+				}
+
+				quadrics[collapse.to] += quadrics[collapse.from];
+				groupAlive[collapse.from] = false;
+				groupFaces[collapse.from].clear();
+				++groupStamps[collapse.to];
+				resultCost = std::max(resultCost, collapse.cost);
+
+				// Drop dead faces and requeue the new edges around the kept group
+				auto& keptFaces{ groupFaces[collapse.to] };
+				keptFaces.erase(std::remove_if(keptFaces.begin(), keptFaces.end(), [&](uint32_t f) { return !faces[f].alive; }), keptFaces.end());
+				pushCollapses(collapse.to);
+			}
+
+			if (pResultError) {
+				*pResultError = float(sqrt(resultCost));
+			}
+
+			// Emit the remaining faces in their original winding, followed by their twin
+			std::vector<uint32_t> result{};
+			result.reserve(liveIndexCount);
+			for (const Face& face : faces) {
+				if (!face.alive) {
+					continue;
+				}
+
+				result.insert(result.end(), face.corners, face.corners + 3);
+				if (face.hasTwin) {
+					result.push_back(face.corners[0]);
+					result.push_back(face.corners[2]);
+					result.push_back(face.corners[1]);
+				}
+			}
+
+			return result;
+		}
+	}
+}
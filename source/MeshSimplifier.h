@@ -0,0 +1,15 @@
+#pragma once
+#include "DataTypes.h"
+
+namespace dae
+{
+	namespace MeshSimplifier
+	{
+		// Quadric error edge-collapse simplification of a triangle list.
+		// Collapses happen on positions so uv and normal seams stay closed, and the vertices are kept in place:
+		// the returned indices reference the input vertices so every level of detail shares one vertex buffer.
+		// Stops at targetIndexCount or when the next collapse would move the surface further than maxError.
+		std::vector<uint32_t> Simplify(const std::vector<VertexUV>& vertices, const std::vector<uint32_t>& indices,
+			size_t targetIndexCount, float maxError = FLT_MAX, float* pResultError = nullptr);
+	}
+}
@@ -1,8 +1,11 @@
 #include "pch.h"
+#include <bit>
+#include <emmintrin.h>
 #include "Renderer.h"
 #include "Utils.h"
 #include "Texture.h"
 #include "Effect.h"
+#include "FastMath.h"
 
 Renderer::Renderer(SDL_Window* pWindow) :
 	m_pWindow(pWindow)
@@ -34,9 +37,8 @@ Renderer::Renderer(SDL_Window* pWindow) :
 
 Renderer::~Renderer()
 {
-	// Delete meshes
-	delete m_pVehicleMesh;
-	delete m_pFireMesh;
+	// Delete meshes and materials while the device is alive
+	m_Scene.Clear();
 
 	// Delete software buffer
 	delete[] m_pDepthBufferPixels;
@@ -70,14 +72,37 @@ void Renderer::Update(const Timer* pTimer)
 	m_Camera.Update(pTimer);
 
 	if (m_ShouldRotate) {
-		m_pVehicleMesh->Update(pTimer->GetElapsed());
-		m_pFireMesh->Update(pTimer->GetElapsed());
+		m_Scene.Update(pTimer->GetElapsed());
+	}
+
+	m_Scene.Cull(m_Camera);
+
+	// Anything that moved invalidates the presented frame
+	if (m_Camera.hasChanged || m_Scene.HasChanged()) {
+		m_IsFrameDirty = true;
 	}
 }
 
 
-void Renderer::Render()
+bool Renderer::Render()
 {
+	// A change restarts the frames needed for the image to settle
+	if (m_IsFrameDirty) {
+		m_SettleFrameCount = GetSettleFrameCount();
+		m_IsFrameDirty = false;
+	}
+
+	// Settled since the last change, show the frame again instead of rendering the same image
+	if (m_SettleFrameCount == 0) {
+		if (m_RenderMode == RenderMode::software) {
+			SDL_UpdateWindowSurface(m_pWindow);
+		}
+		return false;
+	}
+
+	--m_SettleFrameCount;
+	m_Scene.ClearChanged();
+
 	switch (m_RenderMode) {
 		case RenderMode::software:
 			RenderSoftware();
@@ -86,6 +111,27 @@ void Renderer::Render()
 			RenderHardware();
 			break;
 	}
+	return true;
+}
+
+void Renderer::InvalidateFrame() {
+	m_IsFrameDirty = true;
+}
+
+uint32_t Renderer::GetSettleFrameCount() const {
+
+	if (m_RenderMode != RenderMode::software) {
+		return 1;
+	}
+
+	// Reprojected pixels are shaded again when their refresh slot comes up, one slot per frame
+	uint32_t frameCount{ m_UseTemporalReprojection ? TemporalRefreshPeriod : 1 };
+
+	// Each checkerboard colour is only shaded every other frame, both have to come up after every slot
+	if (m_UseCheckerboard) {
+		frameCount *= 2;
+	}
+	return frameCount;
 }
 
 HRESULT Renderer::InitializeDirectX()
@@ -231,12 +277,13 @@ HRESULT Renderer::InitializeDirectX()
 	m_pDevice->CreateSamplerState(&samplerStateDesc, &m_pLinearSamplerState);
 
 	samplerStateDesc.Filter = D3D11_FILTER_ANISOTROPIC;
+	samplerStateDesc.MaxAnisotropy = Texture::MaxAnisotropy;
 	m_pDevice->CreateSamplerState(&samplerStateDesc, &m_pAnisotropicSamplerState);
 
 	return result;
 }
 
-void Renderer::RenderHardware() const{
+void Renderer::RenderHardware() {
 	if (!m_IsInitialized)
 		return;
 
@@ -274,11 +321,20 @@ void Renderer::RenderHardware() const{
 			break;
 	}
 
-	// Drawing
-	m_pVehicleMesh->RenderHardware(m_pDeviceContext, m_Camera, samplerState);
+	// Drawing, one instanced call per batch with the transparent ones blended over the opaque ones
+	for (const Scene::DrawBatch& batch : m_Scene.GetBatches()) {
+		if (!m_Scene.GetMaterial(batch.material).isTransparent) {
+			BindBatch(batch).RenderHardware(m_pDeviceContext, m_Camera, samplerState, m_Lights);
+		}
+	}
+
 	if (m_DrawFireMesh) {
 		m_pDeviceContext->RSSetState(m_pRasterState_NoCulling);
-		m_pFireMesh->RenderHardware(m_pDeviceContext, m_Camera, samplerState);
+		for (const Scene::DrawBatch& batch : m_Scene.GetBatches()) {
+			if (m_Scene.GetMaterial(batch.material).isTransparent) {
+				BindBatch(batch).RenderHardware(m_pDeviceContext, m_Camera, samplerState, m_Lights);
+			}
+		}
 	}
 
 	// Swap buffers
@@ -288,29 +344,234 @@ void Renderer::RenderHardware() const{
 	
 void Renderer::RenderSoftware(){
 
+	const uint64_t frameStart{ SDL_GetPerformanceCounter() };
+
+	SetRenderResolution();
+	UpdateShadingRates();
+
 	SDL_LockSurface(m_pBackBuffer);
 
-	// Clear buffers
+	// Clear buffers, the internal target is packed at the start of the back buffer
 	ColorRGB clearColor{ (m_UseUniformBackground) ? colors::Uniform : colors::Software };
-	SDL_FillRect(m_pBackBuffer, NULL, SDL_MapRGB(m_pBackBuffer->format, Uint8(255 * clearColor.r), Uint8(255 * clearColor.g), Uint8(255 * clearColor.b)));
-	std::fill_n(m_pDepthBufferPixels, m_Width * m_Height, FLT_MAX);
+	std::fill_n(m_pBackBufferPixels, m_RenderWidth * m_RenderHeight, SDL_MapRGB(m_pBackBuffer->format, Uint8(255 * clearColor.r), Uint8(255 * clearColor.g), Uint8(255 * clearColor.b)));
+	std::fill_n(m_pDepthBufferPixels, m_RenderWidth * m_RenderHeight, FLT_MAX);
+	std::fill(m_HiZ.begin(), m_HiZ.end(), FLT_MAX);
+	std::fill(m_HiZDirty.begin(), m_HiZDirty.end(), uint8_t(0));
+	std::fill_n(m_LinearDepth.begin(), m_RenderWidth * m_RenderHeight, FLT_MAX);
+	m_MeshletStats = {};
+	m_TriangleSizeHistogram = {};
+	m_ShadingStats = {};
+	m_LightStats = {};
+	m_EntityStats = {};
+
+	// History from a differently sized frame can't be reprojected
+	if (m_History.width != m_RenderWidth || m_History.height != m_RenderHeight) {
+		m_History.isValid = false;
+	}
+	m_History.draws.resize(m_Scene.GetEntityCount());
+
+	if (m_UseShadows) {
+		RenderShadowMap();
+	}
 
-	// Add objects to the render vector
-	std::vector<Mesh*> m_Meshes;
-	m_Meshes.push_back(m_pVehicleMesh);
+	// Render the visible opaque entities batch by batch, entities of a batch share the mesh's buffers and the vertex cache.
+	// With occlusion culling only the ones seen last frame are drawn here, their depth then hides the rest.
+	m_IsEntityVisible.assign(m_Scene.GetEntityCount(), 0);
+	if (m_WasEntityVisible.size() != m_IsEntityVisible.size()) {
+		m_WasEntityVisible.assign(m_IsEntityVisible.size(), 0);
+	}
 
-	// Render each mesh
-	for (auto& mesh : m_Meshes) {
-		std::vector<Vertex_Out> verts;
+	for (const Scene::DrawBatch& batch : m_Scene.GetBatches()) {
+		if (m_Scene.GetMaterial(batch.material).isTransparent) {
+			continue;
+		}
 
-		verts = VertexShader(*mesh);
-		verts = InterPolateAttributes(*mesh, verts);
-		PixelShader(*mesh, verts);
+		const Mesh& mesh{ BindBatch(batch) };
+		for (size_t index{ 0 }; index < batch.entities.size(); ++index) {
+			++m_EntityStats.inFrustum;
+			if (!m_UseOcclusionCulling || m_WasEntityVisible[batch.entities[index]]) {
+				DrawEntity(mesh, batch.worldMatrices[index], batch.entities[index]);
+			}
+		}
+	}
+
+	// The other entities are tested against the depth drawn so far, walking the hierarchy so hidden groups are skipped whole
+	if (m_UseOcclusionCulling) {
+		m_Scene.QueryVisible(m_Camera, [this](const Vector3& center, float radius) {
+			return IsSphereOccluded(m_Camera.viewMatrix.TransformPoint(center), radius);
+		}, m_QueriedEntities);
+
+		for (EntityHandle entity : m_QueriedEntities) {
+			const Material material{ GetBoundMaterial(m_Scene.GetMaterialHandle(entity)) };
+			if (m_WasEntityVisible[entity] || material.isTransparent) {
+				continue;
+			}
+
+			Mesh& mesh{ m_Scene.GetMesh(m_Scene.GetMeshHandle(entity)) };
+			mesh.SetMaterial(material);
+			mesh.SetInstances({ m_Scene.GetWorldMatrix(entity) });
+			mesh.SelectLOD(m_Camera, float(m_Height));
+			DrawEntity(mesh, m_Scene.GetWorldMatrix(entity), entity);
+		}
+	}
+	m_WasEntityVisible.swap(m_IsEntityVisible);
+
+	// Keep this frame for the reprojection and shading rates of the next one
+	if (m_UseTemporalReprojection || m_UseVariableRateShading || m_UseCheckerboard) {
+		const size_t pixelCount{ size_t(m_RenderWidth) * m_RenderHeight };
+		std::copy_n(m_pBackBufferPixels, pixelCount, m_History.colors.begin());
+		std::copy_n(m_LinearDepth.begin(), pixelCount, m_History.depths.begin());
+		m_History.width = m_RenderWidth;
+		m_History.height = m_RenderHeight;
+		m_History.isValid = true;
+		++m_History.frameIndex;
 	}
 
 	SDL_UnlockSurface(m_pBackBuffer);
-	SDL_BlitSurface(m_pBackBuffer, 0, m_pFrontBuffer, 0);
+
+	// Full resolution frames are copied as before, smaller ones are filtered up to the window
+	if (m_RenderWidth == m_Width && m_RenderHeight == m_Height) {
+		SDL_BlitSurface(m_pBackBuffer, 0, m_pFrontBuffer, 0);
+	}
+	else if (m_pFrontBuffer->format->format != m_pBackBuffer->format->format) {
+		// The packed target is only a valid surface with its own pitch, let SDL convert and stretch it
+		SDL_Surface* pRenderTarget{ SDL_CreateRGBSurfaceWithFormatFrom(m_pBackBufferPixels, m_RenderWidth, m_RenderHeight, 32, m_RenderWidth * 4, m_pBackBuffer->format->format) };
+		SDL_BlitScaled(pRenderTarget, 0, m_pFrontBuffer, 0);
+		SDL_FreeSurface(pRenderTarget);
+	}
+	else {
+		UpscaleToFrontBuffer();
+	}
 	SDL_UpdateWindowSurface(m_pWindow);
+
+	const float frameTime{ float(SDL_GetPerformanceCounter() - frameStart) / SDL_GetPerformanceFrequency() };
+	UpdateResolutionScale(frameTime);
+}
+
+void Renderer::SetRenderResolution() {
+
+	m_RenderWidth = Clamp(int(m_Width * m_ResolutionScale + 0.5f), 2, m_Width);
+	m_RenderHeight = Clamp(int(m_Height * m_ResolutionScale + 0.5f), 2, m_Height);
+
+	m_HiZWidth = (m_RenderWidth + HiZTileSize - 1) / HiZTileSize;
+	m_HiZHeight = (m_RenderHeight + HiZTileSize - 1) / HiZTileSize;
+
+	m_LightTilesX = (m_RenderWidth + LightTileSize - 1) / LightTileSize;
+	m_LightTilesY = (m_RenderHeight + LightTileSize - 1) / LightTileSize;
+	m_TileLights.resize(size_t(m_LightTilesX) * m_LightTilesY);
+}
+
+void Renderer::RenderShadowMap() {
+
+	// The first directional light casts the shadows
+	int lightIndex{ -1 };
+	for (size_t index{ 0 }; index < m_Lights.size(); ++index) {
+		if (m_Lights[index].type == LightType::directional) {
+			lightIndex = int(index);
+			break;
+		}
+	}
+
+	m_ShadowMap.SetLightIndex(lightIndex);
+	if (lightIndex < 0) {
+		return;
+	}
+
+	// Every opaque entity casts, also the ones outside the camera's view
+	std::vector<ShadowMap::Caster> casters{};
+	casters.reserve(m_Scene.GetEntityCount());
+	for (EntityHandle entity{ 0 }; entity < m_Scene.GetEntityCount(); ++entity) {
+		if (!m_Scene.GetMaterial(m_Scene.GetMaterialHandle(entity)).isTransparent) {
+			casters.push_back({ &m_Scene.GetMesh(m_Scene.GetMeshHandle(entity)), m_Scene.GetWorldMatrix(entity) });
+		}
+	}
+
+	m_ShadowMap.Render(m_Camera, m_Lights[lightIndex].direction, casters);
+}
+
+void Renderer::UpdateResolutionScale(float frameTime) {
+
+	if (!m_UseDynamicResolution) {
+		m_ResolutionScale = 1.0f;
+		return;
+	}
+
+	// Smooth out single slow frames so the resolution doesn't jump around
+	const float smoothing{ 0.1f };
+	m_SmoothedFrameTime = (m_SmoothedFrameTime <= 0.0f) ? frameTime : m_SmoothedFrameTime + (frameTime - m_SmoothedFrameTime) * smoothing;
+
+	// Frame cost scales with the pixel count, so the scale on each axis goes with the square root
+	const float targetScale{ Clamp(m_ResolutionScale * sqrtf(m_FrameTimeBudget / m_SmoothedFrameTime), MinResolutionScale, 1.0f) };
+
+	// Only resize when the change is worth it
+	const float minScaleStep{ 0.05f };
+	if (targetScale != m_ResolutionScale && (std::abs(targetScale - m_ResolutionScale) >= minScaleStep || targetScale == 1.0f)) {
+		m_ResolutionScale = targetScale;
+
+		// Render again at the new size, otherwise a still frame keeps its temporary resolution
+		m_IsFrameDirty = true;
+	}
+}
+
+void Renderer::UpscaleToFrontBuffer() {
+
+	// Bilinear filter with 7 bit weights, two neighbouring texels of two rows are blended per output pixel in SSE2 registers
+	const int weightBits{ 7 };
+	const int weightOne{ 1 << weightBits };
+
+	// Source texel and horizontal weight per output column, the pair x0, x0 + 1 always lies inside the row
+	m_UpscaleColumns.resize(m_Width);
+	for (int x{ 0 }; x < m_Width; ++x) {
+		const float sourceX{ Clamp((x + 0.5f) * m_RenderWidth / m_Width - 0.5f, 0.0f, float(m_RenderWidth - 1)) };
+		int x0{ int(sourceX) };
+		int weight{ int((sourceX - x0) * weightOne + 0.5f) };
+		if (x0 >= m_RenderWidth - 1) {
+			x0 = m_RenderWidth - 2;
+			weight = weightOne;
+		}
+		m_UpscaleColumns[x] = { x0, weight };
+	}
+
+	SDL_LockSurface(m_pFrontBuffer);
+
+	const uint32_t* pSource{ m_pBackBufferPixels };
+	uint8_t* pDestination{ static_cast<uint8_t*>(m_pFrontBuffer->pixels) };
+	const __m128i zero{ _mm_setzero_si128() };
+
+	for (int y{ 0 }; y < m_Height; ++y) {
+
+		const float sourceY{ Clamp((y + 0.5f) * m_RenderHeight / m_Height - 0.5f, 0.0f, float(m_RenderHeight - 1)) };
+		int y0{ int(sourceY) };
+		int weightY{ int((sourceY - y0) * weightOne + 0.5f) };
+		if (y0 >= m_RenderHeight - 1) {
+			y0 = m_RenderHeight - 2;
+			weightY = weightOne;
+		}
+
+		const uint32_t* pRow0{ pSource + y0 * m_RenderWidth };
+		const uint32_t* pRow1{ pRow0 + m_RenderWidth };
+		uint32_t* pOut{ reinterpret_cast<uint32_t*>(pDestination + y * m_pFrontBuffer->pitch) };
+		const __m128i rowWeight{ _mm_set1_epi16(short(weightY)) };
+
+		for (int x{ 0 }; x < m_Width; ++x) {
+			const UpscaleColumn& column{ m_UpscaleColumns[x] };
+
+			// Texels x0 and x0 + 1 widened to 16 bit channels
+			const __m128i top{ _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(pRow0 + column.x0)), zero) };
+			const __m128i bottom{ _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(pRow1 + column.x0)), zero) };
+
+			// Vertical blend, the difference times the weight stays inside 16 bit
+			const __m128i vertical{ _mm_add_epi16(top, _mm_srai_epi16(_mm_mullo_epi16(_mm_sub_epi16(bottom, top), rowWeight), weightBits)) };
+
+			// Horizontal blend of the left and right texel
+			const __m128i right{ _mm_srli_si128(vertical, 8) };
+			const __m128i blended{ _mm_add_epi16(vertical, _mm_srai_epi16(_mm_mullo_epi16(_mm_sub_epi16(right, vertical), _mm_set1_epi16(short(column.weight))), weightBits)) };
+
+			pOut[x] = uint32_t(_mm_cvtsi128_si32(_mm_packus_epi16(blended, zero)));
+		}
+	}
+
+	SDL_UnlockSurface(m_pFrontBuffer);
 }
 
 void Renderer::InitSoftware(SDL_Window* pWindow) {
@@ -320,6 +581,16 @@ void Renderer::InitSoftware(SDL_Window* pWindow) {
 	m_pBackBufferPixels = (uint32_t*)m_pBackBuffer->pixels;
 
 	m_pDepthBufferPixels = new float[m_Width * m_Height];
+
+	// Max depth per tile for the meshlet occlusion test, sized for the full window
+	SetRenderResolution();
+	m_HiZ.resize(size_t(m_HiZWidth) * m_HiZHeight, FLT_MAX);
+
+	m_LinearDepth.resize(size_t(m_Width) * m_Height, FLT_MAX);
+	m_History.colors.resize(m_LinearDepth.size());
+	m_History.depths.resize(m_LinearDepth.size(), FLT_MAX);
+	m_FragmentIndices.resize(m_LinearDepth.size(), -1);
+	m_HiZDirty.resize(m_HiZ.size(), 0);
 }
 
 void Renderer::InitMeshes() {
@@ -329,277 +600,1004 @@ void Renderer::InitMeshes() {
 	//  --Vehicle mesh--
 	//
 	Utils::ParseOBJ("Resources/vehicle.obj", vertices, indices);
-	m_pVehicleMesh = new Mesh(m_pDevice, vertices, indices);
+	m_VehicleMesh = m_Scene.AddMesh(new Mesh(m_pDevice, vertices, indices));
 
-	// Load Textures
-	Texture* diffuseMap = new Texture();
-	diffuseMap->LoadFromFile(m_pDevice, "Resources/vehicle_diffuse.png");
-
-	Texture* normalMap = new Texture();
-	normalMap->LoadFromFile(m_pDevice, "Resources/vehicle_normal.png");
-
-	Texture* specularMap = new Texture();
-	specularMap->LoadFromFile(m_pDevice, "Resources/vehicle_specular.png");
-
-	Texture* glossyMap = new Texture();
-	glossyMap->LoadFromFile(m_pDevice, "Resources/vehicle_gloss.png");
-
-	m_pVehicleMesh->SetMaps(diffuseMap, normalMap, specularMap, glossyMap);
-	m_pVehicleMesh->SetPosition({ 0.0f, 0.0f, 50.0f });
+	// Load Textures, shared with any other material using the same files
+	TextureCache& textures{ m_Scene.GetTextures() };
+	Material material{};
+	material.pDiffuseMap = textures.Acquire(m_pDevice, "Resources/vehicle_diffuse.png", TexelFormat::color, CompressTextures);
+	material.pNormalMap = textures.Acquire(m_pDevice, "Resources/vehicle_normal.png", TexelFormat::normal, CompressTextures);
+	material.pSpecularMap = textures.Acquire(m_pDevice, "Resources/vehicle_specular.png", TexelFormat::color, CompressTextures);
+	material.pGlossyMap = textures.Acquire(m_pDevice, "Resources/vehicle_gloss.png", TexelFormat::color, CompressTextures);
 
 	// Load effect
-	Effect* effect = new Effect_Vertex(m_pDevice);
-	effect->Initialize();
-	m_pVehicleMesh->SetEffect(effect);
+	material.pEffect = new Effect_Vertex(m_pDevice);
+	material.pEffect->Initialize();
+	m_VehicleMaterial = m_Scene.AddMaterial(material);
+
+	m_Scene.CreateEntity(m_VehicleMesh, m_VehicleMaterial, { 0.0f, 0.0f, 50.0f }, VehicleRotationSpeed);
 
 	//  --Fire FX mesh--
 	//
 	Utils::ParseOBJ("Resources/fireFX.obj", vertices, indices);
-	m_pFireMesh = new Mesh(m_pDevice, vertices, indices);
+	const MeshHandle fireMesh{ m_Scene.AddMesh(new Mesh(m_pDevice, vertices, indices)) };
 
 	// Load Textures
-	diffuseMap = new Texture();
-	diffuseMap->LoadFromFile(m_pDevice, "Resources/fireFX_diffuse.png");
-	m_pFireMesh->SetMaps(diffuseMap);
-	m_pFireMesh->SetPosition({ 0.0f, 0.0f, 50.0f });
+	material = {};
+	material.pDiffuseMap = textures.Acquire(m_pDevice, "Resources/fireFX_diffuse.png", TexelFormat::color, CompressTextures);
+	material.isTransparent = true;
 
 	// Load effect
-	effect = new Effect_DiffuseAlpha(m_pDevice);
-	effect->Initialize();
-	m_pFireMesh->SetEffect(effect);
+	material.pEffect = new Effect_DiffuseAlpha(m_pDevice);
+	material.pEffect->Initialize();
+	const MaterialHandle fireMaterial{ m_Scene.AddMaterial(material) };
+
+	m_Scene.CreateEntity(fireMesh, fireMaterial, { 0.0f, 0.0f, 50.0f }, VehicleRotationSpeed);
 }
 
-std::vector<Vertex_Out> Renderer::VertexShader(const Mesh& mesh) {
+void Renderer::DrawEntity(const Mesh& mesh, const Matrix& worldMatrix, EntityHandle entity) {
 
-	std::vector<VertexUV> vertices_in{mesh.GetVertices()};
-	std::vector<Vertex_Out> vertices_out{};
-	vertices_out.reserve(vertices_in.size());
-	Matrix worldMatrix{ mesh.GetWorldMatrix() };
-	Matrix WVPMatrix{ worldMatrix * m_Camera.viewMatrix * m_Camera.projectionMatrix };
+	std::vector<Vertex_Out> verts;
 
-	for (const VertexUV& vertex : vertices_in) {
+	ResetVertexCache(mesh, worldMatrix);
+	verts = InterPolateAttributes(mesh);
+	PixelShader(mesh, verts, entity);
 
-		// Init out vertex
-		Vertex_Out vertexOut{};
-		vertexOut.position = { vertex.position.x, vertex.position.y, vertex.position.z, 1 };
-		vertexOut.uv = vertex.uv;
-		vertexOut.normal = vertex.normal;
-		vertexOut.tangent = vertex.tangent;
+	// Entities that left no fragment stay out of the first pass next frame
+	m_IsEntityVisible[entity] = verts.empty() ? 0 : 1;
+	++m_EntityStats.drawn;
+}
 
-		// World to NDC space
-		vertexOut.position = WVPMatrix.TransformPoint(vertexOut.position);
+Mesh& Renderer::BindBatch(const Scene::DrawBatch& batch) {
 
-		// Perspective divide
-		vertexOut.position.x /= vertexOut.position.w;
-		vertexOut.position.y /= vertexOut.position.w;
-		vertexOut.position.z /= vertexOut.position.w;
+	// Meshes only hold the state of the batch drawn last
+	Mesh& mesh{ m_Scene.GetMesh(batch.mesh) };
+	mesh.SetMaterial(GetBoundMaterial(batch.material));
+	mesh.SetInstances(batch.worldMatrices);
+	mesh.SelectLOD(m_Camera, float(m_Height));
+	return mesh;
+}
 
-		// Transform normal and tangent To World space
-		vertexOut.normal = worldMatrix.TransformVector(vertexOut.normal);
-		vertexOut.tangent = worldMatrix.TransformVector(vertexOut.tangent);
+Material Renderer::GetBoundMaterial(MaterialHandle handle) const {
 
-		// Calculate viewDirection
-		vertexOut.viewDirection = worldMatrix.TransformPoint(vertex.position) - m_Camera.origin;
-		vertexOut.viewDirection.Normalize();
+	// Without packed materials the separate maps are sampled, as if the scene never packed them
+	Material material{ m_Scene.GetMaterial(handle) };
+	if (!m_UsePackedMaterials) {
+		material.pDiffuseGlossMap = nullptr;
+		material.pNormalSpecularMap = nullptr;
+	}
+	return material;
+}
+
+void Renderer::ResetVertexCache(const Mesh& mesh, const Matrix& worldMatrix) {
 
-		vertices_out.emplace_back(vertexOut);
+	const size_t vertexCount{ mesh.GetVertices().size() };
+	if (m_VertexCache.vertices.size() < vertexCount) {
+		m_VertexCache.vertices.resize(vertexCount);
+		m_VertexCache.stamps.resize(vertexCount, 0);
 	}
 
-	return vertices_out;
-}
+	// A new stamp invalidates every cached vertex without touching the buffers
+	++m_VertexCache.currentStamp;
+	if (m_VertexCache.currentStamp == 0) {
+		std::fill(m_VertexCache.stamps.begin(), m_VertexCache.stamps.end(), 0);
+		m_VertexCache.currentStamp = 1;
+	}
 
-void Renderer::PixelShader(const Mesh& mesh, const std::vector<Vertex_Out>& verts) {
-	
-	for (const auto& vertex : verts) {
-		ColorRGB finalColor{ mesh.PixelShading(vertex, m_ShadingMode, m_UseNormalMap) };
+	m_VertexCache.worldMatrix = worldMatrix;
+	m_VertexCache.WVPMatrix = m_VertexCache.worldMatrix * m_Camera.viewMatrix * m_Camera.projectionMatrix;
+}
 
-		//Update Color in Buffer
-		finalColor.MaxToOne();
+const Vertex_Out& Renderer::FetchVertex(const Mesh& mesh, uint32_t index) {
 
-		m_pBackBufferPixels[int(vertex.position.x) + (int(vertex.position.y) * m_Width)] = SDL_MapRGB(m_pBackBuffer->format,
-			static_cast<uint8_t>(finalColor.r * 255),
-			static_cast<uint8_t>(finalColor.g * 255),
-			static_cast<uint8_t>(finalColor.b * 255));
+	Vertex_Out& vertexOut{ m_VertexCache.vertices[index] };
+	if (m_VertexCache.stamps[index] != m_VertexCache.currentStamp) {
+		VertexShader(mesh.GetVertices()[index], vertexOut);
+		m_VertexCache.stamps[index] = m_VertexCache.currentStamp;
 	}
+
+	return vertexOut;
 }
 
-std::vector<Vertex_Out> Renderer::InterPolateAttributes(const Mesh& mesh, const std::vector<Vertex_Out>& verts) {
-	
-	std::vector<uint32_t> indices{ mesh.GetIndices() };
-	std::vector<Vertex_Out> vertices_out{};
-	
-	for (int triangleIndex{ 0 }; triangleIndex + 2 < indices.size(); ++triangleIndex) {
+void Renderer::VertexShader(const VertexUV& vertex, Vertex_Out& vertexOut) const {
 
-		// Get correct indexes based on the mesh's topology
-		int index0{}, index1{}, index2{};
-		if (mesh.primitiveTopology == PrimitiveTopology::TriangleList) {
+	const Matrix& worldMatrix{ m_VertexCache.worldMatrix };
 
-			index0 = indices[triangleIndex + 0];
-			index1 = indices[triangleIndex + 1];
-			index2 = indices[triangleIndex + 2];
-			triangleIndex += 2;
+	// Init out vertex
+	vertexOut.position = { vertex.position.x, vertex.position.y, vertex.position.z, 1 };
+	vertexOut.uv = vertex.uv;
+	vertexOut.normal = vertex.normal;
+	vertexOut.tangent = vertex.tangent;
+
+	// World to NDC space
+	vertexOut.position = m_VertexCache.WVPMatrix.TransformPoint(vertexOut.position);
+
+	// Perspective divide
+	vertexOut.position.x /= vertexOut.position.w;
+	vertexOut.position.y /= vertexOut.position.w;
+	vertexOut.position.z /= vertexOut.position.w;
+
+	// To Screen Space
+	vertexOut.position.x = (vertexOut.position.x + 1) * m_RenderWidth / 2;
+	vertexOut.position.y = (-vertexOut.position.y + 1) * m_RenderHeight / 2;
+
+	// Transform normal and tangent To World space
+	vertexOut.normal = worldMatrix.TransformVector(vertexOut.normal);
+	vertexOut.tangent = worldMatrix.TransformVector(vertexOut.tangent);
+
+	// Calculate viewDirection
+	vertexOut.worldPosition = worldMatrix.TransformPoint(vertex.position);
+	vertexOut.viewDirection = vertexOut.worldPosition - m_Camera.origin;
+	FastMath::Normalize(vertexOut.viewDirection);
+}
+
+void Renderer::PixelShader(const Mesh& mesh, const std::vector<Vertex_Out>& verts, EntityHandle entity) {
+
+	if (verts.empty()) {
+		return;
+	}
+
+	// Clip space of this frame to clip space of the last one, through object space so the entity's own motion is included
+	DrawHistory& drawHistory{ m_History.draws[entity] };
+	const bool hasHistory{ m_History.isValid && drawHistory.drawnFrame + 1 == m_History.frameIndex };
+	const Matrix reprojectionMatrix{ hasHistory ? Matrix::Inverse(m_VertexCache.WVPMatrix) * drawHistory.WVPMatrix : Matrix{} };
+	const bool canReproject{ m_UseTemporalReprojection && hasHistory };
+
+	// Resolve the visible fragment of every pixel first, overdrawn fragments are never shaded
+	Int2 pMin{ m_RenderWidth, m_RenderHeight }, pMax{ -1, -1 };
+	for (size_t fragmentIndex{ 0 }; fragmentIndex < verts.size(); ++fragmentIndex) {
+		const Vertex_Out& vertex{ verts[fragmentIndex] };
+		const int px{ int(vertex.position.x) };
+		const int py{ int(vertex.position.y) };
+		const int pixelIndex{ px + (py * m_RenderWidth) };
+
+		m_FragmentIndices[pixelIndex] = int(fragmentIndex);
+		m_LinearDepth[pixelIndex] = vertex.position.w;
+
+		pMin = { std::min(pMin.x, px), std::min(pMin.y, py) };
+		pMax = { std::max(pMax.x, px), std::max(pMax.y, py) };
+	}
+
+	CullLights(pMin, pMax);
+
+	// Shade tile by tile at the tile's shading rate
+	for (int tileY{ pMin.y / ShadingRateTileSize }; tileY <= pMax.y / ShadingRateTileSize; ++tileY) {
+		for (int tileX{ pMin.x / ShadingRateTileSize }; tileX <= pMax.x / ShadingRateTileSize; ++tileX) {
+
+			const Int2 rate{ GetShadingRateSize(m_ShadingRates[tileX + tileY * m_ShadingRateTilesX]) };
+			const int tileEndX{ std::min((tileX + 1) * ShadingRateTileSize, pMax.x + 1) };
+			const int tileEndY{ std::min((tileY + 1) * ShadingRateTileSize, pMax.y + 1) };
+
+			for (int blockY{ tileY * ShadingRateTileSize }; blockY < tileEndY; blockY += rate.y) {
+				for (int blockX{ tileX * ShadingRateTileSize }; blockX < tileEndX; blockX += rate.x) {
+					const int prefetchX{ blockX + TexelPrefetchDistance * rate.x };
+					if (prefetchX <= pMax.x) {
+						const int prefetchIndex{ m_FragmentIndices[prefetchX + blockY * m_RenderWidth] };
+						if (prefetchIndex >= 0) {
+							mesh.PrefetchTexels(verts[prefetchIndex], m_UseNormalMap);
+						}
+					}
+
+					ShadeCoarsePixel(mesh, verts, blockX, blockY, std::min(rate.x, tileEndX - blockX), std::min(rate.y, tileEndY - blockY),
+						canReproject ? &reprojectionMatrix : nullptr);
+				}
+			}
+		}
+	}
+
+	// Fill in the checkerboard pixels skipped this frame
+	if (!m_CheckerboardPixels.empty()) {
+		ReconstructCheckerboard(mesh, verts, hasHistory ? &reprojectionMatrix : nullptr);
+	}
+
+	for (const auto& vertex : verts) {
+		m_FragmentIndices[int(vertex.position.x) + (int(vertex.position.y) * m_RenderWidth)] = -1;
+	}
+
+	drawHistory.WVPMatrix = m_VertexCache.WVPMatrix;
+	drawHistory.drawnFrame = m_History.frameIndex;
+}
+
+void Renderer::ShadeCoarsePixel(const Mesh& mesh, const std::vector<Vertex_Out>& verts, int x, int y, int width, int height, const Matrix* pReprojectionMatrix) {
+
+	// The sample in the middle of the coarse pixel is shaded for the whole block
+	bool hasSharedColor{ false };
+	uint32_t sharedColor{};
+	float sharedDepth{};
+	int sharedIndex{ -1 };
+
+	if (width * height > 1) {
+		const int centerIndex{ (x + width / 2) + (y + height / 2) * m_RenderWidth };
+		const int fragmentIndex{ m_FragmentIndices[centerIndex] };
+		if (fragmentIndex >= 0) {
+			sharedColor = ShadePixel(mesh, verts[fragmentIndex]);
+			sharedDepth = verts[fragmentIndex].position.w;
+			sharedIndex = centerIndex;
+			hasSharedColor = true;
+
+			m_pBackBufferPixels[centerIndex] = sharedColor;
+			++m_ShadingStats.shaded;
 		}
+	}
 
-		if (mesh.primitiveTopology == PrimitiveTopology::TriangleStrip) {
+	const uint32_t refreshSlot{ m_History.frameIndex % TemporalRefreshPeriod };
+	for (int py{ y }; py < y + height; ++py) {
+		for (int px{ x }; px < x + width; ++px) {
 
-			index0 = indices[triangleIndex + 0];
-			if (triangleIndex % 2 == 0) {
-				index1 = indices[triangleIndex + 1];
-				index2 = indices[triangleIndex + 2];
+			const int pixelIndex{ px + (py * m_RenderWidth) };
+			const int fragmentIndex{ m_FragmentIndices[pixelIndex] };
+			if (fragmentIndex < 0 || pixelIndex == sharedIndex) {
+				continue;
 			}
-			else {
-				index1 = indices[triangleIndex + 2];
-				index2 = indices[triangleIndex + 1];
+			const Vertex_Out& vertex{ verts[fragmentIndex] };
+
+			// Reuse last frame's colour unless the pixel was hidden there or is due for a refresh
+			if (pReprojectionMatrix && ((px & 3) + (py & 1) * 4) != int(refreshSlot)) {
+				uint32_t historyColor{};
+				if (Reproject(*pReprojectionMatrix, vertex.position, historyColor)) {
+					m_pBackBufferPixels[pixelIndex] = historyColor;
+					++m_ShadingStats.reprojected;
+					continue;
+				}
 			}
 
-			if (index0 == index1 || index1 == index2 || index2 == index0) {
+			// Samples on the same surface as the shaded one take its colour, depth stays per pixel
+			if (hasSharedColor && std::abs(vertex.position.w - sharedDepth) <= ShadingRateDepthTolerance * sharedDepth) {
+				m_pBackBufferPixels[pixelIndex] = sharedColor;
+				++m_ShadingStats.broadcast;
 				continue;
 			}
+
+			// Full rate pixels of the other checkerboard colour are reconstructed once their neighbours are shaded
+			if (m_UseCheckerboard && width * height == 1 && ((px + py + m_History.frameIndex) & 1) != 0) {
+				m_CheckerboardPixels.push_back(pixelIndex);
+				continue;
+			}
+
+			const uint32_t color{ ShadePixel(mesh, vertex) };
+			m_pBackBufferPixels[pixelIndex] = color;
+			++m_ShadingStats.shaded;
+
+			if (!hasSharedColor) {
+				sharedColor = color;
+				sharedDepth = vertex.position.w;
+				hasSharedColor = true;
+			}
 		}
+	}
+}
+
+void Renderer::ReconstructCheckerboard(const Mesh& mesh, const std::vector<Vertex_Out>& verts, const Matrix* pReprojectionMatrix) {
+
+	const SDL_PixelFormat* pFormat{ m_pBackBuffer->format };
+	const std::array<uint32_t, 3> masks{ pFormat->Rmask, pFormat->Gmask, pFormat->Bmask };
+	const std::array<uint8_t, 3> shifts{ pFormat->Rshift, pFormat->Gshift, pFormat->Bshift };
+	const std::array<Int2, 4> offsets{ Int2{ -1, 0 }, Int2{ 1, 0 }, Int2{ 0, -1 }, Int2{ 0, 1 } };
+
+	for (int pixelIndex : m_CheckerboardPixels) {
+
+		const Vertex_Out& vertex{ verts[m_FragmentIndices[pixelIndex]] };
+		const int px{ pixelIndex % m_RenderWidth };
+		const int py{ pixelIndex / m_RenderWidth };
+		const float depth{ vertex.position.w };
+
+		// Range and sum of the direct neighbours on the same surface, they were all shaded this frame
+		std::array<uint32_t, 3> minimum{ 255, 255, 255 }, maximum{ 0, 0, 0 }, sum{ 0, 0, 0 };
+		int neighbourCount{ 0 };
+		for (const Int2& offset : offsets) {
+			const int nx{ px + offset.x };
+			const int ny{ py + offset.y };
+			if (nx < 0 || nx >= m_RenderWidth || ny < 0 || ny >= m_RenderHeight) {
+				continue;
+			}
+
+			const int neighbourIndex{ nx + ny * m_RenderWidth };
+			const int fragmentIndex{ m_FragmentIndices[neighbourIndex] };
+			if (fragmentIndex < 0 || std::abs(verts[fragmentIndex].position.w - depth) > ShadingRateDepthTolerance * depth) {
+				continue;
+			}
 
-		// Render triangle
-		Vertex_Out v0 = verts[index0];
-		Vertex_Out v1 = verts[index1];
-		Vertex_Out v2 = verts[index2];
+			const uint32_t color{ m_pBackBufferPixels[neighbourIndex] };
+			for (int channel{ 0 }; channel < 3; ++channel) {
+				const uint32_t value{ (color & masks[channel]) >> shifts[channel] };
+				minimum[channel] = std::min(minimum[channel], value);
+				maximum[channel] = std::max(maximum[channel], value);
+				sum[channel] += value;
+			}
+			++neighbourCount;
+		}
 
-		// Culling triangles out of view
-		if (abs(v0.position.x) > 1 || abs(v0.position.y) > 1 || v0.position.z < 0 || v0.position.z > 1) {
+		// Last frame shaded this pixel, its colour is kept inside the neighbourhood's range against ghosting
+		uint32_t historyColor{};
+		if (pReprojectionMatrix && Reproject(*pReprojectionMatrix, vertex.position, historyColor)) {
+			if (neighbourCount > 0) {
+				uint32_t clampedColor{ historyColor & ~(masks[0] | masks[1] | masks[2]) };
+				for (int channel{ 0 }; channel < 3; ++channel) {
+					const uint32_t value{ (historyColor & masks[channel]) >> shifts[channel] };
+					clampedColor |= std::min(std::max(value, minimum[channel]), maximum[channel]) << shifts[channel];
+				}
+				historyColor = clampedColor;
+			}
+			m_pBackBufferPixels[pixelIndex] = historyColor;
+			++m_ShadingStats.reconstructed;
 			continue;
 		}
-		if (abs(v1.position.x) > 1 || abs(v1.position.y) > 1 || v1.position.z < 0 || v1.position.z > 1) {
+
+		// Disoccluded, the neighbours' average stands in
+		if (neighbourCount > 0) {
+			uint32_t averageColor{ m_pBackBufferPixels[pixelIndex] & ~(masks[0] | masks[1] | masks[2]) };
+			for (int channel{ 0 }; channel < 3; ++channel) {
+				averageColor |= ((sum[channel] + neighbourCount / 2) / neighbourCount) << shifts[channel];
+			}
+			m_pBackBufferPixels[pixelIndex] = averageColor;
+			++m_ShadingStats.reconstructed;
 			continue;
 		}
-		if (abs(v2.position.x) > 1 || abs(v2.position.y) > 1 || v2.position.z < 0 || v2.position.z > 1) {
+
+		// Nothing to rebuild it from, on an edge or a lone pixel
+		m_pBackBufferPixels[pixelIndex] = ShadePixel(mesh, vertex);
+		++m_ShadingStats.shaded;
+	}
+
+	m_CheckerboardPixels.clear();
+}
+
+uint32_t Renderer::ShadePixel(const Mesh& mesh, const Vertex_Out& vertex) const {
+
+	const int tileIndex{ int(vertex.position.x) / LightTileSize + (int(vertex.position.y) / LightTileSize) * m_LightTilesX };
+	ColorRGB finalColor{ mesh.PixelShading(vertex, m_ShadingMode, m_UseNormalMap, m_Filtering, m_Lights, m_TileLights[tileIndex],
+		(m_UseShadows && m_ShadowMap.GetLightIndex() >= 0) ? &m_ShadowMap : nullptr, m_UseShadingCache && mesh.GetInstanceCount() == 1) };
+
+	//Update Color in Buffer
+	finalColor.MaxToOne();
+
+	return SDL_MapRGB(m_pBackBuffer->format,
+		static_cast<uint8_t>(finalColor.r * 255),
+		static_cast<uint8_t>(finalColor.g * 255),
+		static_cast<uint8_t>(finalColor.b * 255));
+}
+
+void Renderer::UpdateShadingRates() {
+
+	const int tilesX{ (m_RenderWidth + ShadingRateTileSize - 1) / ShadingRateTileSize };
+	const int tilesY{ (m_RenderHeight + ShadingRateTileSize - 1) / ShadingRateTileSize };
+
+	// Rates of the last frame, a coarse tile is measured across its blocks instead of inside them
+	const bool hasPreviousRates{ tilesX == m_ShadingRateTilesX && tilesY == m_ShadingRateTilesY };
+	m_PreviousShadingRates.swap(m_ShadingRates);
+	m_ShadingRates.assign(size_t(tilesX) * tilesY, ShadingRate::rate1x1);
+	m_ShadingRateTilesX = tilesX;
+	m_ShadingRateTilesY = tilesY;
+
+	if (!m_UseVariableRateShading) {
+		return;
+	}
+
+	// An explicit rate image wins over the measured rates, it is stretched over the tile grid
+	if (!m_ShadingRateImage.empty()) {
+		for (int tileY{ 0 }; tileY < tilesY; ++tileY) {
+			for (int tileX{ 0 }; tileX < tilesX; ++tileX) {
+				const int imageX{ tileX * m_ShadingRateImageWidth / tilesX };
+				const int imageY{ tileY * m_ShadingRateImageHeight / tilesY };
+				m_ShadingRates[tileX + tileY * tilesX] = m_ShadingRateImage[imageX + imageY * m_ShadingRateImageWidth];
+			}
+		}
+		return;
+	}
+
+	if (!m_History.isValid || m_History.width != m_RenderWidth || m_History.height != m_RenderHeight) {
+		return;
+	}
+
+	// Average luminance step between neighbours of last frame, per axis
+	for (int tileY{ 0 }; tileY < tilesY; ++tileY) {
+		for (int tileX{ 0 }; tileX < tilesX; ++tileX) {
+
+			const int tileIndex{ tileX + tileY * tilesX };
+			const Int2 step{ hasPreviousRates ? GetShadingRateSize(m_PreviousShadingRates[tileIndex]) : Int2{ 1, 1 } };
+			const int startX{ tileX * ShadingRateTileSize };
+			const int startY{ tileY * ShadingRateTileSize };
+			const int endX{ std::min(startX + ShadingRateTileSize, m_RenderWidth) };
+			const int endY{ std::min(startY + ShadingRateTileSize, m_RenderHeight) };
+
+			float gradientX{}, gradientY{};
+			int countX{}, countY{};
+			for (int py{ startY }; py < endY; ++py) {
+				for (int px{ startX }; px < endX; ++px) {
+					const float luminance{ GetLuminance(m_History.colors[px + py * m_RenderWidth]) };
+					if (px + step.x < endX) {
+						gradientX += std::abs(GetLuminance(m_History.colors[(px + step.x) + py * m_RenderWidth]) - luminance) / step.x;
+						++countX;
+					}
+					if (py + step.y < endY) {
+						gradientY += std::abs(GetLuminance(m_History.colors[px + (py + step.y) * m_RenderWidth]) - luminance) / step.y;
+						++countY;
+					}
+				}
+			}
+			gradientX = (countX > 0) ? gradientX / countX : 0.0f;
+			gradientY = (countY > 0) ? gradientY / countY : 0.0f;
+
+			ShadingRate& rate{ m_ShadingRates[tileIndex] };
+			if (std::max(gradientX, gradientY) < ShadingRateFlatThreshold) {
+				rate = ShadingRate::rate4x4;
+			}
+			else if (std::max(gradientX, gradientY) < ShadingRateSmoothThreshold) {
+				rate = ShadingRate::rate2x2;
+			}
+			else if (gradientY < ShadingRateSmoothThreshold) {
+				rate = ShadingRate::rate1x2;
+			}
+		}
+	}
+}
+
+Int2 Renderer::GetShadingRateSize(ShadingRate rate) const {
+	switch (rate) {
+		case ShadingRate::rate1x2:
+			return { 1, 2 };
+		case ShadingRate::rate2x2:
+			return { 2, 2 };
+		case ShadingRate::rate4x4:
+			return { 4, 4 };
+		default:
+			return { 1, 1 };
+	}
+}
+
+float Renderer::GetLuminance(uint32_t color) const {
+	const SDL_PixelFormat* pFormat{ m_pBackBuffer->format };
+	const uint32_t r{ (color & pFormat->Rmask) >> pFormat->Rshift };
+	const uint32_t g{ (color & pFormat->Gmask) >> pFormat->Gshift };
+	const uint32_t b{ (color & pFormat->Bmask) >> pFormat->Bshift };
+	return 0.299f * r + 0.587f * g + 0.114f * b;
+}
+
+bool Renderer::Reproject(const Matrix& reprojectionMatrix, const Vector4& pixelPosition, uint32_t& historyColor) const {
+
+	// Back from screen space to clip space, w is the view depth and gives the exact clip depth
+	const float w{ pixelPosition.w };
+	const Vector4 clipPosition{
+		(pixelPosition.x * 2.0f / m_RenderWidth - 1.0f) * w,
+		(1.0f - pixelPosition.y * 2.0f / m_RenderHeight) * w,
+		(w - m_Camera.zNear) * m_Camera.zFar / (m_Camera.zFar - m_Camera.zNear),
+		w };
+
+	const Vector4 previousPosition{ reprojectionMatrix.TransformPoint(clipPosition) };
+	if (previousPosition.w <= m_Camera.zNear) {
+		return false;
+	}
+
+	const int previousX{ int((previousPosition.x / previousPosition.w + 1) * m_RenderWidth / 2 + 0.5f) };
+	const int previousY{ int((-previousPosition.y / previousPosition.w + 1) * m_RenderHeight / 2 + 0.5f) };
+	if (previousX < 0 || previousX >= m_RenderWidth || previousY < 0 || previousY >= m_RenderHeight) {
+		return false;
+	}
+
+	// Disocclusion, something else was in front of this surface in the last frame
+	const int previousIndex{ previousX + previousY * m_RenderWidth };
+	if (std::abs(m_History.depths[previousIndex] - previousPosition.w) > TemporalDepthTolerance * previousPosition.w) {
+		return false;
+	}
+
+	historyColor = m_History.colors[previousIndex];
+	return true;
+}
+
+std::vector<Vertex_Out> Renderer::InterPolateAttributes(const Mesh& mesh) {
+	
+	const std::vector<uint32_t>& indices{ mesh.GetIndices() };
+	const MeshLOD& lod{ mesh.GetCurrentLOD() };
+	std::vector<Vertex_Out> vertices_out{};
+
+	// Triangle lists are rasterized per meshlet so hidden clusters are rejected before any triangle work
+	if (mesh.primitiveTopology == PrimitiveTopology::TriangleList) {
+
+		const std::vector<MeshOptimizer::Meshlet>& meshlets{ mesh.GetMeshlets() };
+		for (uint32_t meshletIndex{ lod.meshletOffset }; meshletIndex < lod.meshletOffset + lod.meshletCount; ++meshletIndex) {
+
+			const MeshOptimizer::Meshlet& meshlet{ meshlets[meshletIndex] };
+			++m_MeshletStats.total;
+			if (CullMeshlet(meshlet)) {
+				continue;
+			}
+
+			for (uint32_t index{ meshlet.indexOffset }; index < meshlet.indexOffset + meshlet.indexCount; index += 3) {
+				RasterizeTriangle(FetchVertex(mesh, indices[index]), FetchVertex(mesh, indices[index + 1]), FetchVertex(mesh, indices[index + 2]), vertices_out);
+			}
+		}
+
+		return vertices_out;
+	}
+
+	const int indexEnd{ int(lod.indexOffset + lod.indexCount) };
+	for (int triangleIndex{ int(lod.indexOffset) }; triangleIndex + 2 < indexEnd; ++triangleIndex) {
+
+		// Get correct indexes based on the mesh's topology
+		uint32_t index0{ indices[triangleIndex + 0] }, index1{}, index2{};
+		if (triangleIndex % 2 == 0) {
+			index1 = indices[triangleIndex + 1];
+			index2 = indices[triangleIndex + 2];
+		}
+		else {
+			index1 = indices[triangleIndex + 2];
+			index2 = indices[triangleIndex + 1];
+		}
+
+		if (index0 == index1 || index1 == index2 || index2 == index0) {
 			continue;
 		}
 
-		// Cull base on cull mode
-		Vector3 TriangleNormal{ (v0.normal + v1.normal + v2.normal)/3 };
-		if ( m_CullMode == CullMode::back && Vector3::Dot(TriangleNormal, m_Camera.forward) > 0) {
+		// Render triangle, vertices are shaded once and reused through the cache
+		RasterizeTriangle(FetchVertex(mesh, index0), FetchVertex(mesh, index1), FetchVertex(mesh, index2), vertices_out);
+	}
+
+	return vertices_out;
+}
+
+bool Renderer::CullMeshlet(const MeshOptimizer::Meshlet& meshlet) {
+
+	// Frustum, bounding sphere in view space against the side, near and far planes
+	const Vector3 worldCenter{ m_VertexCache.worldMatrix.TransformPoint(meshlet.center) };
+	const Vector3 viewCenter{ m_Camera.viewMatrix.TransformPoint(worldCenter) };
+	const float radius{ meshlet.radius };
+
+	if (m_Camera.IsSphereOutsideFrustum(viewCenter, radius)) {
+		++m_MeshletStats.frustumCulled;
+		return true;
+	}
+
+	// Normal cone, matches the per triangle test on the averaged vertex normal
+	if (m_CullMode != CullMode::none && meshlet.coneSin <= 1.0f) {
+		const Vector3 coneAxis{ m_VertexCache.worldMatrix.TransformVector(meshlet.coneAxis) };
+		const float facing{ Vector3::Dot(coneAxis, m_Camera.forward) };
+
+		if ((m_CullMode == CullMode::back && facing > meshlet.coneSin) || (m_CullMode == CullMode::front && facing < -meshlet.coneSin)) {
+			++m_MeshletStats.coneCulled;
+			return true;
+		}
+	}
+
+	if (IsSphereOccluded(viewCenter, radius)) {
+		++m_MeshletStats.occlusionCulled;
+		return true;
+	}
+
+	return false;
+}
+
+bool Renderer::IsSphereOccluded(const Vector3& viewCenter, float radius) {
+
+	// Hi-Z, nearest depth of the sphere against the farthest depth already drawn under its screen rect
+	const float nearestZ{ viewCenter.z - radius };
+	if (nearestZ <= m_Camera.zNear) {
+		return false;
+	}
+
+	const Vector4 nearestPoint{ m_Camera.projectionMatrix.TransformPoint(Vector4{ viewCenter.x, viewCenter.y, nearestZ, 1.0f }) };
+	const float nearestDepth{ nearestPoint.z / nearestPoint.w };
+
+	Int2 rectMin{}, rectMax{};
+	GetSphereScreenRect(viewCenter, radius, rectMin, rectMax);
+
+	const int tileMinX{ Clamp(rectMin.x / HiZTileSize, 0, m_HiZWidth - 1) };
+	const int tileMaxX{ Clamp(rectMax.x / HiZTileSize, 0, m_HiZWidth - 1) };
+	const int tileMinY{ Clamp(rectMin.y / HiZTileSize, 0, m_HiZHeight - 1) };
+	const int tileMaxY{ Clamp(rectMax.y / HiZTileSize, 0, m_HiZHeight - 1) };
+
+	for (int tileY{ tileMinY }; tileY <= tileMaxY; ++tileY) {
+		for (int tileX{ tileMinX }; tileX <= tileMaxX; ++tileX) {
+			if (nearestDepth <= GetHiZ(tileX, tileY)) {
+				return false;
+			}
+		}
+	}
+
+	return true;
+}
+
+bool Renderer::GetSphereScreenRect(const Vector3& viewCenter, float radius, Int2& pMin, Int2& pMax) const {
+
+	// A sphere crossing the near plane can cover any part of the screen
+	const float nearestZ{ viewCenter.z - radius };
+	if (nearestZ <= m_Camera.zNear) {
+		pMin = { 0, 0 };
+		pMax = { m_RenderWidth - 1, m_RenderHeight - 1 };
+		return false;
+	}
+
+	// Screen rect of the box around the sphere, the projected corners bound it
+	const float tanX{ m_Camera.fov * m_Camera.aspectRatio };
+	const float tanY{ m_Camera.fov };
+	const float farthestZ{ viewCenter.z + radius };
+	const float minNDCX{ std::min((viewCenter.x - radius) / nearestZ, (viewCenter.x - radius) / farthestZ) / tanX };
+	const float maxNDCX{ std::max((viewCenter.x + radius) / nearestZ, (viewCenter.x + radius) / farthestZ) / tanX };
+	const float minNDCY{ std::min((viewCenter.y - radius) / nearestZ, (viewCenter.y - radius) / farthestZ) / tanY };
+	const float maxNDCY{ std::max((viewCenter.y + radius) / nearestZ, (viewCenter.y + radius) / farthestZ) / tanY };
+
+	pMin = { int((minNDCX + 1) * m_RenderWidth / 2), int((-maxNDCY + 1) * m_RenderHeight / 2) };
+	pMax = { int((maxNDCX + 1) * m_RenderWidth / 2), int((-minNDCY + 1) * m_RenderHeight / 2) };
+	return true;
+}
+
+void Renderer::CullLights(const Int2& pMin, const Int2& pMax) {
+
+	const int tileMinX{ pMin.x / LightTileSize };
+	const int tileMaxX{ pMax.x / LightTileSize };
+	const int tileMinY{ pMin.y / LightTileSize };
+	const int tileMaxY{ pMax.y / LightTileSize };
+	const int tileCountX{ tileMaxX - tileMinX + 1 };
+
+	// Depth span of the mesh's visible pixels in every tile it covers
+	std::vector<Vector2> depthBounds{};
+	depthBounds.reserve(size_t(tileCountX) * (tileMaxY - tileMinY + 1));
+	for (int tileY{ tileMinY }; tileY <= tileMaxY; ++tileY) {
+		for (int tileX{ tileMinX }; tileX <= tileMaxX; ++tileX) {
+
+			Vector2 bounds{ FLT_MAX, 0.0f };
+			const int endX{ std::min((tileX + 1) * LightTileSize, m_RenderWidth) };
+			const int endY{ std::min((tileY + 1) * LightTileSize, m_RenderHeight) };
+			for (int py{ tileY * LightTileSize }; py < endY; ++py) {
+				for (int px{ tileX * LightTileSize }; px < endX; ++px) {
+					const int pixelIndex{ px + py * m_RenderWidth };
+					if (m_FragmentIndices[pixelIndex] >= 0) {
+						bounds.x = std::min(bounds.x, m_LinearDepth[pixelIndex]);
+						bounds.y = std::max(bounds.y, m_LinearDepth[pixelIndex]);
+					}
+				}
+			}
+
+			depthBounds.push_back(bounds);
+			m_TileLights[tileX + tileY * m_LightTilesX].clear();
+		}
+	}
+
+	for (uint32_t lightIndex{ 0 }; lightIndex < m_Lights.size(); ++lightIndex) {
+		const Light& light{ m_Lights[lightIndex] };
+
+		// Directional lights reach everything
+		if (light.type == LightType::directional) {
+			for (int tileY{ tileMinY }; tileY <= tileMaxY; ++tileY) {
+				for (int tileX{ tileMinX }; tileX <= tileMaxX; ++tileX) {
+					m_TileLights[tileX + tileY * m_LightTilesX].push_back(lightIndex);
+				}
+			}
 			continue;
 		}
 
-		if (m_CullMode == CullMode::front && Vector3::Dot(TriangleNormal, m_Camera.forward) < 0) {
+		// Spot lights are bounded by the sphere of their range as well
+		const Vector3 viewCenter{ m_Camera.viewMatrix.TransformPoint(light.position) };
+		const float nearestZ{ viewCenter.z - light.range };
+		const float farthestZ{ viewCenter.z + light.range };
+		if (farthestZ < m_Camera.zNear) {
 			continue;
 		}
 
-		// To Screen Space
-		v0.position.x = (v0.position.x + 1) * m_Width / 2;
-		v0.position.y = (-v0.position.y + 1) * m_Height / 2;
-		v1.position.x = (v1.position.x + 1) * m_Width / 2;
-		v1.position.y = (-v1.position.y + 1) * m_Height / 2;
-		v2.position.x = (v2.position.x + 1) * m_Width / 2;
-		v2.position.y = (-v2.position.y + 1) * m_Height / 2;
-
-		// Find bounding box
-		Int2 pMin{}, pMax{};
-		pMin.x = Clamp(int(std::min(v2.position.x, std::min(v0.position.x, v1.position.x))), 0, m_Width);
-		pMin.y = Clamp(int(std::min(v2.position.y, std::min(v0.position.y, v1.position.y))), 0, m_Height);
-		pMax.x = Clamp(int(std::max(v2.position.x, std::max(v0.position.x, v1.position.x))), 0, m_Width);
-		pMax.y = Clamp(int(std::max(v2.position.y, std::max(v0.position.y, v1.position.y))), 0, m_Height);
-
-		// Loop over pixels
-		for (int px{ pMin.x }; px <= pMax.x; ++px) {
-			for (int py{ pMin.y }; py <= pMax.y; ++py) {
-
-				Vector2 pixel{ float(px),float(py) };
-
-				// Visualize the bouding boxes
-				if (m_VisualizeBoundingBoxes) {
-					m_pBackBufferPixels[px + (py * m_Width)] = SDL_MapRGB(m_pBackBuffer->format,
-						static_cast<uint8_t>(255),
-						static_cast<uint8_t>(255),
-						static_cast<uint8_t>(255));
-					continue;
+		Int2 rectMin{}, rectMax{};
+		GetSphereScreenRect(viewCenter, light.range, rectMin, rectMax);
+
+		const int lightMinX{ std::max(tileMinX, rectMin.x / LightTileSize) };
+		const int lightMaxX{ std::min(tileMaxX, rectMax.x / LightTileSize) };
+		const int lightMinY{ std::max(tileMinY, rectMin.y / LightTileSize) };
+		const int lightMaxY{ std::min(tileMaxY, rectMax.y / LightTileSize) };
+
+		for (int tileY{ lightMinY }; tileY <= lightMaxY; ++tileY) {
+			for (int tileX{ lightMinX }; tileX <= lightMaxX; ++tileX) {
+				const Vector2& bounds{ depthBounds[(tileX - tileMinX) + (tileY - tileMinY) * tileCountX] };
+				if (nearestZ <= bounds.y && farthestZ >= bounds.x) {
+					m_TileLights[tileX + tileY * m_LightTilesX].push_back(lightIndex);
 				}
+			}
+		}
+	}
 
-				//Side A
-				Vector2 side{ v1.position.GetXY() - v0.position.GetXY() };
-				Vector2 pointToSide{ pixel - v0.position.GetXY() };
-				float w2{ Vector2::Cross(side,pointToSide) };
+	for (int tileY{ tileMinY }; tileY <= tileMaxY; ++tileY) {
+		for (int tileX{ tileMinX }; tileX <= tileMaxX; ++tileX) {
+			const uint32_t lightCount{ uint32_t(m_TileLights[tileX + tileY * m_LightTilesX].size()) };
+			++m_LightStats.tiles;
+			m_LightStats.lights += lightCount;
+			m_LightStats.maxLights = std::max(m_LightStats.maxLights, lightCount);
+		}
+	}
+}
 
-				//Side B
-				side = { v2.position.GetXY() - v1.position.GetXY() };
-				pointToSide = { pixel - v1.position.GetXY() };
-				float w0{ Vector2::Cross(side,pointToSide) };
+float Renderer::GetHiZ(int tileX, int tileY) {
 
-				//Side C
-				side = { v0.position.GetXY() - v2.position.GetXY() };
-				pointToSide = { pixel - v2.position.GetXY() };
-				float w1{ Vector2::Cross(side,pointToSide) };
+	const int tileIndex{ tileX + tileY * m_HiZWidth };
+	if (m_HiZDirty[tileIndex]) {
 
-				if (w0 >= 0 && w1 >= 0 && w2 >= 0) {
+		// Rebuild the tile lazily, depth only decreases so the old max can't be patched
+		float maxDepth{ 0.0f };
+		const int endX{ std::min((tileX + 1) * HiZTileSize, m_RenderWidth) };
+		const int endY{ std::min((tileY + 1) * HiZTileSize, m_RenderHeight) };
+		for (int py{ tileY * HiZTileSize }; py < endY; ++py) {
+			for (int px{ tileX * HiZTileSize }; px < endX; ++px) {
+				maxDepth = std::max(maxDepth, m_pDepthBufferPixels[px + (py * m_RenderWidth)]);
+			}
+		}
+
+		m_HiZ[tileIndex] = maxDepth;
+		m_HiZDirty[tileIndex] = 0;
+	}
 
-					// Calculate Barycentric weights
-					const float totalArea = w0 + w1 + w2;
-					w0 /= totalArea;
-					w1 /= totalArea;
-					w2 /= totalArea;
+	return m_HiZ[tileIndex];
+}
 
-					float interpolatedDepth{ 1.0f / (w0 * (1 / v0.position.z) + w1 * (1 / v1.position.z) + w2 * (1 / v2.position.z)) };
-					bool depthTestPassed{ interpolatedDepth < m_pDepthBufferPixels[px + (py * m_Width)] };
+void Renderer::RasterizeTriangle(const Vertex_Out& v0, const Vertex_Out& v1, const Vertex_Out& v2, std::vector<Vertex_Out>& vertices_out) {
+
+	// Culling triangles out of view
+	if (IsOutsideScreen(v0.position) || IsOutsideScreen(v1.position) || IsOutsideScreen(v2.position)) {
+		return;
+	}
 
-					if (depthTestPassed) {
+	// Cull base on cull mode
+	Vector3 TriangleNormal{ (v0.normal + v1.normal + v2.normal)/3 };
+	if ( m_CullMode == CullMode::back && Vector3::Dot(TriangleNormal, m_Camera.forward) > 0) {
+		return;
+	}
 
-						// Update Depth Buffer
-						m_pDepthBufferPixels[px + (py * m_Width)] = interpolatedDepth;
+	if (m_CullMode == CullMode::front && Vector3::Dot(TriangleNormal, m_Camera.forward) < 0) {
+		return;
+	}
 
-						// Visualize the depth buffer
-						if (m_VisualizeDepthBuffer) {
+	// Find bounding box
+	Int2 pMin{}, pMax{};
+	pMin.x = Clamp(int(std::min(v2.position.x, std::min(v0.position.x, v1.position.x))), 0, m_RenderWidth - 1);
+	pMin.y = Clamp(int(std::min(v2.position.y, std::min(v0.position.y, v1.position.y))), 0, m_RenderHeight - 1);
+	pMax.x = Clamp(int(std::max(v2.position.x, std::max(v0.position.x, v1.position.x))), 0, m_RenderWidth - 1);
+	pMax.y = Clamp(int(std::max(v2.position.y, std::max(v0.position.y, v1.position.y))), 0, m_RenderHeight - 1);
+
+	// Small triangles take the masked path
+	const int boxWidth{ pMax.x - pMin.x + 1 };
+	const int boxHeight{ pMax.y - pMin.y + 1 };
+	const int boxExtent{ std::max(boxWidth, boxHeight) };
+
+	int sizeBin{ 0 };
+	while (sizeBin + 1 < TriangleSizeBins && (1 << sizeBin) < boxExtent) {
+		++sizeBin;
+	}
+	++m_TriangleSizeHistogram[sizeBin];
 
-							float depthColor{ Remap(interpolatedDepth, 0.997f, 1.0f) };
+	SetUVGradients(v0, v1, v2);
 
-							m_pBackBufferPixels[px + (py * m_Width)] = SDL_MapRGB(m_pBackBuffer->format,
-								static_cast<uint8_t>(depthColor * 255),
-								static_cast<uint8_t>(depthColor * 255),
-								static_cast<uint8_t>(depthColor * 255));
-							continue;
-						}
+	if (boxExtent <= SmallTriangleSize && !m_VisualizeBoundingBoxes) {
+		RasterizeSmallTriangle(v0, v1, v2, pMin, boxWidth, boxHeight, vertices_out);
+		return;
+	}
 
-						// InterpolatedW
-						float interpolatedW{ 1.0f / (w0 * (1 / v0.position.w) + w1 * (1 / v1.position.w) + w2 * (1 / v2.position.w)) };
+	// Loop over pixels
+	for (int px{ pMin.x }; px <= pMax.x; ++px) {
+		for (int py{ pMin.y }; py <= pMax.y; ++py) {
 
-						// Interpolated UV
-						Vector2 interpolatedUV{ w0 * (v0.uv / v0.position.w) + w1 * (v1.uv / v1.position.w) + w2 * (v2.uv / v2.position.w) };
-						interpolatedUV *= interpolatedW;
+			Vector2 pixel{ float(px),float(py) };
 
-						// Interpolated Normal
-						Vector3 InterpolatedNormal{ w0 * (v0.normal / v0.position.w) + w1 * (v1.normal / v1.position.w) + w2 * (v2.normal / v2.position.w) };
-						InterpolatedNormal *= interpolatedW;
+			// Visualize the bouding boxes
+			if (m_VisualizeBoundingBoxes) {
+				m_pBackBufferPixels[px + (py * m_RenderWidth)] = SDL_MapRGB(m_pBackBuffer->format,
+					static_cast<uint8_t>(255),
+					static_cast<uint8_t>(255),
+					static_cast<uint8_t>(255));
+				continue;
+			}
 
-						// Interpolated Tangent
-						Vector3 InterpolatedTangent{ w0 * (v0.tangent / v0.position.w) + w1 * (v1.tangent / v1.position.w) + w2 * (v2.tangent / v2.position.w) };
-						InterpolatedTangent *= interpolatedW;
+			//Side A
+			Vector2 side{ v1.position.GetXY() - v0.position.GetXY() };
+			Vector2 pointToSide{ pixel - v0.position.GetXY() };
+			float w2{ Vector2::Cross(side,pointToSide) };
 
-						// Interpolated view direction
-						Vector3 InterpolatedViewDirection{ w0 * (v0.viewDirection / v0.position.w) + w1 * (v1.viewDirection / v1.position.w) + w2 * (v2.viewDirection / v2.position.w) };
-						InterpolatedViewDirection *= interpolatedW;
+			//Side B
+			side = { v2.position.GetXY() - v1.position.GetXY() };
+			pointToSide = { pixel - v1.position.GetXY() };
+			float w0{ Vector2::Cross(side,pointToSide) };
 
-						Vertex_Out pixelVertex{};
-						pixelVertex.position = { pixel.x, pixel.y, interpolatedDepth, interpolatedW };
-						pixelVertex.uv = interpolatedUV;
-						pixelVertex.normal = InterpolatedNormal.Normalized();
-						pixelVertex.tangent = InterpolatedTangent.Normalized();
-						pixelVertex.viewDirection = InterpolatedViewDirection.Normalized();
+			//Side C
+			side = { v0.position.GetXY() - v2.position.GetXY() };
+			pointToSide = { pixel - v2.position.GetXY() };
+			float w1{ Vector2::Cross(side,pointToSide) };
 
-						vertices_out.push_back(pixelVertex);
-					}
-				}
+			if (w0 >= 0 && w1 >= 0 && w2 >= 0) {
+
+				// Calculate Barycentric weights
+				const float totalArea = w0 + w1 + w2;
+				ShadeFragment(px, py, w0 / totalArea, w1 / totalArea, w2 / totalArea, v0, v1, v2, vertices_out);
 			}
 		}
 	}
+}
 
-	return vertices_out;
+void Renderer::RasterizeSmallTriangle(const Vertex_Out& v0, const Vertex_Out& v1, const Vertex_Out& v2, const Int2& pMin, int boxWidth, int boxHeight, std::vector<Vertex_Out>& vertices_out) {
+
+	// Edge functions as w = w(pMin) + stepX * dx + stepY * dy, set up once for the whole block
+	const float originX{ float(pMin.x) };
+	const float originY{ float(pMin.y) };
+
+	const float stepX2{ v0.position.y - v1.position.y };
+	const float stepY2{ v1.position.x - v0.position.x };
+	const float origin2{ stepY2 * (originY - v0.position.y) + stepX2 * (originX - v0.position.x) };
+
+	const float stepX0{ v1.position.y - v2.position.y };
+	const float stepY0{ v2.position.x - v1.position.x };
+	const float origin0{ stepY0 * (originY - v1.position.y) + stepX0 * (originX - v1.position.x) };
+
+	const float stepX1{ v2.position.y - v0.position.y };
+	const float stepY1{ v0.position.x - v2.position.x };
+	const float origin1{ stepY1 * (originY - v2.position.y) + stepX1 * (originX - v2.position.x) };
+
+	// The weights sum to the doubled area everywhere, only front facing triangles can cover pixels
+	const float totalArea{ origin0 + origin1 + origin2 };
+	if (totalArea <= 0.0f) {
+		return;
+	}
+
+	// Coverage mask of the whole block, bit x + y * SmallTriangleSize, one row of four pixels per compare.
+	// Pixels past the bounding box are tested too and masked off afterwards, so the loop has no branches.
+	const __m128 columns{ _mm_setr_ps(0.0f, 1.0f, 2.0f, 3.0f) };
+	const __m128 rowStart0{ _mm_add_ps(_mm_set1_ps(origin0), _mm_mul_ps(_mm_set1_ps(stepX0), columns)) };
+	const __m128 rowStart1{ _mm_add_ps(_mm_set1_ps(origin1), _mm_mul_ps(_mm_set1_ps(stepX1), columns)) };
+	const __m128 rowStart2{ _mm_add_ps(_mm_set1_ps(origin2), _mm_mul_ps(_mm_set1_ps(stepX2), columns)) };
+	const __m128 zero{ _mm_setzero_ps() };
+
+	uint32_t coverage{ 0 };
+	for (int dy{ 0 }; dy < SmallTriangleSize; ++dy) {
+		const __m128 row{ _mm_set1_ps(float(dy)) };
+		const __m128 w0{ _mm_add_ps(rowStart0, _mm_mul_ps(_mm_set1_ps(stepY0), row)) };
+		const __m128 w1{ _mm_add_ps(rowStart1, _mm_mul_ps(_mm_set1_ps(stepY1), row)) };
+		const __m128 w2{ _mm_add_ps(rowStart2, _mm_mul_ps(_mm_set1_ps(stepY2), row)) };
+		const __m128 inside{ _mm_and_ps(_mm_and_ps(_mm_cmpge_ps(w0, zero), _mm_cmpge_ps(w1, zero)), _mm_cmpge_ps(w2, zero)) };
+		coverage |= uint32_t(_mm_movemask_ps(inside)) << (dy * SmallTriangleSize);
+	}
+
+	coverage &= SmallTriangleBoxMasks[(boxWidth - 1) + (boxHeight - 1) * SmallTriangleSize];
+	if (coverage == 0) {
+		return;
+	}
+
+	const float invArea{ 1.0f / totalArea };
+	while (coverage != 0) {
+
+		// Pop the lowest covered pixel with a bit scan
+		const int bit{ std::countr_zero(coverage) };
+		coverage &= coverage - 1;
+
+		const int dx{ bit % SmallTriangleSize };
+		const int dy{ bit / SmallTriangleSize };
+		const float w0{ (origin0 + stepX0 * dx + stepY0 * dy) * invArea };
+		const float w1{ (origin1 + stepX1 * dx + stepY1 * dy) * invArea };
+		const float w2{ (origin2 + stepX2 * dx + stepY2 * dy) * invArea };
+
+		ShadeFragment(pMin.x + dx, pMin.y + dy, w0, w1, w2, v0, v1, v2, vertices_out);
+	}
+}
+
+void Renderer::SetUVGradients(const Vertex_Out& v0, const Vertex_Out& v1, const Vertex_Out& v2) {
+
+	const float area{ (v1.position.x - v0.position.x) * (v2.position.y - v0.position.y) - (v2.position.x - v0.position.x) * (v1.position.y - v0.position.y) };
+	if (area == 0.0f) {
+		m_UVGradients = {};
+		return;
+	}
+
+	// Screen space gradients of the three barycentric weights
+	const float inverseArea{ 1.0f / area };
+	const float weight0Dx{ (v1.position.y - v2.position.y) * inverseArea }, weight0Dy{ (v2.position.x - v1.position.x) * inverseArea };
+	const float weight1Dx{ (v2.position.y - v0.position.y) * inverseArea }, weight1Dy{ (v0.position.x - v2.position.x) * inverseArea };
+	const float weight2Dx{ (v0.position.y - v1.position.y) * inverseArea }, weight2Dy{ (v1.position.x - v0.position.x) * inverseArea };
+
+	const float inverseW0{ 1.0f / v0.position.w };
+	const float inverseW1{ 1.0f / v1.position.w };
+	const float inverseW2{ 1.0f / v2.position.w };
+
+	m_UVGradients.inverseWDx = weight0Dx * inverseW0 + weight1Dx * inverseW1 + weight2Dx * inverseW2;
+	m_UVGradients.inverseWDy = weight0Dy * inverseW0 + weight1Dy * inverseW1 + weight2Dy * inverseW2;
+	m_UVGradients.uvOverWDx = (weight0Dx * inverseW0) * v0.uv + (weight1Dx * inverseW1) * v1.uv + (weight2Dx * inverseW2) * v2.uv;
+	m_UVGradients.uvOverWDy = (weight0Dy * inverseW0) * v0.uv + (weight1Dy * inverseW1) * v1.uv + (weight2Dy * inverseW2) * v2.uv;
+}
+
+void Renderer::ShadeFragment(int px, int py, float w0, float w1, float w2, const Vertex_Out& v0, const Vertex_Out& v1, const Vertex_Out& v2, std::vector<Vertex_Out>& vertices_out) {
+
+	Vector2 pixel{ float(px),float(py) };
+
+	float interpolatedDepth{ FastMath::Reciprocal(w0 * FastMath::Reciprocal(v0.position.z) + w1 * FastMath::Reciprocal(v1.position.z) + w2 * FastMath::Reciprocal(v2.position.z)) };
+	bool depthTestPassed{ interpolatedDepth < m_pDepthBufferPixels[px + (py * m_RenderWidth)] };
+
+	if (depthTestPassed) {
+
+		// Update Depth Buffer
+		m_pDepthBufferPixels[px + (py * m_RenderWidth)] = interpolatedDepth;
+		m_HiZDirty[(px / HiZTileSize) + (py / HiZTileSize) * m_HiZWidth] = 1;
+
+		// Visualize the depth buffer
+		if (m_VisualizeDepthBuffer) {
+
+			float depthColor{ Remap(interpolatedDepth, 0.997f, 1.0f) };
+
+			m_pBackBufferPixels[px + (py * m_RenderWidth)] = SDL_MapRGB(m_pBackBuffer->format,
+				static_cast<uint8_t>(depthColor * 255),
+				static_cast<uint8_t>(depthColor * 255),
+				static_cast<uint8_t>(depthColor * 255));
+			return;
+		}
+
+		// Perspective correct weights, one reciprocal per vertex instead of a division per attribute
+		const float perspective0{ w0 * FastMath::Reciprocal(v0.position.w) };
+		const float perspective1{ w1 * FastMath::Reciprocal(v1.position.w) };
+		const float perspective2{ w2 * FastMath::Reciprocal(v2.position.w) };
+
+		// InterpolatedW
+		float interpolatedW{ FastMath::Reciprocal(perspective0 + perspective1 + perspective2) };
+
+		// Interpolated UV
+		Vector2 interpolatedUV{ perspective0 * v0.uv + perspective1 * v1.uv + perspective2 * v2.uv };
+		interpolatedUV *= interpolatedW;
+
+		// Interpolated directions, normalized afterwards so the division by the summed weights can be left out
+		Vector3 InterpolatedNormal{ perspective0 * v0.normal + perspective1 * v1.normal + perspective2 * v2.normal };
+		Vector3 InterpolatedTangent{ perspective0 * v0.tangent + perspective1 * v1.tangent + perspective2 * v2.tangent };
+		Vector3 InterpolatedViewDirection{ perspective0 * v0.viewDirection + perspective1 * v1.viewDirection + perspective2 * v2.viewDirection };
+
+		// Interpolated world position, the point lights need its distance so it has to be divided
+		Vector3 interpolatedWorldPosition{ perspective0 * v0.worldPosition + perspective1 * v1.worldPosition + perspective2 * v2.worldPosition };
+		interpolatedWorldPosition *= interpolatedW;
+
+		Vertex_Out pixelVertex{};
+		pixelVertex.position = { pixel.x, pixel.y, interpolatedDepth, interpolatedW };
+		pixelVertex.uv = interpolatedUV;
+		pixelVertex.normal = FastMath::Normalized(InterpolatedNormal);
+		pixelVertex.tangent = FastMath::Normalized(InterpolatedTangent);
+		pixelVertex.viewDirection = FastMath::Normalized(InterpolatedViewDirection);
+		pixelVertex.worldPosition = interpolatedWorldPosition;
+
+		// d(uv)/dx = (d(uv / w)/dx - uv * d(1 / w)/dx) * w
+		pixelVertex.uvDdx = (m_UVGradients.uvOverWDx - interpolatedUV * m_UVGradients.inverseWDx) * interpolatedW;
+		pixelVertex.uvDdy = (m_UVGradients.uvOverWDy - interpolatedUV * m_UVGradients.inverseWDy) * interpolatedW;
+
+		vertices_out.push_back(pixelVertex);
+	}
+}
+
+void Renderer::PrintStatistics() const {
+	if (m_RenderMode == RenderMode::software) {
+		std::cout << "Render resolution: " << m_RenderWidth << "x" << m_RenderHeight << " (" << int(m_ResolutionScale * 100 + 0.5f) << "%)\n";
+		std::cout << "Pixels: " << m_ShadingStats.shaded << " shaded, " << m_ShadingStats.broadcast << " coarse, " << m_ShadingStats.reprojected << " reprojected, "
+			<< m_ShadingStats.reconstructed << " reconstructed\n";
+		if (m_UseVariableRateShading) {
+			std::array<uint32_t, 4> rateCounts{};
+			for (ShadingRate rate : m_ShadingRates) {
+				++rateCounts[int(rate)];
+			}
+			std::cout << "Shading rate tiles: 1x1 " << rateCounts[0] << ", 1x2 " << rateCounts[1] << ", 2x2 " << rateCounts[2] << ", 4x4 " << rateCounts[3] << "\n";
+		}
+		std::cout << "Lights: " << m_Lights.size() << ", " << ((m_LightStats.tiles > 0) ? float(m_LightStats.lights) / m_LightStats.tiles : 0.0f)
+			<< " per tile on average, " << m_LightStats.maxLights << " at most\n";
+		std::cout << "Entities: " << m_Scene.GetVisibleCount() << "/" << m_Scene.GetEntityCount() << " visible in " << m_Scene.GetBatches().size() << " batches, "
+			<< m_EntityStats.drawn << "/" << m_EntityStats.inFrustum << " opaque ones drawn\n";
+		if (m_UseShadows) {
+			std::cout << "Shadow map: " << m_ShadowMap.GetCascadeCount() << " cascades, " << m_ShadowMap.GetTriangleCount() << " triangles drawn\n";
+		}
+		std::cout << "Triangle bounding boxes:";
+		for (int bin{ 0 }; bin < TriangleSizeBins; ++bin) {
+			std::cout << ((bin + 1 < TriangleSizeBins) ? " <=" : " >") << (1 << std::min(bin, TriangleSizeBins - 2)) << "px " << m_TriangleSizeHistogram[bin];
+		}
+		std::cout << "\n";
+
+		std::cout << "Meshlets: " << m_MeshletStats.total - m_MeshletStats.frustumCulled - m_MeshletStats.coneCulled - m_MeshletStats.occlusionCulled
+			<< "/" << m_MeshletStats.total << " drawn (frustum " << m_MeshletStats.frustumCulled << ", cone " << m_MeshletStats.coneCulled
+			<< ", Hi-Z " << m_MeshletStats.occlusionCulled << ")\n";
+	}
 }
 
 void Renderer::SwitchRenderMode() {
 	m_RenderMode = (m_RenderMode == RenderMode::software) ? m_RenderMode = RenderMode::hardware : RenderMode::software;
+	m_IsFrameDirty = true;
+	m_History.isValid = false;
 
 	std::cout << "Rasterizer mode = " << ((m_RenderMode == RenderMode::software) ? "SOFTWARE" : "HARDWARE") << "\n";
 }
 
 void Renderer::ToggleCullMode() { 
 	m_CullMode = CullMode((int(m_CullMode) + 1) % 3); 
+	m_IsFrameDirty = true;
+	m_History.isValid = false;
 	
 	switch (m_CullMode)
 	{
@@ -619,6 +1617,8 @@ void Renderer::ToggleCullMode() {
 void Renderer::ToggleShadingMode() {
 	if (m_RenderMode == RenderMode::software) {
 		m_ShadingMode = ShadingMode((int(m_ShadingMode) + 1) % 4);
+		m_IsFrameDirty = true;
+		m_History.isValid = false;
 
 		std::cout << "Shading mode = ";
 		switch (m_ShadingMode)
@@ -642,6 +1642,8 @@ void Renderer::ToggleShadingMode() {
 void Renderer::ToggleBoundingBoxes() {
 	if (m_RenderMode == RenderMode::software) {
 		m_VisualizeBoundingBoxes = !m_VisualizeBoundingBoxes;
+		m_IsFrameDirty = true;
+		m_History.isValid = false;
 		std::cout << "Visualize Bounding Boxes " << ((m_VisualizeBoundingBoxes) ? "ON" : "OFF") << "\n";
 	}
 }
@@ -649,6 +1651,8 @@ void Renderer::ToggleBoundingBoxes() {
 void Renderer::ToggleDepthBuffer() {
 	if (m_RenderMode == RenderMode::software) {
 		m_VisualizeDepthBuffer = !m_VisualizeDepthBuffer;
+		m_IsFrameDirty = true;
+		m_History.isValid = false;
 		std::cout << "Show Depth Buffer " << ((m_VisualizeDepthBuffer) ? "ON" : "OFF") << "\n";
 	}
 }
@@ -656,10 +1660,206 @@ void Renderer::ToggleDepthBuffer() {
 void Renderer::ToggleNormalMap() {
 	if (m_RenderMode == RenderMode::software) {
 		m_UseNormalMap = !m_UseNormalMap;
+		m_IsFrameDirty = true;
+		m_History.isValid = false;
 		std::cout << "Normal Map " << ((m_UseNormalMap) ? "ON" : "OFF") << "\n";
 	}
 }
 
+void Renderer::ToggleDynamicResolution() {
+	if (m_RenderMode == RenderMode::software) {
+		m_UseDynamicResolution = !m_UseDynamicResolution;
+		m_SmoothedFrameTime = 0.0f;
+		m_IsFrameDirty = true;
+		std::cout << "Dynamic Resolution " << ((m_UseDynamicResolution) ? "ON" : "OFF") << "\n";
+	}
+}
+
+void Renderer::ToggleTemporalReprojection() {
+	if (m_RenderMode == RenderMode::software) {
+		m_UseTemporalReprojection = !m_UseTemporalReprojection;
+		m_IsFrameDirty = true;
+		m_History.isValid = false;
+		std::cout << "Temporal Reprojection " << ((m_UseTemporalReprojection) ? "ON" : "OFF") << "\n";
+	}
+}
+
+void Renderer::ToggleVariableRateShading() {
+	if (m_RenderMode == RenderMode::software) {
+		m_UseVariableRateShading = !m_UseVariableRateShading;
+		m_IsFrameDirty = true;
+		std::cout << "Variable Rate Shading " << ((m_UseVariableRateShading) ? "ON" : "OFF") << "\n";
+	}
+}
+
+void Renderer::ToggleCheckerboard() {
+	if (m_RenderMode == RenderMode::software) {
+		m_UseCheckerboard = !m_UseCheckerboard;
+		m_IsFrameDirty = true;
+		std::cout << "Checkerboard Rendering " << ((m_UseCheckerboard) ? "ON" : "OFF") << "\n";
+	}
+}
+
+void Renderer::ToggleShadingCache() {
+	if (m_RenderMode == RenderMode::software) {
+		m_UseShadingCache = !m_UseShadingCache;
+		m_IsFrameDirty = true;
+		std::cout << "Texture Space Shading Cache " << ((m_UseShadingCache) ? "ON" : "OFF") << "\n";
+	}
+}
+
+void Renderer::ToggleDemoLights() {
+	m_UseDemoLights = !m_UseDemoLights;
+	m_IsFrameDirty = true;
+	m_History.isValid = false;
+
+	if (m_UseDemoLights) {
+
+		// Coloured point lights spread over a sphere around the vehicle
+		const Vector3 center{ 0.0f, 0.0f, 50.0f };
+		const float goldenAngle{ 2.39996323f };
+		m_DemoLightOffset = m_Lights.size();
+		for (int index{ 0 }; index < DemoLightCount; ++index) {
+			const float height{ 1.0f - 2.0f * (index + 0.5f) / DemoLightCount };
+			const float ringRadius{ sqrtf(1.0f - height * height) };
+			const float angle{ index * goldenAngle };
+
+			Light light{};
+			light.type = LightType::point;
+			light.position = center + 20.0f * Vector3{ cosf(angle) * ringRadius, height, sinf(angle) * ringRadius };
+			light.color = { 0.5f + 0.5f * cosf(angle), 0.5f + 0.5f * cosf(angle + 2.094f), 0.5f + 0.5f * cosf(angle + 4.189f) };
+			light.intensity = 4.0f;
+			light.range = 10.0f;
+			m_Lights.push_back(light);
+		}
+	}
+	else {
+		m_Lights.erase(m_Lights.begin() + m_DemoLightOffset, m_Lights.begin() + m_DemoLightOffset + DemoLightCount);
+	}
+
+	std::cout << "Demo Point Lights " << ((m_UseDemoLights) ? "ON" : "OFF") << " (" << m_Lights.size() << " lights)\n";
+}
+
+void Renderer::ToggleShadows() {
+	if (m_RenderMode == RenderMode::software) {
+		m_UseShadows = !m_UseShadows;
+		m_IsFrameDirty = true;
+		m_History.isValid = false;
+		std::cout << "Shadows " << ((m_UseShadows) ? "ON" : "OFF") << "\n";
+	}
+}
+
+void Renderer::ToggleInstancing() {
+	m_UseInstancing = !m_UseInstancing;
+	m_IsFrameDirty = true;
+	m_History.isValid = false;
+
+	// A grid of copies behind the vehicle, the cell at the vehicle itself is left out
+	const uint32_t copyCount{ uint32_t(InstanceGridWidth * InstanceGridDepth - 1) };
+	if (m_UseInstancing) {
+		m_FirstInstanceEntity = m_Scene.GetEntityCount();
+		for (int row{ 0 }; row < InstanceGridDepth; ++row) {
+			for (int column{ 0 }; column < InstanceGridWidth; ++column) {
+				const int offsetX{ (column + InstanceGridWidth / 2) % InstanceGridWidth - InstanceGridWidth / 2 };
+				if (offsetX == 0 && row == 0) {
+					continue;
+				}
+				m_Scene.CreateEntity(m_VehicleMesh, m_VehicleMaterial, { offsetX * InstanceSpacing, 0.0f, 50.0f + row * InstanceSpacing }, VehicleRotationSpeed);
+			}
+		}
+	}
+	else {
+		m_Scene.DestroyEntities(m_FirstInstanceEntity, copyCount);
+	}
+
+	// Handles after the removed range moved, so the per entity history no longer matches
+	m_History.draws.assign(m_Scene.GetEntityCount(), DrawHistory{});
+	m_Scene.Cull(m_Camera);
+
+	std::cout << "Instanced Vehicles " << ((m_UseInstancing) ? "ON" : "OFF") << " (" << m_Scene.GetEntityCount() << " entities)\n";
+}
+
+void Renderer::ToggleOcclusionCulling() {
+	if (m_RenderMode == RenderMode::software) {
+		m_UseOcclusionCulling = !m_UseOcclusionCulling;
+		m_IsFrameDirty = true;
+		std::cout << "Entity Occlusion Culling " << ((m_UseOcclusionCulling) ? "ON" : "OFF") << "\n";
+	}
+}
+
+void Renderer::TogglePackedMaterials() {
+	if (m_RenderMode == RenderMode::software) {
+		m_UsePackedMaterials = !m_UsePackedMaterials;
+		m_IsFrameDirty = true;
+		m_History.isValid = false;
+		std::cout << "Packed Materials " << ((m_UsePackedMaterials) ? "ON" : "OFF") << "\n";
+	}
+}
+
+void Renderer::RunBenchmarks() const {
+	BVH::RunBenchmark(m_Camera);
+	m_Scene.GetMesh(m_VehicleMesh).GetSpecularTable().PrintError();
+
+	const Material& material{ m_Scene.GetMaterial(m_VehicleMaterial) };
+	material.pDiffuseMap->RunFilteringBenchmark();
+	material.pDiffuseMap->RunLayoutBenchmark();
+	Texture::RunPackingBenchmark("Separate maps", { material.pDiffuseMap, material.pNormalMap, material.pSpecularMap, material.pGlossyMap });
+
+	// Compressed normal maps have no packed copy, the separate normal and specular maps are read next to the packed diffuse
+	if (material.pDiffuseGlossMap && material.pNormalSpecularMap) {
+		Texture::RunPackingBenchmark("Packed maps", { material.pDiffuseGlossMap, material.pNormalSpecularMap });
+	}
+	else if (material.pDiffuseGlossMap) {
+		Texture::RunPackingBenchmark("Packed diffuse", { material.pDiffuseGlossMap, material.pNormalMap, material.pSpecularMap });
+	}
+
+	size_t memorySize{ 0 };
+	for (const Texture* pMap : { material.pDiffuseMap, material.pNormalMap, material.pSpecularMap, material.pGlossyMap }) {
+		memorySize += pMap->GetMemorySize();
+	}
+	std::cout << "Vehicle maps: " << memorySize / 1024 << " KiB" << (CompressTextures ? " block compressed\n" : "\n");
+	m_Scene.GetTextures().PrintStatistics();
+}
+
+void Renderer::AddLight(const Light& light) {
+	m_Lights.push_back(light);
+	m_IsFrameDirty = true;
+	m_History.isValid = false;
+}
+
+void Renderer::SetShadingRateImage(const std::vector<ShadingRate>& rates, int width, int height) {
+
+	// An empty image hands the tiles back to the measured rates
+	if (rates.empty()) {
+		m_ShadingRateImage.clear();
+		m_ShadingRateImageWidth = 0;
+		m_ShadingRateImageHeight = 0;
+		m_IsFrameDirty = true;
+		return;
+	}
+
+	// The image is indexed per tile every frame, a size that doesn't match would read past it
+	if (width <= 0 || height <= 0 || rates.size() != size_t(width) * height) {
+		std::cout << "Shading rate image rejected, " << rates.size() << " rates for " << width << "x" << height << "\n";
+		return;
+	}
+
+	// Values outside the enum fall back to full rate
+	m_ShadingRateImage = rates;
+	for (ShadingRate& rate : m_ShadingRateImage) {
+		if (int(rate) < int(ShadingRate::rate1x1) || int(rate) > int(ShadingRate::rate4x4)) {
+			rate = ShadingRate::rate1x1;
+		}
+	}
+	m_ShadingRateImageWidth = width;
+	m_ShadingRateImageHeight = height;
+	m_IsFrameDirty = true;
+}
+
+void Renderer::SetFrameTimeBudget(float seconds) {
+	m_FrameTimeBudget = seconds;
+}
+
 void Renderer::ToggleRotation() {
 	m_ShouldRotate = !m_ShouldRotate;
 	std::cout << "Vehicle Rotation " << ((m_ShouldRotate) ? "ON" : "OFF") << "\n";
@@ -667,36 +1867,46 @@ void Renderer::ToggleRotation() {
 
 void Renderer::ToggleUniformBackground() { 
 	m_UseUniformBackground = !m_UseUniformBackground; 
+	m_IsFrameDirty = true;
+	m_History.isValid = false;
 	std::cout << "Uniform Background " << ((m_UseUniformBackground) ? "ON" : "OFF") << "\n";
 }
 
 void Renderer::ToggleFireMesh() { 
 	if (m_RenderMode == RenderMode::hardware) {
 		m_DrawFireMesh = !m_DrawFireMesh;
+		m_IsFrameDirty = true;
 		std::cout << "Fire Effect " << ((m_DrawFireMesh) ? "ON" : "OFF") << "\n";
 	}
 }
 
+bool Renderer::IsOutsideScreen(const Vector4& position) const {
+	// Written as the inside test so NaN from a w of 0 is outside too, the interpolation takes the reciprocal of z and w
+	const bool isInside{ position.x >= 0 && position.x <= m_RenderWidth && position.y >= 0 && position.y <= m_RenderHeight
+		&& position.z > 0 && position.z <= 1 && position.w > 0 };
+	return !isInside;
+}
+
 float Renderer::Remap(float value, float min, float max) {
 	return (value - min) / (max - min);
 }
 
 void Renderer::SwitchFilteringMethod() {
-	if (m_RenderMode == RenderMode::hardware) {
-		m_Filtering = Filtering((int(m_Filtering) + 1) % 3);
+	m_Filtering = Filtering((int(m_Filtering) + 1) % 3);
+	m_IsFrameDirty = true;
+	m_History.isValid = false;
 
-		std::cout << "Sample Filter = ";
-		switch (m_Filtering)
-		{
-		case Filtering::point:
-			std::cout << "POINT\n";
-			break;
-		case Filtering::linear:
-			std::cout << "LINEAR\n";
-			break;
-		case Filtering::anisotropic:
-			std::cout << "ANISOTROPIC\n";
-			break;
-		}
+	std::cout << "Sample Filter = ";
+	switch (m_Filtering)
+	{
+	case Filtering::point:
+		std::cout << "POINT\n";
+		break;
+	case Filtering::linear:
+		std::cout << "LINEAR\n";
+		break;
+	case Filtering::anisotropic:
+		std::cout << "ANISOTROPIC\n";
+		break;
 	}
 }
\ No newline at end of file
@@ -1,7 +1,10 @@
 #pragma once
+#include <array>
 #include "Camera.h"
 #include "Mesh.h"
 #include "DataTypes.h"
+#include "ShadowMap.h"
+#include "Scene.h"
 using namespace dae;
 
 struct SDL_Window;
@@ -19,7 +22,10 @@ public:
 	Renderer& operator=(Renderer&&) noexcept = delete;
 
 	void Update(const Timer* pTimer);
-	void Render();
+	// False when the image had settled and the last frame was shown again instead
+	bool Render();
+	void InvalidateFrame();
+	void PrintStatistics() const;
 
 	// Controlling functions
 	void SwitchRenderMode();
@@ -32,6 +38,24 @@ public:
 	void ToggleBoundingBoxes();
 	void ToggleDepthBuffer();
 	void ToggleNormalMap();
+	void ToggleDynamicResolution();
+	void ToggleTemporalReprojection();
+	void ToggleVariableRateShading();
+	void ToggleCheckerboard();
+	void ToggleShadingCache();
+	void ToggleDemoLights();
+	void ToggleShadows();
+	void ToggleInstancing();
+	void ToggleOcclusionCulling();
+	void TogglePackedMaterials();
+	void RunBenchmarks() const;
+
+	void AddLight(const Light& light);
+
+	// Shading rate per tile, stretched over the tile grid, overrides the measured rates while not empty.
+	// Needs width * height rates, other sizes are rejected and the current image is kept.
+	void SetShadingRateImage(const std::vector<ShadingRate>& rates, int width, int height);
+	void SetFrameTimeBudget(float seconds);
 
 private:
 	SDL_Window* m_pWindow{};
@@ -39,8 +63,19 @@ private:
 	int m_Width{};
 	int m_Height{};
 
+	// Size of the software target, scaled down from the window to hold the frame time budget
+	int m_RenderWidth{};
+	int m_RenderHeight{};
+
 	bool m_IsInitialized{ false };
 
+	// Set by anything that changes the image, cleared once a frame is rendered
+	bool m_IsFrameDirty{ true };
+
+	// Frames still rendered after the last change, so pixels reused from the history are all shaded again before idling
+	uint32_t m_SettleFrameCount{};
+	uint32_t GetSettleFrameCount() const;
+
 	Camera m_Camera;
 
 	// Controling variables
@@ -53,18 +88,52 @@ private:
 	bool m_VisualizeBoundingBoxes{ false };
 	bool m_VisualizeDepthBuffer{ false };
 	bool m_UseNormalMap{ true };
+	bool m_UseDynamicResolution{ true };
+	bool m_UseTemporalReprojection{ false };
+	bool m_UseVariableRateShading{ false };
+	bool m_UseCheckerboard{ false };
+	bool m_UseShadingCache{ false };
+	bool m_UseShadows{ false };
+	bool m_UseOcclusionCulling{ true };
+	bool m_UsePackedMaterials{ true };
 	Filtering m_Filtering{ Filtering::point };
 
 	// Hardware
 	HRESULT InitializeDirectX();
-	void RenderHardware() const;
+	void RenderHardware();
 
 	// Software
 	void RenderSoftware();
 	void InitSoftware(SDL_Window* pWindow);
-	std::vector<Vertex_Out> VertexShader(const Mesh& mesh);
-	std::vector<Vertex_Out> InterPolateAttributes(const Mesh& mesh, const std::vector<Vertex_Out>& verts);
-	void PixelShader(const Mesh& mesh, const std::vector<Vertex_Out>& verts);
+	void SetRenderResolution();
+	void RenderShadowMap();
+	void UpdateResolutionScale(float frameTime);
+	void UpscaleToFrontBuffer();
+	Mesh& BindBatch(const Scene::DrawBatch& batch);
+	Material GetBoundMaterial(MaterialHandle handle) const;
+	void DrawEntity(const Mesh& mesh, const Matrix& worldMatrix, EntityHandle entity);
+	void ResetVertexCache(const Mesh& mesh, const Matrix& worldMatrix);
+	const Vertex_Out& FetchVertex(const Mesh& mesh, uint32_t index);
+	void VertexShader(const VertexUV& vertex, Vertex_Out& vertexOut) const;
+	std::vector<Vertex_Out> InterPolateAttributes(const Mesh& mesh);
+	void RasterizeTriangle(const Vertex_Out& v0, const Vertex_Out& v1, const Vertex_Out& v2, std::vector<Vertex_Out>& vertices_out);
+	void RasterizeSmallTriangle(const Vertex_Out& v0, const Vertex_Out& v1, const Vertex_Out& v2, const Int2& pMin, int boxWidth, int boxHeight, std::vector<Vertex_Out>& vertices_out);
+	void SetUVGradients(const Vertex_Out& v0, const Vertex_Out& v1, const Vertex_Out& v2);
+	void ShadeFragment(int px, int py, float w0, float w1, float w2, const Vertex_Out& v0, const Vertex_Out& v1, const Vertex_Out& v2, std::vector<Vertex_Out>& vertices_out);
+	bool CullMeshlet(const MeshOptimizer::Meshlet& meshlet);
+	bool IsSphereOccluded(const Vector3& viewCenter, float radius);
+	bool GetSphereScreenRect(const Vector3& viewCenter, float radius, Int2& pMin, Int2& pMax) const;
+	void CullLights(const Int2& pMin, const Int2& pMax);
+	float GetHiZ(int tileX, int tileY);
+	void PixelShader(const Mesh& mesh, const std::vector<Vertex_Out>& verts, EntityHandle entity);
+	void ShadeCoarsePixel(const Mesh& mesh, const std::vector<Vertex_Out>& verts, int x, int y, int width, int height, const Matrix* pReprojectionMatrix);
+	void ReconstructCheckerboard(const Mesh& mesh, const std::vector<Vertex_Out>& verts, const Matrix* pReprojectionMatrix);
+	uint32_t ShadePixel(const Mesh& mesh, const Vertex_Out& vertex) const;
+	bool Reproject(const Matrix& reprojectionMatrix, const Vector4& pixelPosition, uint32_t& historyColor) const;
+	void UpdateShadingRates();
+	Int2 GetShadingRateSize(ShadingRate rate) const;
+	float GetLuminance(uint32_t color) const;
+	bool IsOutsideScreen(const Vector4& position) const;
 	float Remap(float value, float min, float max);
 
 	// Shared
@@ -89,14 +158,187 @@ private:
 	ID3D11SamplerState* m_pLinearSamplerState;
 	ID3D11SamplerState* m_pAnisotropicSamplerState;
 
-	// Meshes
-	Mesh* m_pVehicleMesh;
-	Mesh* m_pFireMesh;
+	// Lights, a single directional light by default
+	std::vector<Light> m_Lights{ Light{} };
+	static constexpr int DemoLightCount{ 256 };
+	size_t m_DemoLightOffset{};
+	bool m_UseDemoLights{ false };
+
+	// Radians per second the vehicle turns
+	static constexpr float VehicleRotationSpeed{ PI_DIV_2 };
+
+	// Scene textures are block compressed at load, both render paths sample the blocks
+	static constexpr bool CompressTextures{ true };
+
+	// Vehicle copies drawn through the instanced path
+	static constexpr int InstanceGridWidth{ 25 };
+	static constexpr int InstanceGridDepth{ 20 };
+	static constexpr float InstanceSpacing{ 45.0f };
+	bool m_UseInstancing{ false };
+	EntityHandle m_FirstInstanceEntity{};
+
+	// Cascaded shadows of the first directional light
+	ShadowMap m_ShadowMap{};
+
+	// Meshes, materials and the entities placing them
+	Scene m_Scene{};
+	MeshHandle m_VehicleMesh{};
+	MaterialHandle m_VehicleMaterial{};
 
 	// Software variables
 	SDL_Surface* m_pFrontBuffer{ nullptr };
 	SDL_Surface* m_pBackBuffer{ nullptr };
 	uint32_t* m_pBackBufferPixels{};
 	float* m_pDepthBufferPixels{};
+
+	// Post-transform vertex cache, vertices are shaded on first use by an index
+	struct VertexCache
+	{
+		std::vector<Vertex_Out> vertices{};
+		std::vector<uint32_t> stamps{};
+		uint32_t currentStamp{ 0 };
+		Matrix worldMatrix{};
+		Matrix WVPMatrix{};
+	};
+	VertexCache m_VertexCache{};
+
+	// Hierarchical depth, farthest depth per tile, rebuilt lazily after depth writes
+	static constexpr int HiZTileSize{ 8 };
+	int m_HiZWidth{};
+	int m_HiZHeight{};
+	std::vector<float> m_HiZ{};
+	std::vector<uint8_t> m_HiZDirty{};
+
+	struct MeshletStats
+	{
+		uint32_t total{};
+		uint32_t frustumCulled{};
+		uint32_t coneCulled{};
+		uint32_t occlusionCulled{};
+	};
+	MeshletStats m_MeshletStats{};
+
+	// Whether each entity left a fragment, last frame's flags pick the entities drawn before the occlusion query
+	std::vector<uint8_t> m_WasEntityVisible{};
+	std::vector<uint8_t> m_IsEntityVisible{};
+	std::vector<EntityHandle> m_QueriedEntities{};
+
+	struct EntityStats
+	{
+		uint32_t inFrustum{};
+		uint32_t drawn{};
+	};
+	EntityStats m_EntityStats{};
+
+	// Dynamic resolution
+	static constexpr float MinResolutionScale{ 0.5f };
+	float m_FrameTimeBudget{ 1.0f / 60.0f };
+	float m_SmoothedFrameTime{ 0.0f };
+	float m_ResolutionScale{ 1.0f };
+
+	struct UpscaleColumn
+	{
+		int x0{};
+		int weight{};
+	};
+	std::vector<UpscaleColumn> m_UpscaleColumns{};
+
+	// Temporal reprojection, last frame's colour and view depth with the transform of every entity drawn into it
+	static constexpr uint32_t TemporalRefreshPeriod{ 8 };
+	static constexpr float TemporalDepthTolerance{ 0.01f };
+	struct DrawHistory
+	{
+		Matrix WVPMatrix{};
+		uint32_t drawnFrame{ UINT32_MAX };
+	};
+	struct History
+	{
+		std::vector<uint32_t> colors{};
+		std::vector<float> depths{};
+		std::vector<DrawHistory> draws{};
+		int width{};
+		int height{};
+		uint32_t frameIndex{ 0 };
+		bool isValid{ false };
+	};
+	History m_History{};
+	std::vector<float> m_LinearDepth{};
+
+	// Visible fragment per pixel of the mesh being shaded, -1 when uncovered
+	std::vector<int> m_FragmentIndices{};
+
+	// Blocks ahead along a row whose texels are prefetched before the current block is shaded
+	static constexpr int TexelPrefetchDistance{ 4 };
+
+	// Pixels skipped by the checkerboard this frame, rebuilt from their neighbours and the last frame
+	std::vector<int> m_CheckerboardPixels{};
+
+	// Variable rate shading, one rate per tile measured from last frame's luminance steps
+	static constexpr int ShadingRateTileSize{ 8 };
+	static constexpr float ShadingRateFlatThreshold{ 1.5f };
+	static constexpr float ShadingRateSmoothThreshold{ 4.0f };
+	static constexpr float ShadingRateDepthTolerance{ 0.01f };
+	int m_ShadingRateTilesX{};
+	int m_ShadingRateTilesY{};
+	std::vector<ShadingRate> m_ShadingRates{};
+	std::vector<ShadingRate> m_PreviousShadingRates{};
+	std::vector<ShadingRate> m_ShadingRateImage{};
+	int m_ShadingRateImageWidth{};
+	int m_ShadingRateImageHeight{};
+
+	struct ShadingStats
+	{
+		uint32_t shaded{};
+		uint32_t broadcast{};
+		uint32_t reprojected{};
+		uint32_t reconstructed{};
+	};
+	ShadingStats m_ShadingStats{};
+
+	// Tiled light culling, every tile lists the lights reaching the depth span of its visible pixels
+	static constexpr int LightTileSize{ 16 };
+	int m_LightTilesX{};
+	int m_LightTilesY{};
+	std::vector<std::vector<uint32_t>> m_TileLights{};
+
+	struct LightStats
+	{
+		uint32_t tiles{};
+		uint32_t lights{};
+		uint32_t maxLights{};
+	};
+	LightStats m_LightStats{};
+
+	// Screen space gradients of uv / w and 1 / w over the triangle being rasterized, both are affine on screen
+	// so every fragment gets its exact uv derivatives from them with the quotient rule
+	struct UVGradients
+	{
+		Vector2 uvOverWDx{};
+		Vector2 uvOverWDy{};
+		float inverseWDx{};
+		float inverseWDy{};
+	};
+	UVGradients m_UVGradients{};
+
+	// Triangles with a bounding box up to 4x4 pixels skip the per pixel edge setup.
+	// The whole block is tested at once, the mask for the box width and height keeps the pixels inside the box.
+	static constexpr int SmallTriangleSize{ 4 };
+	static constexpr std::array<uint32_t, SmallTriangleSize * SmallTriangleSize> SmallTriangleBoxMasks{ []() {
+		std::array<uint32_t, SmallTriangleSize * SmallTriangleSize> masks{};
+		for (int h{ 1 }; h <= SmallTriangleSize; ++h) {
+			for (int w{ 1 }; w <= SmallTriangleSize; ++w) {
+				uint32_t mask{ 0 };
+				for (int y{ 0 }; y < h; ++y) {
+					mask |= ((1u << w) - 1) << (y * SmallTriangleSize);
+				}
+				masks[(w - 1) + (h - 1) * SmallTriangleSize] = mask;
+			}
+		}
+		return masks;
+	}() };
+
+	// Triangle count per bounding box extent: 1, 2, 4 ... 64 and larger pixels
+	static constexpr int TriangleSizeBins{ 8 };
+	std::array<uint32_t, TriangleSizeBins> m_TriangleSizeHistogram{};
 };
 
@@ -1,7 +1,15 @@
 float4x4 gWorldViewProjMat : WorldViewProjectionMatrix;
-float4x4 gWorldMat : WORLD;
+float4x4 gViewProjMat : VIEWPROJECTION;
 float4x4 gViewInvMat : VIEWINVERSE;
 
+// Light list, the type sits in the position's w and the range in the direction's w
+#define MAX_LIGHTS 32
+float4 gLightPositions[MAX_LIGHTS];
+float4 gLightDirections[MAX_LIGHTS];
+float4 gLightColors[MAX_LIGHTS];
+float4 gLightCones[MAX_LIGHTS];
+int gLightCount;
+
 SamplerState gSamPoint : SamplerPoint;
 
 Texture2D gDiffuseMap : DiffuseMap;
@@ -25,6 +33,12 @@ struct VS_INPUT {
 	float2 TexCoord : TEXCOORD;
 	float3 Normal : NORMAL;
 	float3 Tangent : TANGENT;
+
+	// Instance world matrix rows
+	float4 World0 : WORLD0;
+	float4 World1 : WORLD1;
+	float4 World2 : WORLD2;
+	float4 World3 : WORLD3;
 };
 
 struct VS_OUTPUT {
@@ -38,10 +52,11 @@ struct VS_OUTPUT {
 // Vertex Shader
 VS_OUTPUT VS(VS_INPUT input) {
 	VS_OUTPUT output = (VS_OUTPUT)0;
-	output.Position = mul(float4(input.Position, 1.0f), gWorldViewProjMat);
-	output.WorldPosition = mul(float4(input.Position, 1.0f), gWorldMat);
-	output.Normal = mul(normalize(input.Normal), (float3x3)gWorldMat);
-	output.Tangent = mul(normalize(input.Tangent), (float3x3)gWorldMat);
+	float4x4 worldMat = float4x4(input.World0, input.World1, input.World2, input.World3);
+	output.WorldPosition = mul(float4(input.Position, 1.0f), worldMat);
+	output.Position = mul(output.WorldPosition, gViewProjMat);
+	output.Normal = mul(normalize(input.Normal), (float3x3)worldMat);
+	output.Tangent = mul(normalize(input.Tangent), (float3x3)worldMat);
 	output.TexCoord = input.TexCoord;
 	return output;
 }
@@ -50,9 +65,7 @@ VS_OUTPUT VS(VS_INPUT input) {
 float4 PS(VS_OUTPUT input) : SV_TARGET{
 
 	float3 viewDirection = normalize(input.WorldPosition.xyz - gViewInvMat[3].xyz);
-	float3 lightDirection = float3(0.577f, -0.577f, 0.577f);
 	float PI = 3.1415926535f;
-	float lightIntensity = 7.0f;
 	float shininess = 25.0f;
 
 	float3 finalColor = float3(0,0,0);
@@ -60,28 +73,55 @@ float4 PS(VS_OUTPUT input) : SV_TARGET{
 
 	float3 binormal = cross(input.Normal, input.Tangent);
 	float4x4 tangentSpaceAxis = float4x4(float4(input.Tangent,0), float4(binormal,0), float4(input.Normal,0), float4(0,0,0,1));
-	float3 sampledNormal = gNormalMap.Sample(gSamPoint, input.TexCoord).rgb;
-	sampledNormal = (2.0f * sampledNormal) - float3(1,1,1);
+	// The normal map is a signed format holding the decoded vectors, block compressed ones keep x and y only so z is rebuilt
+	float2 sampledXY = gNormalMap.Sample(gSamPoint, input.TexCoord).rg;
+	float3 sampledNormal = float3(sampledXY, sqrt(saturate(1 - dot(sampledXY, sampledXY))));
 	sampledNormal = mul(normalize(sampledNormal), (float3x3)tangentSpaceAxis);
 
-	// Cosine law
-	float observedArea = dot(sampledNormal, -lightDirection);
-
-	if (observedArea > 0) {
-
-		// Diffuse lambert color
-		float3 diffuseColor = lightIntensity * (gDiffuseMap.Sample(gSamPoint, input.TexCoord).rgb) / PI;
-
-		// Specular Color
-		float3 ks = gSpecularMap.Sample(gSamPoint, input.TexCoord).rgb;
-		float exp = gGlossyMap.Sample(gSamPoint, input.TexCoord).r * shininess;
-
-		float dotproduct =  max(dot(sampledNormal,-lightDirection),0);
-		float3 r = (-lightDirection) - 2 * dotproduct * sampledNormal;
-		float cosine = max(dot(r, viewDirection),0);
-		float3 specularPhong =  ks * pow(cosine,exp);
+	// Diffuse lambert color
+	float3 diffuseColor = gDiffuseMap.Sample(gSamPoint, input.TexCoord).rgb / PI;
+
+	// Specular Color
+	float3 ks = gSpecularMap.Sample(gSamPoint, input.TexCoord).rgb;
+	float exp = gGlossyMap.Sample(gSamPoint, input.TexCoord).r * shininess;
+
+	bool isLit = false;
+	for (int i = 0; i < gLightCount; ++i) {
+
+		// Type 0 is directional, 1 point and 2 spot
+		float lightType = gLightPositions[i].w;
+		float3 lightDirection = gLightDirections[i].xyz;
+		float attenuation = 1.0f;
+
+		if (lightType > 0.5f) {
+			float3 toPixel = input.WorldPosition.xyz - gLightPositions[i].xyz;
+			float range = gLightDirections[i].w;
+			float falloff = saturate(1.0f - dot(toPixel, toPixel) / (range * range));
+			attenuation = falloff * falloff;
+			lightDirection = normalize(toPixel);
+
+			if (lightType > 1.5f) {
+				float spotCosine = dot(lightDirection, gLightDirections[i].xyz);
+				attenuation *= saturate((spotCosine - gLightCones[i].y) / (gLightCones[i].x - gLightCones[i].y));
+			}
+		}
+
+		// Cosine law
+		float observedArea = dot(sampledNormal, -lightDirection);
+
+		if (observedArea > 0 && attenuation > 0) {
+			float3 r = (-lightDirection) - 2 * observedArea * sampledNormal;
+			float cosine = max(dot(r, viewDirection),0);
+			float3 specularPhong =  ks * pow(cosine,exp);
+
+			float3 radiance = gLightColors[i].rgb * attenuation * observedArea;
+			finalColor += (diffuseColor * gLightColors[i].w + specularPhong) * radiance;
+			isLit = true;
+		}
+	}
 
-		finalColor = (diffuseColor + specularPhong) * observedArea + ambientColor;
+	if (isLit) {
+		finalColor += ambientColor;
 	}
 
 	return float4(finalColor, 0.0f);
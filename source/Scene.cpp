@@ -0,0 +1,228 @@
+#include "pch.h"
+#include <execution>
+#include "Scene.h"
+#include "Camera.h"
+#include "Mesh.h"
+#include "Texture.h"
+#include "Effect.h"
+
+template<typename Function>
+void Scene::ForEachChunk(Function function) {
+
+	const uint32_t entityCount{ GetEntityCount() };
+	if (entityCount <= ChunkSize) {
+		function(0u, entityCount);
+		return;
+	}
+
+	m_ChunkStarts.clear();
+	for (uint32_t begin{ 0 }; begin < entityCount; begin += ChunkSize) {
+		m_ChunkStarts.push_back(begin);
+	}
+
+	// Chunks write disjoint ranges of every array
+	std::for_each(std::execution::par, m_ChunkStarts.begin(), m_ChunkStarts.end(), [&function, entityCount](uint32_t begin) {
+		function(begin, std::min(begin + ChunkSize, entityCount));
+	});
+}
+
+Scene::~Scene() {
+	Clear();
+}
+
+MeshHandle Scene::AddMesh(Mesh* pMesh) {
+	m_Meshes.push_back(pMesh);
+	return MeshHandle(m_Meshes.size() - 1);
+}
+
+MaterialHandle Scene::AddMaterial(const Material& material) {
+
+	Material& added{ m_Materials.emplace_back(material) };
+	if (added.pDiffuseMap && added.pNormalMap && added.pSpecularMap && added.pGlossyMap) {
+		added.pDiffuseGlossMap = m_Textures.AcquirePacked(*added.pDiffuseMap, *added.pGlossyMap, Texture::PackColorAlpha);
+		added.pNormalSpecularMap = m_Textures.AcquirePacked(*added.pNormalMap, *added.pSpecularMap, Texture::PackNormalScalar);
+	}
+
+	return MaterialHandle(m_Materials.size() - 1);
+}
+
+EntityHandle Scene::CreateEntity(MeshHandle mesh, MaterialHandle material, const Vector3& position, float angularSpeed) {
+
+	const EntityHandle entity{ GetEntityCount() };
+
+	m_Positions.push_back(position);
+	m_Angles.push_back(0.0f);
+	m_AngularSpeeds.push_back(angularSpeed);
+	m_WorldMatrices.emplace_back();
+
+	m_LocalCenters.push_back(m_Meshes[mesh]->GetBoundingCenter());
+	m_Radii.push_back(m_Meshes[mesh]->GetBoundingRadius());
+	m_WorldCenters.emplace_back();
+
+	m_MeshHandles.push_back(mesh);
+	m_MaterialHandles.push_back(material);
+	m_IsVisible.push_back(0);
+
+	if (angularSpeed != 0.0f) {
+		++m_RotatingCount;
+	}
+
+	UpdateEntity(entity);
+	m_HasChanged = true;
+	m_IsBVHOutdated = true;
+	return entity;
+}
+
+void Scene::DestroyEntities(EntityHandle first, uint32_t count) {
+
+	for (EntityHandle entity{ first }; entity < first + count; ++entity) {
+		if (m_AngularSpeeds[entity] != 0.0f) {
+			--m_RotatingCount;
+		}
+	}
+
+	const auto eraseRange{ [first, count](auto& components) {
+		components.erase(components.begin() + first, components.begin() + first + count);
+	} };
+
+	eraseRange(m_Positions);
+	eraseRange(m_Angles);
+	eraseRange(m_AngularSpeeds);
+	eraseRange(m_WorldMatrices);
+	eraseRange(m_LocalCenters);
+	eraseRange(m_Radii);
+	eraseRange(m_WorldCenters);
+	eraseRange(m_MeshHandles);
+	eraseRange(m_MaterialHandles);
+	eraseRange(m_IsVisible);
+
+	m_HasChanged = true;
+	m_IsBVHOutdated = true;
+}
+
+void Scene::Clear() {
+
+	DestroyEntities(0, GetEntityCount());
+	m_Batches.clear();
+
+	for (Mesh* pMesh : m_Meshes) {
+		delete pMesh;
+	}
+	m_Meshes.clear();
+
+	// Materials own their effect, the maps and their packed copies go back to the cache
+	for (Material& material : m_Materials) {
+		delete material.pEffect;
+		m_Textures.Release(material.pDiffuseMap);
+		m_Textures.Release(material.pNormalMap);
+		m_Textures.Release(material.pSpecularMap);
+		m_Textures.Release(material.pGlossyMap);
+		m_Textures.Release(material.pDiffuseGlossMap);
+		m_Textures.Release(material.pNormalSpecularMap);
+	}
+	m_Materials.clear();
+
+	// Cached textures hold device resources, they cannot wait for the cache to be destroyed after the device
+	const uint32_t usedCount{ m_Textures.EvictUnused() };
+	if (usedCount > 0) {
+		std::cout << "Scene cleared with " << usedCount << " textures still in use, they outlive the scene\n";
+	}
+}
+
+void Scene::Update(float deltaTime) {
+
+	if (deltaTime == 0.0f || m_RotatingCount == 0) {
+		return;
+	}
+
+	ForEachChunk([this, deltaTime](uint32_t begin, uint32_t end) {
+		for (EntityHandle entity{ begin }; entity < end; ++entity) {
+			if (m_AngularSpeeds[entity] == 0.0f) {
+				continue;
+			}
+
+			float angle{ m_Angles[entity] + m_AngularSpeeds[entity] * deltaTime };
+			if (angle < 0) {
+				angle += PI_2;
+			}
+			if (angle >= PI_2) {
+				angle -= PI_2;
+			}
+			m_Angles[entity] = angle;
+
+			UpdateEntity(entity);
+		}
+	});
+
+	m_HasChanged = true;
+	m_IsBVHStale = true;
+}
+
+void Scene::UpdateEntity(EntityHandle entity) {
+	m_WorldMatrices[entity] = Matrix::CreateRotationY(m_Angles[entity]) * Matrix::CreateTranslation(m_Positions[entity]);
+	m_WorldCenters[entity] = m_WorldMatrices[entity].TransformPoint(m_LocalCenters[entity]);
+}
+
+void Scene::UpdateBVH() {
+
+	// Moved entities only widen the boxes, until the tree is loose enough that a new one pays off
+	if (!m_IsBVHOutdated && m_IsBVHStale) {
+		m_BVH.Refit(m_WorldCenters, m_Radii);
+		++m_RefitsSinceBuild;
+		m_IsBVHOutdated = m_BVH.NeedsRebuild() || m_RefitsSinceBuild >= RebuildPeriod;
+	}
+
+	if (m_IsBVHOutdated) {
+		m_BVH.Build(m_WorldCenters, m_Radii);
+		m_RefitsSinceBuild = 0;
+	}
+
+	m_IsBVHOutdated = false;
+	m_IsBVHStale = false;
+}
+
+void Scene::Cull(const Camera& camera) {
+
+	UpdateBVH();
+
+	std::fill(m_IsVisible.begin(), m_IsVisible.end(), uint8_t(0));
+	m_BVH.Query([&camera](const Vector3& center, float radius) {
+		return BVH::ClassifyFrustum(camera, center, radius);
+	}, [this](uint32_t entity) {
+		m_IsVisible[entity] = 1;
+	});
+
+	// Batches keep their order and storage from frame to frame
+	for (DrawBatch& batch : m_Batches) {
+		batch.worldMatrices.clear();
+		batch.entities.clear();
+	}
+
+	m_VisibleCount = 0;
+	size_t batchIndex{ 0 };
+	for (EntityHandle entity{ 0 }; entity < GetEntityCount(); ++entity) {
+		if (!m_IsVisible[entity]) {
+			continue;
+		}
+		++m_VisibleCount;
+
+		// Entities of one kind are usually created together, so the last batch is checked first
+		const MeshHandle mesh{ m_MeshHandles[entity] };
+		const MaterialHandle material{ m_MaterialHandles[entity] };
+		if (batchIndex >= m_Batches.size() || m_Batches[batchIndex].mesh != mesh || m_Batches[batchIndex].material != material) {
+			const auto batch{ std::find_if(m_Batches.begin(), m_Batches.end(), [mesh, material](const DrawBatch& batch) {
+				return batch.mesh == mesh && batch.material == material;
+			}) };
+
+			batchIndex = size_t(batch - m_Batches.begin());
+			if (batch == m_Batches.end()) {
+				m_Batches.push_back({ mesh, material });
+			}
+		}
+
+		m_Batches[batchIndex].worldMatrices.push_back(m_WorldMatrices[entity]);
+		m_Batches[batchIndex].entities.push_back(entity);
+	}
+
+	std::erase_if(m_Batches, [](const DrawBatch& batch) { return batch.entities.empty(); });
+}
@@ -0,0 +1,154 @@
+#pragma once
+#include <vector>
+#include "DataTypes.h"
+#include "BVH.h"
+#include "TextureCache.h"
+
+struct Camera;
+class Mesh;
+class Texture;
+class Effect;
+
+using EntityHandle = uint32_t;
+using MeshHandle = uint32_t;
+using MaterialHandle = uint32_t;
+
+// Maps and effect a mesh is drawn with
+struct Material
+{
+	Texture* pDiffuseMap{ nullptr };
+	Texture* pNormalMap{ nullptr };
+	Texture* pSpecularMap{ nullptr };
+	Texture* pGlossyMap{ nullptr };
+	Effect* pEffect{ nullptr };
+	float shininess{ 25.0f };
+
+	// Software sampler copies of the four maps in two, diffuse with gloss and normal with specular, made by AddMaterial
+	// through the texture cache so materials with the same maps share them.
+	// Null when the maps differ in size, the separate maps are sampled then. Compressed normal maps have no packed copy.
+	Texture* pDiffuseGlossMap{ nullptr };
+	Texture* pNormalSpecularMap{ nullptr };
+
+	// Blended after the opaque meshes, only the hardware path draws them
+	bool isTransparent{ false };
+};
+
+// Entity store with one array per component, updated in parallel chunks and culled through a bounding volume hierarchy.
+// Owns the meshes and materials, entities refer to them by handle. Material maps come from the scene's texture cache.
+class Scene final
+{
+public:
+	// Entities per task of the parallel loops
+	static constexpr uint32_t ChunkSize{ 1024 };
+
+	// Refits before the hierarchy is rebuilt even if it hasn't loosened much
+	static constexpr uint32_t RebuildPeriod{ 300 };
+
+	// Visible entities sharing a mesh and material, drawn as instances of one call
+	struct DrawBatch
+	{
+		MeshHandle mesh{};
+		MaterialHandle material{};
+		std::vector<Matrix> worldMatrices{};
+		std::vector<EntityHandle> entities{};
+	};
+
+	Scene() = default;
+	~Scene();
+
+	Scene(const Scene&) = delete;
+	Scene(Scene&&) noexcept = delete;
+	Scene& operator=(const Scene&) = delete;
+	Scene& operator=(Scene&&) noexcept = delete;
+
+	MeshHandle AddMesh(Mesh* pMesh);
+	// Packs the maps of materials with all four of them. The material's maps have to be acquired from GetTextures,
+	// the scene releases them when it is cleared.
+	MaterialHandle AddMaterial(const Material& material);
+	EntityHandle CreateEntity(MeshHandle mesh, MaterialHandle material, const Vector3& position, float angularSpeed = 0.0f);
+
+	// Removes a range of entities, the handles after it move down by count
+	void DestroyEntities(EntityHandle first, uint32_t count);
+	// Deletes every entity, mesh and material and empties the texture cache of what they used
+	void Clear();
+
+	// Turns the rotating entities and refreshes their world matrices and bounds
+	void Update(float deltaTime);
+
+	// Frustum test through the hierarchy, then groups the visible entities into batches
+	void Cull(const Camera& camera);
+
+	// Entities inside the frustum for which isOccluded(center, radius) fails, whole subtrees are rejected at once.
+	// Only valid after Cull in the same frame.
+	template<typename OcclusionTest>
+	void QueryVisible(const Camera& camera, const OcclusionTest& isOccluded, std::vector<EntityHandle>& entities) const;
+
+	bool HasChanged() const { return m_HasChanged; }
+	void ClearChanged() { m_HasChanged = false; }
+
+	uint32_t GetEntityCount() const { return uint32_t(m_Positions.size()); }
+	uint32_t GetVisibleCount() const { return m_VisibleCount; }
+	const Matrix& GetWorldMatrix(EntityHandle entity) const { return m_WorldMatrices[entity]; }
+	MeshHandle GetMeshHandle(EntityHandle entity) const { return m_MeshHandles[entity]; }
+	MaterialHandle GetMaterialHandle(EntityHandle entity) const { return m_MaterialHandles[entity]; }
+
+	Mesh& GetMesh(MeshHandle mesh) const { return *m_Meshes[mesh]; }
+	const Material& GetMaterial(MaterialHandle material) const { return m_Materials[material]; }
+	const std::vector<DrawBatch>& GetBatches() const { return m_Batches; }
+	TextureCache& GetTextures() { return m_Textures; }
+	const TextureCache& GetTextures() const { return m_Textures; }
+
+private:
+	// Calls function(begin, end) for every chunk of the entity range, spread over the available threads
+	template<typename Function>
+	void ForEachChunk(Function function);
+
+	void UpdateEntity(EntityHandle entity);
+	void UpdateBVH();
+
+	std::vector<Mesh*> m_Meshes{};
+	std::vector<Material> m_Materials{};
+	TextureCache m_Textures{};
+
+	// Transform
+	std::vector<Vector3> m_Positions{};
+	std::vector<float> m_Angles{};
+	std::vector<float> m_AngularSpeeds{};
+	std::vector<Matrix> m_WorldMatrices{};
+
+	// Bounds, the local sphere is copied from the mesh so the loops don't follow the handle
+	std::vector<Vector3> m_LocalCenters{};
+	std::vector<float> m_Radii{};
+	std::vector<Vector3> m_WorldCenters{};
+
+	// Resources
+	std::vector<MeshHandle> m_MeshHandles{};
+	std::vector<MaterialHandle> m_MaterialHandles{};
+
+	// Culling, the hierarchy is rebuilt when entities come or go and refitted when they move
+	std::vector<uint8_t> m_IsVisible{};
+	uint32_t m_VisibleCount{};
+	BVH m_BVH{};
+	bool m_IsBVHOutdated{ true };
+	bool m_IsBVHStale{ false };
+	uint32_t m_RefitsSinceBuild{};
+
+	std::vector<DrawBatch> m_Batches{};
+	std::vector<uint32_t> m_ChunkStarts{};
+	uint32_t m_RotatingCount{};
+	bool m_HasChanged{ true };
+};
+
+template<typename OcclusionTest>
+void Scene::QueryVisible(const Camera& camera, const OcclusionTest& isOccluded, std::vector<EntityHandle>& entities) const {
+
+	entities.clear();
+	m_BVH.Query([&camera, &isOccluded](const Vector3& center, float radius) {
+		if (BVH::ClassifyFrustum(camera, center, radius) == BVH::Containment::outside || isOccluded(center, radius)) {
+			return BVH::Containment::outside;
+		}
+		return BVH::Containment::partial;
+	}, [&entities](uint32_t entity) {
+		entities.push_back(entity);
+	});
+}
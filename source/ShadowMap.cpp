@@ -0,0 +1,155 @@
+#include "pch.h"
+#include <array>
+#include "ShadowMap.h"
+#include "Camera.h"
+#include "Mesh.h"
+
+ShadowMap::ShadowMap(int size, int cascadeCount) :
+	m_Cascades(Clamp(cascadeCount, 1, MaxCascades)),
+	m_Size{ size }
+{
+	for (Cascade& cascade : m_Cascades) {
+		cascade.depthMap.Resize(size, size);
+	}
+}
+
+void ShadowMap::Render(const Camera& camera, const Vector3& lightDirection, const std::vector<Caster>& casters) {
+
+	// Light space, looking along the light
+	const Vector3 lightForward{ lightDirection.Normalized() };
+	const Vector3 worldUp{ (std::abs(lightForward.y) > 0.99f) ? Vector3::UnitZ : Vector3::UnitY };
+	const Vector3 lightRight{ Vector3::Cross(worldUp, lightForward).Normalized() };
+	const Vector3 lightUp{ Vector3::Cross(lightForward, lightRight) };
+	const Matrix lightView{ Matrix::Inverse(Matrix{ lightRight, lightUp, lightForward, Vector3::Zero }) };
+
+	const float nearDepth{ camera.zNear };
+	const float farDepth{ std::min(camera.zFar, m_ShadowDistance) };
+	const float tanX{ camera.fov * camera.aspectRatio };
+	const float tanY{ camera.fov };
+
+	float sliceStart{ nearDepth };
+	for (size_t cascadeIndex{ 0 }; cascadeIndex < m_Cascades.size(); ++cascadeIndex) {
+		Cascade& cascade{ m_Cascades[cascadeIndex] };
+
+		const float fraction{ float(cascadeIndex + 1) / m_Cascades.size() };
+		const float logarithmicSplit{ nearDepth * powf(farDepth / nearDepth, fraction) };
+		const float uniformSplit{ nearDepth + (farDepth - nearDepth) * fraction };
+		cascade.splitDepth = SplitLambda * logarithmicSplit + (1.0f - SplitLambda) * uniformSplit;
+
+		// Bounding sphere of the slice's corners, its size doesn't change when the camera turns
+		std::array<Vector3, 8> corners{};
+		Vector3 center{};
+		int cornerIndex{ 0 };
+		for (float depth : { sliceStart, cascade.splitDepth }) {
+			for (float signY : { -1.0f, 1.0f }) {
+				for (float signX : { -1.0f, 1.0f }) {
+					corners[cornerIndex] = camera.origin + depth * camera.forward + (signX * depth * tanX) * camera.right + (signY * depth * tanY) * camera.up;
+					center += corners[cornerIndex];
+					++cornerIndex;
+				}
+			}
+		}
+		center /= float(corners.size());
+
+		float radius{ 0.0f };
+		for (const Vector3& corner : corners) {
+			radius = std::max(radius, Vector3{ center, corner }.Magnitude());
+		}
+
+		// Moving the box by whole texels keeps the texel grid fixed on the world
+		cascade.texelWorldSize = 2.0f * radius / m_Size;
+		Vector3 lightCenter{ lightView.TransformPoint(center) };
+		lightCenter.x = floorf(lightCenter.x / cascade.texelWorldSize) * cascade.texelWorldSize;
+		lightCenter.y = floorf(lightCenter.y / cascade.texelWorldSize) * cascade.texelWorldSize;
+
+		// Depth runs from the nearest caster in front of the slice to the far side of the slice
+		m_CascadeCasters.clear();
+		float minDepth{ lightCenter.z - radius };
+		const float maxDepth{ lightCenter.z + radius };
+		for (const Caster& caster : casters) {
+			const float casterRadius{ caster.pMesh->GetBoundingRadius() };
+			const Vector3 casterCenter{ lightView.TransformPoint(caster.worldMatrix.TransformPoint(caster.pMesh->GetBoundingCenter())) };
+			if (std::abs(casterCenter.x - lightCenter.x) > radius + casterRadius || std::abs(casterCenter.y - lightCenter.y) > radius + casterRadius
+				|| casterCenter.z - casterRadius > maxDepth) {
+				continue;
+			}
+
+			minDepth = std::min(minDepth, casterCenter.z - casterRadius);
+			m_CascadeCasters.push_back(caster);
+		}
+		cascade.depthRange = maxDepth - minDepth;
+
+		// Orthographic box around the sphere, depth to [0, 1]
+		const Matrix projection{
+			Vector4{ 1.0f / radius, 0.0f, 0.0f, 0.0f },
+			Vector4{ 0.0f, 1.0f / radius, 0.0f, 0.0f },
+			Vector4{ 0.0f, 0.0f, 1.0f / cascade.depthRange, 0.0f },
+			Vector4{ -lightCenter.x / radius, -lightCenter.y / radius, -minDepth / cascade.depthRange, 1.0f }
+		};
+		cascade.viewProjection = lightView * projection;
+
+		// Casters are drawn at the level of detail picked for the camera
+		cascade.depthMap.Clear();
+		for (const Caster& caster : m_CascadeCasters) {
+			const MeshLOD& lod{ caster.pMesh->GetCurrentLOD() };
+			cascade.depthMap.RasterizeMesh(caster.pMesh->GetVertices(), caster.pMesh->GetIndices(), lod.indexOffset, lod.indexCount,
+				caster.pMesh->primitiveTopology, caster.worldMatrix * cascade.viewProjection);
+		}
+
+		sliceStart = cascade.splitDepth;
+	}
+}
+
+float ShadowMap::Lookup(const Vector3& worldPosition, const Vector3& normal, float viewDepth) const {
+
+	const Cascade* pCascade{ nullptr };
+	for (const Cascade& cascade : m_Cascades) {
+		if (viewDepth <= cascade.splitDepth) {
+			pCascade = &cascade;
+			break;
+		}
+	}
+
+	if (!pCascade) {
+		return 1.0f;
+	}
+
+	const Vector3 offsetPosition{ worldPosition + normal * (NormalOffsetTexels * pCascade->texelWorldSize) };
+	const Vector3 lightPosition{ pCascade->viewProjection.TransformPoint(offsetPosition) };
+	const float depth{ lightPosition.z - DepthBias / pCascade->depthRange };
+
+	// Texel coordinates with the centers on whole numbers, the same mapping as the rasterizer's pixels
+	const float u{ (lightPosition.x + 1) * m_Size / 2 - 0.5f };
+	const float v{ (-lightPosition.y + 1) * m_Size / 2 - 0.5f };
+	const int baseX{ int(floorf(u)) };
+	const int baseY{ int(floorf(v)) };
+	const float fractionX{ u - baseX };
+	const float fractionY{ v - baseY };
+
+	// Box filter of whole texels, the outer ones weighted by the fraction so it slides smoothly between them
+	float visibility{ 0.0f };
+	for (int offsetY{ -PCFRadius }; offsetY <= PCFRadius + 1; ++offsetY) {
+		const float weightY{ (offsetY == -PCFRadius) ? 1.0f - fractionY : (offsetY == PCFRadius + 1) ? fractionY : 1.0f };
+		const int texelY{ Clamp(baseY + offsetY, 0, m_Size - 1) };
+
+		for (int offsetX{ -PCFRadius }; offsetX <= PCFRadius + 1; ++offsetX) {
+			const float weightX{ (offsetX == -PCFRadius) ? 1.0f - fractionX : (offsetX == PCFRadius + 1) ? fractionX : 1.0f };
+			const int texelX{ Clamp(baseX + offsetX, 0, m_Size - 1) };
+
+			if (depth <= pCascade->depthMap.GetDepth(texelX, texelY)) {
+				visibility += weightX * weightY;
+			}
+		}
+	}
+
+	const float kernelSize{ float(2 * PCFRadius + 1) };
+	return visibility / (kernelSize * kernelSize);
+}
+
+uint32_t ShadowMap::GetTriangleCount() const {
+	uint32_t triangleCount{ 0 };
+	for (const Cascade& cascade : m_Cascades) {
+		triangleCount += cascade.depthMap.GetTriangleCount();
+	}
+	return triangleCount;
+}
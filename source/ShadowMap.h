@@ -0,0 +1,63 @@
+#pragma once
+#include <vector>
+#include "DataTypes.h"
+#include "DepthRasterizer.h"
+
+struct Camera;
+class Mesh;
+
+// Cascaded shadow map for one directional light, drawn with the depth-only rasterizer.
+// The view distance is split into cascades, each fitted around its slice of the camera frustum
+// and snapped to whole texels so the shadow edges don't crawl while the camera moves.
+class ShadowMap
+{
+public:
+	static constexpr int MaxCascades{ 4 };
+
+	// Blend of the logarithmic and uniform split distances
+	static constexpr float SplitLambda{ 0.5f };
+
+	// Texels of the box filter on each side of the looked up one
+	static constexpr int PCFRadius{ 1 };
+
+	// Receivers are pushed towards the light by a world space depth and along their normal by texels of the cascade
+	static constexpr float DepthBias{ 0.05f };
+	static constexpr float NormalOffsetTexels{ 1.5f };
+
+	// Mesh drawn into the cascades at one world transform
+	struct Caster
+	{
+		const Mesh* pMesh{};
+		Matrix worldMatrix{};
+	};
+
+	explicit ShadowMap(int size = 1024, int cascadeCount = 3);
+
+	void Render(const Camera& camera, const Vector3& lightDirection, const std::vector<Caster>& casters);
+
+	// Fraction of the light reaching the point, 1 past the last cascade
+	float Lookup(const Vector3& worldPosition, const Vector3& normal, float viewDepth) const;
+
+	void SetLightIndex(int index) { m_LightIndex = index; }
+	int GetLightIndex() const { return m_LightIndex; }
+	int GetCascadeCount() const { return int(m_Cascades.size()); }
+	uint32_t GetTriangleCount() const;
+
+private:
+	struct Cascade
+	{
+		DepthRasterizer depthMap{};
+		Matrix viewProjection{};
+		float splitDepth{};
+		float texelWorldSize{};
+		float depthRange{};
+	};
+
+	std::vector<Cascade> m_Cascades{};
+
+	// Casters overlapping the cascade being drawn
+	std::vector<Caster> m_CascadeCasters{};
+	int m_Size{};
+	float m_ShadowDistance{ 100.0f };
+	int m_LightIndex{ -1 };
+};
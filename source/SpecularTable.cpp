@@ -0,0 +1,70 @@
+#include "pch.h"
+#include "SpecularTable.h"
+#include <cassert>
+#include "FastMath.h"
+
+using namespace dae;
+
+void SpecularTable::Build(float shininess) {
+
+	m_Shininess = shininess;
+	m_CosineSteps = std::max(MinCosineSteps, int(shininess * CosineStepsPerShininess));
+	m_Values.resize(size_t(m_CosineSteps) * GlossSteps);
+
+	for (int glossIndex{ 0 }; glossIndex < GlossSteps; ++glossIndex) {
+		const float exponent{ float(glossIndex) / (GlossSteps - 1) * shininess };
+		for (int cosineIndex{ 0 }; cosineIndex < m_CosineSteps; ++cosineIndex) {
+			m_Values[cosineIndex + glossIndex * m_CosineSteps] = powf(float(cosineIndex) / (m_CosineSteps - 1), exponent);
+		}
+	}
+
+	// The grid above has to hold MaxError for every shininess, the sweep is too slow to pay for outside debug builds
+#if defined(DEBUG) || defined(_DEBUG)
+	assert(MeasureError() <= MaxError && "ERROR: specular table error is over MaxError, the cosine steps need raising");
+#endif
+}
+
+float SpecularTable::Sample(float cosine, float gloss) const {
+
+	const float cosinePosition{ std::min(cosine, 1.0f) * (m_CosineSteps - 1) };
+
+	// Below the first step small exponents rise too steeply to interpolate, those rare samples take the exact value
+	if (cosinePosition < 1.0f) {
+		return FastMath::Pow(cosine, gloss * m_Shininess);
+	}
+
+	const float glossPosition{ Clamp(gloss, 0.0f, 1.0f) * (GlossSteps - 1) };
+	const int cosineIndex{ std::min(int(cosinePosition), m_CosineSteps - 2) };
+	const int glossIndex{ std::min(int(glossPosition), GlossSteps - 2) };
+	const float cosineWeight{ cosinePosition - cosineIndex };
+	const float glossWeight{ glossPosition - glossIndex };
+
+	const float* pRow0{ &m_Values[cosineIndex + glossIndex * m_CosineSteps] };
+	const float* pRow1{ pRow0 + m_CosineSteps };
+	const float value0{ pRow0[0] + (pRow0[1] - pRow0[0]) * cosineWeight };
+	const float value1{ pRow1[0] + (pRow1[1] - pRow1[0]) * cosineWeight };
+
+	return value0 + (value1 - value0) * glossWeight;
+}
+
+void SpecularTable::PrintError() const {
+	std::cout << "Specular table for shininess " << m_Shininess << ": " << m_CosineSteps << "x" << GlossSteps << ", max error " << MeasureError()
+		<< " (bound " << MaxError << ")\n";
+}
+
+float SpecularTable::MeasureError() const {
+
+	// Every gloss level of an 8 bit map against a cosine sweep four times finer than the table
+	const int cosineSamples{ (m_CosineSteps - 1) * 4 };
+	float maxError{ 0.0f };
+
+	for (int glossLevel{ 0 }; glossLevel <= 255; ++glossLevel) {
+		const float gloss{ glossLevel / 255.0f };
+		for (int cosineSample{ 0 }; cosineSample <= cosineSamples; ++cosineSample) {
+			const float cosine{ float(cosineSample) / cosineSamples };
+			maxError = std::max(maxError, std::abs(Sample(cosine, gloss) - powf(cosine, gloss * m_Shininess)));
+		}
+	}
+
+	return maxError;
+}
@@ -0,0 +1,32 @@
+#pragma once
+#include <vector>
+
+// Precomputed powf(cosine, gloss * shininess) for the phong specular term.
+// Cosine and gloss are quantised on a grid and interpolated bilinearly, the gloss axis has one step per 8 bit texel value.
+// The curve gets steeper with the shininess, so the cosine axis grows with it to keep the same error.
+class SpecularTable
+{
+public:
+	static constexpr int MinCosineSteps{ 256 };
+	static constexpr float CosineStepsPerShininess{ 10.0f };
+	static constexpr int GlossSteps{ 256 };
+
+	// Largest difference with powf allowed over every cosine and 8 bit gloss value
+	static constexpr float MaxError{ 0.005f };
+
+	void Build(float shininess);
+	float Sample(float cosine, float gloss) const;
+
+	float GetShininess() const { return m_Shininess; }
+
+	// Measures the table against powf and prints it with the bound, debug builds assert the bound on every Build
+	void PrintError() const;
+
+private:
+	float MeasureError() const;
+
+	// Gloss major so the two cosine neighbours of a sample are adjacent
+	std::vector<float> m_Values{};
+	int m_CosineSteps{};
+	float m_Shininess{ -1.0f };
+};
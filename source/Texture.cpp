@@ -1,32 +1,86 @@
 #include "pch.h"
+#include <emmintrin.h>
+#include <random>
 #include "Texture.h"
 #include "Vector2.h"
+#include "BlockCompression.h"
 #include <SDL_image.h>
 
-Texture::~Texture() {
+namespace {
+	Vector3 UnpackNormal(uint32_t texel) {
+		return Vector3{ float(int8_t(texel & 0xFF)), float(int8_t((texel >> 8) & 0xFF)), float(int8_t((texel >> 16) & 0xFF)) } / 127.0f;
+	}
 
-	if (m_pSurface)
-	{
-		SDL_FreeSurface(m_pSurface);
-		m_pSurface = nullptr;
+	// Alpha is 1, the same as the unsigned texels carry
+	uint32_t PackNormal(const Vector3& normal) {
+		const auto packChannel{ [](float value) { return uint32_t(uint8_t(int8_t(lroundf(Clamp(value, -1.0f, 1.0f) * 127.0f)))); } };
+		return packChannel(normal.x) | (packChannel(normal.y) << 8) | (packChannel(normal.z) << 16) | (127u << 24);
 	}
 
-	m_pResource->Release();
-	m_pSRV->Release();
+	// Bits of a 3 bit coordinate spread to every other bit, one axis of a Morton index inside a tile
+	constexpr uint32_t MortonSpread[8]{ 0, 1, 4, 5, 16, 17, 20, 21 };
+}
+
+Texture::~Texture() {
+
+	// Packed textures only live on the CPU
+	if (m_pResource) {
+		m_pResource->Release();
+		m_pSRV->Release();
+	}
 }
 
- void Texture::LoadFromFile(ID3D11Device* pDevice, const std::string& path) {
+ void Texture::LoadFromFile(ID3D11Device* pDevice, const std::string& path, TexelFormat format, bool isCompressed) {
+
+	// Whatever the file holds, keep it as R8G8B8A8 so the CPU levels and the GPU texture share one layout
+	SDL_Surface* pLoadedSurface{ IMG_Load(path.c_str()) };
+	SDL_Surface* pSurface{ SDL_ConvertSurfaceFormat(pLoadedSurface, SDL_PIXELFORMAT_ABGR8888, 0) };
+	SDL_FreeSurface(pLoadedSurface);
+
+	MipLevel& baseLevel{ m_MipLevels.emplace_back() };
+	baseLevel.width = pSurface->w;
+	baseLevel.height = pSurface->h;
+	baseLevel.texels.resize(size_t(baseLevel.width) * baseLevel.height);
+	for (int y{ 0 }; y < baseLevel.height; ++y) {
+		const uint32_t* pRow{ reinterpret_cast<const uint32_t*>(static_cast<const uint8_t*>(pSurface->pixels) + y * pSurface->pitch) };
+		std::copy_n(pRow, baseLevel.width, baseLevel.texels.begin() + size_t(y) * baseLevel.width);
+	}
+	SDL_FreeSurface(pSurface);
 
-	m_pSurface = IMG_Load(path.c_str());
-	m_pSurfacePixels = (uint32_t*)m_pSurface->pixels;
+	m_Format = format;
+	if (m_Format == TexelFormat::normal) {
+		DecodeNormals();
+	}
+	BuildMipChain();
+
+	// The GPU only takes block textures whose top level is made of whole blocks, the smaller levels are padded
+	const std::vector<uint32_t>& baseTexels{ m_MipLevels.front().texels };
+	if (isCompressed && GetWidth() % BlockCompression::BlockSize == 0 && GetHeight() % BlockCompression::BlockSize == 0) {
+		const bool isOpaque{ std::all_of(baseTexels.begin(), baseTexels.end(), [](uint32_t texel) { return (texel >> 24) == 0xFF; }) };
+		CompressLevels((m_Format == TexelFormat::normal) ? TextureCompression::bc5 : (isOpaque ? TextureCompression::bc1 : TextureCompression::bc3));
+	}
+
+	DXGI_FORMAT dxgiFormat{ (m_Format == TexelFormat::normal) ? DXGI_FORMAT_R8G8B8A8_SNORM : DXGI_FORMAT_R8G8B8A8_UNORM };
+	switch (m_Compression) {
+		case TextureCompression::bc1:
+			dxgiFormat = DXGI_FORMAT_BC1_UNORM;
+			break;
+		case TextureCompression::bc3:
+			dxgiFormat = DXGI_FORMAT_BC3_UNORM;
+			break;
+		case TextureCompression::bc5:
+			dxgiFormat = DXGI_FORMAT_BC5_SNORM;
+			break;
+		default:
+			break;
+	}
 
-	DXGI_FORMAT format = DXGI_FORMAT_R8G8B8A8_UNORM;
 	D3D11_TEXTURE2D_DESC desc{};
-	desc.Width = m_pSurface->w;
-	desc.Height = m_pSurface->h;
-	desc.MipLevels = 1;
+	desc.Width = m_MipLevels.front().width;
+	desc.Height = m_MipLevels.front().height;
+	desc.MipLevels = UINT(m_MipLevels.size());
 	desc.ArraySize = 1;
-	desc.Format = format;
+	desc.Format = dxgiFormat;
 	desc.SampleDesc.Count = 1;
 	desc.SampleDesc.Quality = 0;
 	desc.Usage = D3D11_USAGE_DEFAULT;
@@ -34,31 +88,603 @@ Texture::~Texture() {
 	desc.CPUAccessFlags = 0;
 	desc.MiscFlags = 0;
 
-	D3D11_SUBRESOURCE_DATA initData{};
-	initData.pSysMem = m_pSurface->pixels;
-	initData.SysMemPitch = static_cast<UINT>(m_pSurface->pitch);
-	initData.SysMemSlicePitch = static_cast<UINT>(m_pSurface->h * m_pSurface->pitch);
+	// One subresource per level, uploaded from the CPU chain, block rows are the pitch of compressed levels
+	std::vector<D3D11_SUBRESOURCE_DATA> initData(m_MipLevels.size());
+	for (size_t level{ 0 }; level < m_MipLevels.size(); ++level) {
+		const MipLevel& mipLevel{ m_MipLevels[level] };
+		if (m_Compression != TextureCompression::none) {
+			initData[level].pSysMem = mipLevel.blocks.data();
+			initData[level].SysMemPitch = static_cast<UINT>(mipLevel.blocksPerRow * BlockCompression::GetBlockBytes(m_Compression));
+			initData[level].SysMemSlicePitch = static_cast<UINT>(mipLevel.blocks.size());
+		}
+		else {
+			initData[level].pSysMem = mipLevel.texels.data();
+			initData[level].SysMemPitch = static_cast<UINT>(mipLevel.width * sizeof(uint32_t));
+			initData[level].SysMemSlicePitch = static_cast<UINT>(mipLevel.texels.size() * sizeof(uint32_t));
+		}
+	}
 
-	HRESULT hr = pDevice->CreateTexture2D(&desc, &initData, &m_pResource);
+	HRESULT hr = pDevice->CreateTexture2D(&desc, initData.data(), &m_pResource);
 
 	D3D11_SHADER_RESOURCE_VIEW_DESC SRVDesc{};
-	SRVDesc.Format = format;
+	SRVDesc.Format = dxgiFormat;
 	SRVDesc.ViewDimension = D3D11_SRV_DIMENSION_TEXTURE2D;
-	SRVDesc.Texture2D.MipLevels = 1;
+	SRVDesc.Texture2D.MipLevels = desc.MipLevels;
 
 	hr = pDevice->CreateShaderResourceView(m_pResource, &SRVDesc, &m_pSRV);
+
+	// The GPU copy was uploaded row by row, the software sampler reads the tiled one. Blocks are already tiles of their own.
+	if (m_Compression == TextureCompression::none) {
+		SwizzleLevels();
+	}
 }
 
+ void Texture::DecodeNormals() {
+
+	 // Stored as 2n - 1 in unsigned bytes, normalised once here instead of per fragment
+	 for (uint32_t& texel : m_MipLevels.front().texels) {
+		 const Vector3 encoded{ float(texel & 0xFF), float((texel >> 8) & 0xFF), float((texel >> 16) & 0xFF) };
+		 const Vector3 normal{ encoded * (2.0f / 255.0f) - Vector3{ 1.0f, 1.0f, 1.0f } };
+		 texel = PackNormal((normal.SqrMagnitude() > 0.0f) ? normal.Normalized() : Vector3::UnitZ);
+	 }
+ }
+
+ void Texture::BuildMipChain() {
+
+	 // Every level averages 2x2 texels of the one above, odd edges repeat their last row or column
+	 while (m_MipLevels.back().width > 1 || m_MipLevels.back().height > 1) {
+		 const MipLevel& source{ m_MipLevels.back() };
+
+		 MipLevel level{};
+		 level.width = std::max(source.width / 2, 1);
+		 level.height = std::max(source.height / 2, 1);
+		 level.texels.resize(size_t(level.width) * level.height);
+
+		 for (int y{ 0 }; y < level.height; ++y) {
+			 const int y0{ std::min(2 * y, source.height - 1) };
+			 const int y1{ std::min(2 * y + 1, source.height - 1) };
+
+			 for (int x{ 0 }; x < level.width; ++x) {
+				 const int x0{ std::min(2 * x, source.width - 1) };
+				 const int x1{ std::min(2 * x + 1, source.width - 1) };
+				 const uint32_t texels[4]{
+					 source.texels[x0 + y0 * source.width], source.texels[x1 + y0 * source.width],
+					 source.texels[x0 + y1 * source.width], source.texels[x1 + y1 * source.width]
+				 };
+
+				 // Normals are averaged as vectors and made unit length again
+				 if (m_Format == TexelFormat::normal) {
+					 const Vector3 sum{ UnpackNormal(texels[0]) + UnpackNormal(texels[1]) + UnpackNormal(texels[2]) + UnpackNormal(texels[3]) };
+					 level.texels[x + y * level.width] = PackNormal((sum.SqrMagnitude() > 0.0f) ? sum.Normalized() : Vector3::UnitZ);
+					 continue;
+				 }
+
+				 uint32_t averaged{ 0 };
+				 for (int shift{ 0 }; shift < 32; shift += 8) {
+					 uint32_t sum{ 2 };
+					 for (uint32_t texel : texels) {
+						 sum += (texel >> shift) & 0xFF;
+					 }
+					 averaged |= (sum / 4) << shift;
+				 }
+				 level.texels[x + y * level.width] = averaged;
+			 }
+		 }
+
+		 m_MipLevels.push_back(std::move(level));
+	 }
+ }
+
+ void Texture::SwizzleLevels() {
+
+	 for (MipLevel& level : m_MipLevels) {
+		 level.tilesPerRow = (level.width + TileSize - 1) >> TileShift;
+		 const int tilesPerColumn{ (level.height + TileSize - 1) >> TileShift };
+		 SetWrapMasks(level);
+
+		 // Edge tiles of other sizes are padded, the padding is never read
+		 std::vector<uint32_t> tiled(size_t(level.tilesPerRow) * tilesPerColumn * TileSize * TileSize);
+		 for (int y{ 0 }; y < level.height; ++y) {
+			 for (int x{ 0 }; x < level.width; ++x) {
+				 tiled[GetTexelAddress(level, x, y)] = level.texels[x + size_t(y) * level.width];
+			 }
+		 }
+		 level.texels = std::move(tiled);
+	 }
+ }
+
+ void Texture::CompressLevels(TextureCompression compression) {
+
+	 const int blockSize{ BlockCompression::BlockSize };
+	 const int blockBytes{ BlockCompression::GetBlockBytes(compression) };
+	 for (MipLevel& level : m_MipLevels) {
+		 level.blocksPerRow = (level.width + blockSize - 1) / blockSize;
+		 const int blocksPerColumn{ (level.height + blockSize - 1) / blockSize };
+		 level.blocks.resize(size_t(level.blocksPerRow) * blocksPerColumn * blockBytes);
+		 SetWrapMasks(level);
+
+		 // Levels smaller than a block repeat their last row or column into it
+		 for (int blockY{ 0 }; blockY < blocksPerColumn; ++blockY) {
+			 for (int blockX{ 0 }; blockX < level.blocksPerRow; ++blockX) {
+				 uint32_t texels[blockSize * blockSize]{};
+				 for (int y{ 0 }; y < blockSize; ++y) {
+					 for (int x{ 0 }; x < blockSize; ++x) {
+						 const int texelX{ std::min(blockX * blockSize + x, level.width - 1) };
+						 const int texelY{ std::min(blockY * blockSize + y, level.height - 1) };
+						 texels[x + y * blockSize] = level.texels[texelX + size_t(texelY) * level.width];
+					 }
+				 }
+				 BlockCompression::EncodeBlock(compression, texels, &level.blocks[(size_t(blockY) * level.blocksPerRow + blockX) * blockBytes]);
+			 }
+		 }
+
+		 level.texels.clear();
+		 level.texels.shrink_to_fit();
+	 }
+	 m_Compression = compression;
+ }
+
+ void Texture::SetWrapMasks(MipLevel& level) {
+	 level.widthMask = ((level.width & (level.width - 1)) == 0) ? level.width - 1 : 0;
+	 level.heightMask = ((level.height & (level.height - 1)) == 0) ? level.height - 1 : 0;
+ }
+
+ int Texture::WrapCoordinate(int coordinate, int size, int mask) {
+	 if (mask != 0 || size == 1) {
+		 return coordinate & mask;
+	 }
+
+	 coordinate %= size;
+	 return (coordinate < 0) ? coordinate + size : coordinate;
+ }
+
+ size_t Texture::GetTexelAddress(const MipLevel& level, int x, int y) {
+	 const size_t tile{ size_t(y >> TileShift) * level.tilesPerRow + (x >> TileShift) };
+	 return (tile << (2 * TileShift)) | MortonSpread[x & (TileSize - 1)] | (MortonSpread[y & (TileSize - 1)] << 1);
+ }
+
+ uint32_t Texture::FetchTexel(const MipLevel& level, int x, int y) const {
+	 if (m_Compression == TextureCompression::none) {
+		 return level.texels[GetTexelAddress(level, x, y)];
+	 }
+
+	 const int blockSize{ BlockCompression::BlockSize };
+	 return BlockCompression::DecodeTexel(m_Compression, GetLevelData(level) + GetTexelByteOffset(level, x, y), x % blockSize, y % blockSize);
+ }
+
+ size_t Texture::GetTexelByteOffset(const MipLevel& level, int x, int y) const {
+	 if (m_Compression == TextureCompression::none) {
+		 return GetTexelAddress(level, x, y) * sizeof(uint32_t);
+	 }
+
+	 const int blockSize{ BlockCompression::BlockSize };
+	 return (size_t(y / blockSize) * level.blocksPerRow + x / blockSize) * BlockCompression::GetBlockBytes(m_Compression);
+ }
+
+ const uint8_t* Texture::GetLevelData(const MipLevel& level) const {
+	 return (m_Compression == TextureCompression::none) ? reinterpret_cast<const uint8_t*>(level.texels.data()) : level.blocks.data();
+ }
+
+ size_t Texture::GetMemorySize() const {
+	 size_t size{ 0 };
+	 for (const MipLevel& level : m_MipLevels) {
+		 size += level.texels.size() * sizeof(uint32_t) + level.blocks.size();
+	 }
+	 return size;
+ }
+
+ __m128 Texture::CompleteNormal(__m128 channels) const {
+	 if (m_Compression != TextureCompression::bc5) {
+		 return channels;
+	 }
+
+	 alignas(16) float values[4];
+	 _mm_store_ps(values, channels);
+	 values[2] = sqrtf(std::max(1.0f - values[0] * values[0] - values[1] * values[1], 0.0f));
+	 return _mm_load_ps(values);
+ }
+
+ __m128 Texture::UnpackTexel(uint32_t texel) const {
+	 if (m_Format == TexelFormat::normal) {
+		 const __m128 channels{ _mm_setr_ps(float(int8_t(texel & 0xFF)), float(int8_t((texel >> 8) & 0xFF)),
+			 float(int8_t((texel >> 16) & 0xFF)), float(int8_t(texel >> 24))) };
+		 return _mm_mul_ps(channels, _mm_set1_ps(1.0f / 127.0f));
+	 }
+
+	 const __m128 channels{ _mm_setr_ps(float(texel & 0xFF), float((texel >> 8) & 0xFF), float((texel >> 16) & 0xFF), float(texel >> 24)) };
+	 return _mm_mul_ps(channels, _mm_set1_ps(1.0f / 255.0f));
+ }
+
+ ColorRGB Texture::ToColor(__m128 channels) {
+	 alignas(16) float values[4];
+	 _mm_store_ps(values, channels);
+	 return ColorRGB{ values[0], values[1], values[2] };
+ }
+
  ID3D11ShaderResourceView* Texture::GetSRV() {
 	 return m_pSRV;
  }
 
  ColorRGB Texture::Sample(const Vector2& uv) const
  {
-	 //TODO
-	 //Sample the correct texel for the given uv
-	 int width = m_pSurface->w;
-	 int height = m_pSurface->h;
+	 const int texelIndex{ GetTexelIndex(uv) };
+	 const MipLevel& level{ m_MipLevels.front() };
+	 return ToColor(CompleteNormal(UnpackTexel(FetchTexel(level, texelIndex % level.width, texelIndex / level.width))));
+ }
+
+ ColorRGB Texture::Sample(const Vector2& uv, const Vector2& uvDdx, const Vector2& uvDdy, Filtering filtering) const
+ {
+	 return ToColor(SampleFiltered(uv, uvDdx, uvDdy, filtering));
+ }
+
+ Vector4 Texture::SampleChannels(const Vector2& uv, const Vector2& uvDdx, const Vector2& uvDdy, Filtering filtering) const
+ {
+	 alignas(16) float values[4];
+	 _mm_store_ps(values, SampleFiltered(uv, uvDdx, uvDdy, filtering));
+	 return Vector4{ values[0], values[1], values[2], values[3] };
+ }
+
+ __m128 Texture::SampleFiltered(const Vector2& uv, const Vector2& uvDdx, const Vector2& uvDdy, Filtering filtering) const
+ {
+	 switch (filtering) {
+		 case Filtering::point:
+			 return CompleteNormal(SamplePoint(uv, GetMipLevel(uvDdx, uvDdy)));
+		 case Filtering::anisotropic:
+			 return CompleteNormal(SampleAnisotropic(uv, uvDdx, uvDdy));
+		 default:
+			 return CompleteNormal(SampleTrilinear(uv, GetMipLevel(uvDdx, uvDdy)));
+	 }
+ }
+
+ __m128 Texture::SamplePoint(const Vector2& uv, float mipLevel) const
+ {
+	 // Nearest level and nearest texel in it
+	 const MipLevel& level{ m_MipLevels[Clamp(int(mipLevel + 0.5f), 0, int(m_MipLevels.size()) - 1)] };
+
+	 const int x{ WrapCoordinate(int(floorf(uv.x * level.width)), level.width, level.widthMask) };
+	 const int y{ WrapCoordinate(int(floorf(uv.y * level.height)), level.height, level.heightMask) };
+
+	 return UnpackTexel(FetchTexel(level, x, y));
+ }
+
+ __m128 Texture::SampleAnisotropic(const Vector2& uv, const Vector2& uvDdx, const Vector2& uvDdy) const
+ {
+	 // Footprint axes in level 0 texels
+	 const float lengthX{ Vector2{ uvDdx.x * GetWidth(), uvDdx.y * GetHeight() }.Magnitude() };
+	 const float lengthY{ Vector2{ uvDdy.x * GetWidth(), uvDdy.y * GetHeight() }.Magnitude() };
+	 const float majorLength{ std::max(lengthX, lengthY) };
+	 const float minorLength{ std::min(lengthX, lengthY) };
+	 if (majorLength <= 1.0f) {
+		 return SampleTrilinear(uv, 0.0f);
+	 }
+
+	 // Trilinear taps spread along the long axis, each one filtering a footprint as wide as the short axis
+	 const int tapCount{ (minorLength * MaxAnisotropy > majorLength) ? int(ceilf(majorLength / minorLength)) : MaxAnisotropy };
+	 const float tapLength{ majorLength / tapCount };
+	 const float mipLevel{ (tapLength > 1.0f) ? log2f(tapLength) : 0.0f };
+	 const Vector2 majorAxis{ (lengthX >= lengthY) ? uvDdx : uvDdy };
+
+	 __m128 sampled{ _mm_setzero_ps() };
+	 for (int tap{ 0 }; tap < tapCount; ++tap) {
+		 const float offset{ (tap + 0.5f) / tapCount - 0.5f };
+		 sampled = _mm_add_ps(sampled, SampleTrilinear(uv + majorAxis * offset, mipLevel));
+	 }
+
+	 return _mm_mul_ps(sampled, _mm_set1_ps(1.0f / tapCount));
+ }
+
+ ColorRGB Texture::SampleLevel(const Vector2& uv, float mipLevel) const
+ {
+	 return ToColor(CompleteNormal(SampleTrilinear(uv, mipLevel)));
+ }
+
+ __m128 Texture::SampleTrilinear(const Vector2& uv, float mipLevel) const
+ {
+	 const float maxLevel{ float(m_MipLevels.size() - 1) };
+	 mipLevel = Clamp(mipLevel, 0.0f, maxLevel);
+
+	 const int level{ int(mipLevel) };
+	 const float fraction{ mipLevel - level };
+	 const __m128 sampled{ SampleBilinear(m_MipLevels[level], uv) };
+	 if (fraction <= 0.0f) {
+		 return sampled;
+	 }
+
+	 const __m128 difference{ _mm_sub_ps(SampleBilinear(m_MipLevels[level + 1], uv), sampled) };
+	 return _mm_add_ps(sampled, _mm_mul_ps(difference, _mm_set1_ps(fraction)));
+ }
+
+ float Texture::GetMipLevel(const Vector2& uvDdx, const Vector2& uvDdy) const
+ {
+	 // Longest side of the footprint in level 0 texels, the log of its square halved saves the square root
+	 const Vector2 texelDdx{ uvDdx.x * GetWidth(), uvDdx.y * GetHeight() };
+	 const Vector2 texelDdy{ uvDdy.x * GetWidth(), uvDdy.y * GetHeight() };
+	 const float footprintSquared{ std::max(texelDdx.SqrMagnitude(), texelDdy.SqrMagnitude()) };
+	 if (footprintSquared <= 1.0f) {
+		 return 0.0f;
+	 }
+
+	 return 0.5f * log2f(footprintSquared);
+ }
+
+ void Texture::Prefetch(const Vector2& uv, const Vector2& uvDdx, const Vector2& uvDdy) const
+ {
+	 const MipLevel& level{ m_MipLevels[std::min(int(GetMipLevel(uvDdx, uvDdy)), int(m_MipLevels.size()) - 1)] };
+	 const int x{ WrapCoordinate(int(floorf(uv.x * level.width)), level.width, level.widthMask) };
+	 const int y{ WrapCoordinate(int(floorf(uv.y * level.height)), level.height, level.heightMask) };
+
+	 _mm_prefetch(reinterpret_cast<const char*>(GetLevelData(level) + GetTexelByteOffset(level, x, y)), _MM_HINT_T0);
+ }
+
+ __m128 Texture::SampleBilinear(const MipLevel& level, const Vector2& uv) const
+ {
+	 // The 2x2 footprint is fetched into one register and weighted in float lanes, one texel per register after widening
+	 // Texel centers sit on whole numbers after the half texel shift, addresses wrap like the hardware sampler
+	 const float x{ uv.x * level.width - 0.5f };
+	 const float y{ uv.y * level.height - 0.5f };
+	 const float floorX{ floorf(x) };
+	 const float floorY{ floorf(y) };
+	 const float fractionX{ x - floorX };
+	 const float fractionY{ y - floorY };
+
+	 const int x0{ WrapCoordinate(int(floorX), level.width, level.widthMask) };
+	 const int y0{ WrapCoordinate(int(floorY), level.height, level.heightMask) };
+	 const int x1{ (x0 + 1 == level.width) ? 0 : x0 + 1 };
+	 const int y1{ (y0 + 1 == level.height) ? 0 : y0 + 1 };
+
+	 __m128i footprint{};
+	 if (m_Compression != TextureCompression::none) {
+		 const uint8_t* pBlocks[4]{ level.blocks.data() + GetTexelByteOffset(level, x0, y0), level.blocks.data() + GetTexelByteOffset(level, x1, y0),
+			 level.blocks.data() + GetTexelByteOffset(level, x0, y1), level.blocks.data() + GetTexelByteOffset(level, x1, y1) };
+		 const int blockMask{ BlockCompression::BlockSize - 1 };
+		 const int blockX[4]{ x0 & blockMask, x1 & blockMask, x0 & blockMask, x1 & blockMask };
+		 const int blockY[4]{ y0 & blockMask, y0 & blockMask, y1 & blockMask, y1 & blockMask };
+		 footprint = BlockCompression::DecodeFootprint(m_Compression, pBlocks, blockX, blockY);
+	 }
+	 else {
+		 // The address splits into a row part and a column part, so the four texels share the lookups
+		 const size_t row0{ (size_t(y0 >> TileShift) * level.tilesPerRow << (2 * TileShift)) | (MortonSpread[y0 & (TileSize - 1)] << 1) };
+		 const size_t row1{ (size_t(y1 >> TileShift) * level.tilesPerRow << (2 * TileShift)) | (MortonSpread[y1 & (TileSize - 1)] << 1) };
+		 const size_t column0{ (size_t(x0 >> TileShift) << (2 * TileShift)) | MortonSpread[x0 & (TileSize - 1)] };
+		 const size_t column1{ (size_t(x1 >> TileShift) << (2 * TileShift)) | MortonSpread[x1 & (TileSize - 1)] };
+
+		 const uint32_t* pTexels{ level.texels.data() };
+		 footprint = _mm_setr_epi32(int(pTexels[row0 + column0]), int(pTexels[row0 + column1]), int(pTexels[row1 + column0]), int(pTexels[row1 + column1]));
+	 }
+
+	 // Signed bytes go to the high half of each lane and are shifted back down, which extends the sign
+	 const __m128i zero{ _mm_setzero_si128() };
+	 __m128 topLeft{}, topRight{}, bottomLeft{}, bottomRight{};
+	 if (m_Format == TexelFormat::normal) {
+		 const __m128i topWords{ _mm_srai_epi16(_mm_unpacklo_epi8(zero, footprint), 8) };
+		 const __m128i bottomWords{ _mm_srai_epi16(_mm_unpackhi_epi8(zero, footprint), 8) };
+		 topLeft = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(zero, topWords), 16));
+		 topRight = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(zero, topWords), 16));
+		 bottomLeft = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(zero, bottomWords), 16));
+		 bottomRight = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(zero, bottomWords), 16));
+	 }
+	 else {
+		 const __m128i topWords{ _mm_unpacklo_epi8(footprint, zero) };
+		 const __m128i bottomWords{ _mm_unpackhi_epi8(footprint, zero) };
+		 topLeft = _mm_cvtepi32_ps(_mm_unpacklo_epi16(topWords, zero));
+		 topRight = _mm_cvtepi32_ps(_mm_unpackhi_epi16(topWords, zero));
+		 bottomLeft = _mm_cvtepi32_ps(_mm_unpacklo_epi16(bottomWords, zero));
+		 bottomRight = _mm_cvtepi32_ps(_mm_unpackhi_epi16(bottomWords, zero));
+	 }
+
+	 // Weights folded with the 1 / 255 or 1 / 127 of the unpacking
+	 const float scale{ (m_Format == TexelFormat::normal) ? 1.0f / 127.0f : 1.0f / 255.0f };
+	 const float weightTop{ (1.0f - fractionY) * scale };
+	 const float weightBottom{ fractionY * scale };
+	 __m128 color{ _mm_mul_ps(topLeft, _mm_set1_ps((1.0f - fractionX) * weightTop)) };
+	 color = _mm_add_ps(color, _mm_mul_ps(topRight, _mm_set1_ps(fractionX * weightTop)));
+	 color = _mm_add_ps(color, _mm_mul_ps(bottomLeft, _mm_set1_ps((1.0f - fractionX) * weightBottom)));
+	 color = _mm_add_ps(color, _mm_mul_ps(bottomRight, _mm_set1_ps(fractionX * weightBottom)));
+	 return color;
+ }
+
+ void Texture::RunFilteringBenchmark() const
+ {
+	 // Footprints from magnified up to 64 texels long with up to 8:1 anisotropy, the same set for every filter
+	 const int sampleCount{ 1 << 18 };
+	 std::mt19937 generator{ 1 };
+	 std::uniform_real_distribution<float> coordinate{ 0.0f, 1.0f };
+	 std::uniform_real_distribution<float> footprint{ -6.0f, 0.0f };
+	 std::uniform_real_distribution<float> stretch{ 1.0f, 8.0f };
+
+	 std::vector<Vector2> uvs(sampleCount), uvDdxs(sampleCount), uvDdys(sampleCount);
+	 for (int sample{ 0 }; sample < sampleCount; ++sample) {
+		 const float minorLength{ exp2f(footprint(generator) - 4.0f) };
+		 const float angle{ coordinate(generator) * PI_2 };
+		 uvs[sample] = { coordinate(generator), coordinate(generator) };
+		 uvDdxs[sample] = Vector2{ cosf(angle), sinf(angle) } * (minorLength * stretch(generator));
+		 uvDdys[sample] = Vector2{ -sinf(angle), cosf(angle) } * minorLength;
+	 }
+
+	 std::cout << "Filtering benchmark, " << GetWidth() << "x" << GetHeight() << " texture, nanoseconds per sample\n";
+	 for (Filtering filtering : { Filtering::point, Filtering::linear, Filtering::anisotropic }) {
+		 ColorRGB sum{};
+		 const uint64_t start{ SDL_GetPerformanceCounter() };
+		 for (int sample{ 0 }; sample < sampleCount; ++sample) {
+			 sum += Sample(uvs[sample], uvDdxs[sample], uvDdys[sample], filtering);
+		 }
+		 const float nanoseconds{ 1e9f * float(SDL_GetPerformanceCounter() - start) / SDL_GetPerformanceFrequency() / sampleCount };
+
+		 // The sum is printed so the loop can't be left out
+		 const char* names[]{ "point", "linear", "anisotropic" };
+		 std::cout << names[int(filtering)] << ": " << nanoseconds << " (average " << (sum.r + sum.g + sum.b) / (3 * sampleCount) << ")\n";
+	 }
+ }
+
+ void Texture::RunLayoutBenchmark() const
+ {
+	 // Bilinear level 0 samples, one texel apart along rows, one texel apart along columns and scattered over the texture
+	 const int sampleCount{ 1 << 20 };
+	 const MipLevel& level{ m_MipLevels.front() };
+	 std::mt19937 generator{ 1 };
+	 std::uniform_real_distribution<float> coordinate{ 0.0f, 1.0f };
+
+	 std::vector<Vector2> rowUVs(sampleCount), columnUVs(sampleCount), randomUVs(sampleCount);
+	 for (int sample{ 0 }; sample < sampleCount; ++sample) {
+		 const float along{ (sample % level.width + 0.5f) / level.width };
+		 const float across{ (sample / level.width + 0.5f) / level.height };
+		 rowUVs[sample] = { along, across };
+		 columnUVs[sample] = { (sample / level.height + 0.5f) / level.width, (sample % level.height + 0.5f) / level.height };
+		 randomUVs[sample] = { coordinate(generator), coordinate(generator) };
+	 }
+
+	 std::cout << "Layout benchmark, " << level.width << "x" << level.height << " texture, million bilinear samples per second\n";
+	 const std::pair<const char*, const std::vector<Vector2>*> patterns[]{ { "rows", &rowUVs }, { "columns", &columnUVs }, { "random", &randomUVs } };
+	 for (const auto& [name, pUVs] : patterns) {
+		 ColorRGB sum{};
+		 const uint64_t start{ SDL_GetPerformanceCounter() };
+		 for (const Vector2& uv : *pUVs) {
+			 sum += ToColor(SampleBilinear(level, uv));
+		 }
+		 const float seconds{ float(SDL_GetPerformanceCounter() - start) / SDL_GetPerformanceFrequency() };
+
+		 // The sum is printed so the loop can't be left out
+		 std::cout << name << ": " << sampleCount / seconds / 1e6f << " (average " << (sum.r + sum.g + sum.b) / (3 * sampleCount) << ")\n";
+	 }
+ }
+
+ Texture* Texture::PackColorAlpha(const Texture& colorMap, const Texture& alphaMap)
+ {
+	 if (colorMap.GetWidth() != alphaMap.GetWidth() || colorMap.GetHeight() != alphaMap.GetHeight()) {
+		 return nullptr;
+	 }
+
+	 // Same sizes give the same levels, the alpha map is read through FetchTexel so its storage doesn't matter
+	 Texture* pPacked{ new Texture() };
+	 pPacked->m_MipLevels = colorMap.m_MipLevels;
+	 for (size_t levelIndex{ 0 }; levelIndex < pPacked->m_MipLevels.size(); ++levelIndex) {
+		 MipLevel& level{ pPacked->m_MipLevels[levelIndex] };
+		 const MipLevel& alphaLevel{ alphaMap.m_MipLevels[levelIndex] };
+
+		 if (colorMap.m_Compression == TextureCompression::none) {
+			 for (int y{ 0 }; y < level.height; ++y) {
+				 for (int x{ 0 }; x < level.width; ++x) {
+					 uint32_t& texel{ level.texels[GetTexelAddress(level, x, y)] };
+					 texel = (texel & 0x00FFFFFF) | ((alphaMap.FetchTexel(alphaLevel, x, y) & 0xFF) << 24);
+				 }
+			 }
+			 continue;
+		 }
+
+		 // Compressed colours keep their blocks, the alpha blocks are encoded next to them
+		 const int blockSize{ BlockCompression::BlockSize };
+		 const int colorBlockBytes{ BlockCompression::GetBlockBytes(colorMap.m_Compression) };
+		 const int colorOffset{ (colorMap.m_Compression == TextureCompression::bc3) ? 8 : 0 };
+		 const int blockBytes{ BlockCompression::GetBlockBytes(TextureCompression::bc3) };
+		 const size_t blockCount{ level.blocks.size() / colorBlockBytes };
+
+		 std::vector<uint8_t> blocks(blockCount * blockBytes);
+		 for (size_t block{ 0 }; block < blockCount; ++block) {
+			 const int blockX{ int(block % level.blocksPerRow) * blockSize };
+			 const int blockY{ int(block / level.blocksPerRow) * blockSize };
+
+			 uint8_t alphas[blockSize * blockSize]{};
+			 for (int texel{ 0 }; texel < blockSize * blockSize; ++texel) {
+				 const int x{ std::min(blockX + texel % blockSize, level.width - 1) };
+				 const int y{ std::min(blockY + texel / blockSize, level.height - 1) };
+				 alphas[texel] = uint8_t(alphaMap.FetchTexel(alphaLevel, x, y) & 0xFF);
+			 }
+			 BlockCompression::EncodeBC3FromBC1(&level.blocks[block * colorBlockBytes + colorOffset], alphas, &blocks[block * blockBytes]);
+		 }
+		 level.blocks = std::move(blocks);
+	 }
+
+	 if (colorMap.m_Compression != TextureCompression::none) {
+		 pPacked->m_Compression = TextureCompression::bc3;
+	 }
+	 return pPacked;
+ }
+
+ Texture* Texture::PackNormalScalar(const Texture& normalMap, const Texture& scalarMap)
+ {
+	 if (normalMap.GetWidth() != scalarMap.GetWidth() || normalMap.GetHeight() != scalarMap.GetHeight()
+		 || normalMap.m_Compression != TextureCompression::none) {
+		 return nullptr;
+	 }
+
+	 // Signed like the normal map, the scalar only uses the positive half
+	 Texture* pPacked{ new Texture() };
+	 pPacked->m_Format = TexelFormat::normal;
+	 pPacked->m_MipLevels = normalMap.m_MipLevels;
+	 for (size_t levelIndex{ 0 }; levelIndex < pPacked->m_MipLevels.size(); ++levelIndex) {
+		 MipLevel& level{ pPacked->m_MipLevels[levelIndex] };
+		 const MipLevel& scalarLevel{ scalarMap.m_MipLevels[levelIndex] };
+		 for (int y{ 0 }; y < level.height; ++y) {
+			 for (int x{ 0 }; x < level.width; ++x) {
+				 const uint32_t scalar{ scalarMap.FetchTexel(scalarLevel, x, y) };
+				 const uint32_t luminance{ (54 * (scalar & 0xFF) + 183 * ((scalar >> 8) & 0xFF) + 19 * ((scalar >> 16) & 0xFF) + 128) >> 8 };
+				 uint32_t& texel{ level.texels[GetTexelAddress(level, x, y)] };
+				 texel = (texel & 0x0000FFFF) | (((luminance * 127 + 127) / 255) << 16) | (127u << 24);
+			 }
+		 }
+	 }
+	 return pPacked;
+ }
+
+ void Texture::RunPackingBenchmark(const char* name, const std::vector<const Texture*>& maps)
+ {
+	 // A 1280x720 view of a rotated surface at a bit under one texel per pixel, so every map reads level 0 bilinearly
+	 const int screenWidth{ 1280 };
+	 const int screenHeight{ 720 };
+	 const Vector2 uvDdx{ 0.75f / maps.front()->GetWidth(), 0.25f / maps.front()->GetHeight() };
+	 const Vector2 uvDdy{ -0.25f / maps.front()->GetWidth(), 0.75f / maps.front()->GetHeight() };
+	 const Vector2 uvOrigin{ 0.2f, 0.1f };
+
+	 // Cache lines read at least once, one flag per line of every map's level 0
+	 std::vector<std::vector<uint8_t>> touchedLines(maps.size());
+	 for (size_t map{ 0 }; map < maps.size(); ++map) {
+		 const MipLevel& level{ maps[map]->m_MipLevels.front() };
+		 touchedLines[map].resize((level.texels.size() * sizeof(uint32_t) + level.blocks.size()) / 64 + 1);
+	 }
+
+	 __m128 sum{ _mm_setzero_ps() };
+	 const uint64_t start{ SDL_GetPerformanceCounter() };
+	 for (int y{ 0 }; y < screenHeight; ++y) {
+		 for (int x{ 0 }; x < screenWidth; ++x) {
+			 const Vector2 uv{ uvOrigin + uvDdx * (x + 0.5f) + uvDdy * (y + 0.5f) };
+			 for (const Texture* pMap : maps) {
+				 sum = _mm_add_ps(sum, pMap->SampleFiltered(uv, uvDdx, uvDdy, Filtering::linear));
+			 }
+		 }
+	 }
+	 const float seconds{ float(SDL_GetPerformanceCounter() - start) / SDL_GetPerformanceFrequency() };
+
+	 // The footprints again, outside the timed loop
+	 for (size_t map{ 0 }; map < maps.size(); ++map) {
+		 const MipLevel& level{ maps[map]->m_MipLevels.front() };
+		 for (int y{ 0 }; y < screenHeight; ++y) {
+			 for (int x{ 0 }; x < screenWidth; ++x) {
+				 const Vector2 uv{ uvOrigin + uvDdx * (x + 0.5f) + uvDdy * (y + 0.5f) };
+				 const int x0{ int(floorf(uv.x * level.width - 0.5f)) };
+				 const int y0{ int(floorf(uv.y * level.height - 0.5f)) };
+				 for (int corner{ 0 }; corner < 4; ++corner) {
+					 const int texelX{ WrapCoordinate(x0 + (corner & 1), level.width, level.widthMask) };
+					 const int texelY{ WrapCoordinate(y0 + (corner >> 1), level.height, level.heightMask) };
+					 touchedLines[map][maps[map]->GetTexelByteOffset(level, texelX, texelY) / 64] = 1;
+				 }
+			 }
+		 }
+	 }
+
+	 size_t lineCount{ 0 };
+	 for (const std::vector<uint8_t>& lines : touchedLines) {
+		 lineCount += std::count(lines.begin(), lines.end(), uint8_t(1));
+	 }
+
+	 const ColorRGB average{ ToColor(sum) / float(screenWidth * screenHeight) };
+	 std::cout << name << ": " << maps.size() << " maps, " << lineCount * 64 / 1024 << " KiB touched per frame, "
+		 << 1e9f * seconds / (screenWidth * screenHeight) << " ns per pixel (average " << average.r << ")\n";
+ }
+
+ int Texture::GetTexelIndex(const Vector2& uv) const
+ {
+	 int width = GetWidth();
+	 int height = GetHeight();
 
 	 int px{ int(uv.x * (width - 1)) % width };
 	 int py{ int(uv.y * (height - 1)) % height };
@@ -71,9 +697,5 @@ Texture::~Texture() {
 		 py += height;
 	 }
 
-	 Uint8 r{}, g{}, b{};
-	 SDL_GetRGB(m_pSurfacePixels[px + py * width], m_pSurface->format, &r, &g, &b);
-	 ColorRGB sampledColor{ float(r), float(g), float(b) };
-
-	 return (sampledColor / 255.0f);
- }
\ No newline at end of file
+	 return px + py * width;
+ }
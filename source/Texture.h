@@ -1,28 +1,125 @@
 #pragma once
 #include <SDL_surface.h>
+#include <xmmintrin.h>
 #include <string>
+#include <vector>
 #include "ColorRGB.h"
+#include "DataTypes.h"
 
 using namespace dae;
 
 class Texture
 {
 public:
+	// Taps along the footprint's long axis at most, the hardware sampler state uses the same limit
+	static constexpr int MaxAnisotropy{ 16 };
+
 	Texture() {};
 	~Texture();
 
-	void LoadFromFile(ID3D11Device* pDevice, const std::string& path);
+	// Normal maps are decoded to unit vectors at load and kept as signed texels, sampling them returns the vector.
+	// Compressed textures keep BC blocks for both paths: BC1 for opaque colours, BC3 with alpha and BC5 for normals.
+	// Sizes that aren't a multiple of the block size stay uncompressed.
+	void LoadFromFile(ID3D11Device* pDevice, const std::string& path, TexelFormat format = TexelFormat::color, bool isCompressed = false);
 	ID3D11ShaderResourceView* GetSRV();
+
+	// Nearest texel of level 0
 	ColorRGB Sample(const Vector2& uv) const;
 
+	// Filtered like the hardware sampler state of the same name, the level follows from the screen space derivatives of uv
+	ColorRGB Sample(const Vector2& uv, const Vector2& uvDdx, const Vector2& uvDdy, Filtering filtering = Filtering::linear) const;
+
+	// The same filtering with alpha kept, for packed textures that store a fourth input there
+	Vector4 SampleChannels(const Vector2& uv, const Vector2& uvDdx, const Vector2& uvDdy, Filtering filtering = Filtering::linear) const;
+
+	// Trilinear at an explicit level, fractions blend the two closest levels
+	ColorRGB SampleLevel(const Vector2& uv, float mipLevel) const;
+
+	// Level of detail for a pixel footprint, 0 while a pixel covers at most one texel
+	float GetMipLevel(const Vector2& uvDdx, const Vector2& uvDdy) const;
+
+	// Starts loading the cache line a later Sample with the same arguments reads first
+	void Prefetch(const Vector2& uv, const Vector2& uvDdx, const Vector2& uvDdy) const;
+
+	// Texel the point sampler reads for uv, row major
+	int GetTexelIndex(const Vector2& uv) const;
+	int GetWidth() const { return m_MipLevels.front().width; }
+	int GetHeight() const { return m_MipLevels.front().height; }
+	int GetMipLevelCount() const { return int(m_MipLevels.size()); }
+	TextureCompression GetCompression() const { return m_Compression; }
+
+	// Bytes of the CPU levels, the GPU copy holds the same amount
+	size_t GetMemorySize() const;
+
+	// Times every filter on random footprints, printed to the console
+	void RunFilteringBenchmark() const;
+
+	// Samples per second reading level 0 along rows, along columns and at random, printed to the console
+	void RunLayoutBenchmark() const;
+
+	// CPU only copies interleaving two maps of the same size, texel for texel including the mip levels, null when the sizes differ.
+	// Colour and alpha: the colour map's RGB with the alpha map's red channel in alpha, BC3 when the colour map is compressed.
+	// Normal and scalar: x and y of a normal map, then the scalar map's luminance as the third signed channel, z is left to the caller.
+	// Null for compressed normal maps, BC5 has no third channel.
+	static Texture* PackColorAlpha(const Texture& colorMap, const Texture& alphaMap);
+	static Texture* PackNormalScalar(const Texture& normalMap, const Texture& scalarMap);
+
+	// Texture bytes touched and time per pixel when a screen of pixels samples every map in the list, printed to the console
+	static void RunPackingBenchmark(const char* name, const std::vector<const Texture*>& maps);
+
 private:
 	Texture(ID3D11ShaderResourceView* pSRV);
 
+	// Texels of the CPU levels are stored in square tiles, Morton order inside a tile and the tiles row by row.
+	// A 2x2 footprint or a vertical run then mostly stays inside one cache line.
+	static constexpr int TileShift{ 3 };
+	static constexpr int TileSize{ 1 << TileShift };
+
+	// Texels as R8G8B8A8, red in the lowest byte, the same layout the shader resource is created with.
+	// Unsigned for colours, signed for normals. Compressed levels hold row major blocks instead, the GPU's layout.
+	struct MipLevel
+	{
+		int width{};
+		int height{};
+		int tilesPerRow{};
+		int blocksPerRow{};
+
+		// Size - 1 for power of two sizes, wrapping is a mask then instead of a modulo
+		int widthMask{};
+		int heightMask{};
+		std::vector<uint32_t> texels{};
+		std::vector<uint8_t> blocks{};
+	};
+
+	void DecodeNormals();
+	void BuildMipChain();
+	void SwizzleLevels();
+	void CompressLevels(TextureCompression compression);
+	__m128 UnpackTexel(uint32_t texel) const;
+	static ColorRGB ToColor(__m128 channels);
+	static void SetWrapMasks(MipLevel& level);
+	static int WrapCoordinate(int coordinate, int size, int mask);
+	static size_t GetTexelAddress(const MipLevel& level, int x, int y);
+
+	// Works for either storage, the byte offset is where the texel or its block starts
+	uint32_t FetchTexel(const MipLevel& level, int x, int y) const;
+	size_t GetTexelByteOffset(const MipLevel& level, int x, int y) const;
+	const uint8_t* GetLevelData(const MipLevel& level) const;
+
+	// BC5 drops z, it is rebuilt from the filtered x and y
+	__m128 CompleteNormal(__m128 channels) const;
+	__m128 SampleFiltered(const Vector2& uv, const Vector2& uvDdx, const Vector2& uvDdy, Filtering filtering) const;
+	__m128 SamplePoint(const Vector2& uv, float mipLevel) const;
+	__m128 SampleTrilinear(const Vector2& uv, float mipLevel) const;
+	__m128 SampleAnisotropic(const Vector2& uv, const Vector2& uvDdx, const Vector2& uvDdy) const;
+	__m128 SampleBilinear(const MipLevel& level, const Vector2& uv) const;
+
 	ID3D11ShaderResourceView* m_pSRV{ nullptr };
 	ID3D11Texture2D* m_pResource{ nullptr };
 
-	SDL_Surface* m_pSurface{ nullptr };
-	uint32_t* m_pSurfacePixels{ nullptr };
+	std::vector<MipLevel> m_MipLevels{};
+	TexelFormat m_Format{ TexelFormat::color };
+	TextureCompression m_Compression{ TextureCompression::none };
 };
 
 
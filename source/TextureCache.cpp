@@ -0,0 +1,135 @@
+#include "pch.h"
+#include "TextureCache.h"
+#include "Texture.h"
+
+TextureCache::~TextureCache() {
+	for (auto& [path, entry] : m_Entries) {
+		delete entry.pTexture;
+	}
+}
+
+Texture* TextureCache::Acquire(ID3D11Device* pDevice, const std::string& path, TexelFormat format, bool isCompressed) {
+
+	const auto cached{ m_Entries.find(path) };
+	if (cached != m_Entries.end()) {
+		++cached->second.userCount;
+		++m_SharedCount;
+		return cached->second.pTexture;
+	}
+
+	Texture* pTexture{ new Texture() };
+	pTexture->LoadFromFile(pDevice, path, format, isCompressed);
+	return Add(path, pTexture);
+}
+
+Texture* TextureCache::AcquirePacked(const Texture& first, const Texture& second, PackFunction pack) {
+
+	const auto firstEntry{ Find(&first) };
+	const auto secondEntry{ Find(&second) };
+	if (firstEntry == m_Entries.end() || secondEntry == m_Entries.end()) {
+		return nullptr;
+	}
+
+	// No file path contains a newline, so the key can't collide with a loaded texture
+	const std::string key{ firstEntry->first + "\n" + secondEntry->first };
+	const auto cached{ m_Entries.find(key) };
+	if (cached != m_Entries.end()) {
+		++cached->second.userCount;
+		++m_SharedCount;
+		return cached->second.pTexture;
+	}
+
+	Texture* pPacked{ pack(first, second) };
+	return pPacked ? Add(key, pPacked) : nullptr;
+}
+
+void TextureCache::Release(const Texture* pTexture) {
+
+	if (!pTexture) {
+		return;
+	}
+
+	const auto entry{ Find(pTexture) };
+	if (entry == m_Entries.end() || entry->second.userCount == 0) {
+		return;
+	}
+
+	if (--entry->second.userCount == 0) {
+		entry->second.releaseStamp = ++m_ReleaseStamp;
+		Evict();
+	}
+}
+
+TextureCache::EntryMap::iterator TextureCache::Find(const Texture* pTexture) {
+	return std::find_if(m_Entries.begin(), m_Entries.end(), [pTexture](const auto& keyEntry) {
+		return keyEntry.second.pTexture == pTexture;
+	});
+}
+
+Texture* TextureCache::Add(const std::string& key, Texture* pTexture) {
+
+	const Entry& entry{ m_Entries[key] = { pTexture, pTexture->GetMemorySize(), 1 } };
+	m_MemorySize += entry.memorySize;
+	++m_LoadCount;
+
+	// The new texture may push the cache over, unused ones make room for it
+	Evict();
+	return pTexture;
+}
+
+void TextureCache::SetBudget(size_t budget) {
+	m_Budget = budget;
+	Evict();
+}
+
+void TextureCache::Evict() {
+
+	while (m_MemorySize > m_Budget) {
+		auto oldest{ m_Entries.end() };
+		for (auto entry{ m_Entries.begin() }; entry != m_Entries.end(); ++entry) {
+			if (entry->second.userCount == 0 && (oldest == m_Entries.end() || entry->second.releaseStamp < oldest->second.releaseStamp)) {
+				oldest = entry;
+			}
+		}
+
+		// Everything left is in use
+		if (oldest == m_Entries.end()) {
+			return;
+		}
+
+		m_MemorySize -= oldest->second.memorySize;
+		delete oldest->second.pTexture;
+		m_Entries.erase(oldest);
+		++m_EvictedCount;
+	}
+}
+
+uint32_t TextureCache::EvictUnused() {
+
+	for (auto entry{ m_Entries.begin() }; entry != m_Entries.end();) {
+		if (entry->second.userCount == 0) {
+			m_MemorySize -= entry->second.memorySize;
+			delete entry->second.pTexture;
+			entry = m_Entries.erase(entry);
+			++m_EvictedCount;
+		}
+		else {
+			++entry;
+		}
+	}
+
+	return uint32_t(m_Entries.size());
+}
+
+void TextureCache::PrintStatistics() const {
+
+	uint32_t unusedCount{ 0 };
+	for (const auto& [path, entry] : m_Entries) {
+		if (entry.userCount == 0) {
+			++unusedCount;
+		}
+	}
+
+	std::cout << "Texture cache: " << m_Entries.size() << " textures (" << unusedCount << " unused), " << m_MemorySize / 1024 << " KiB of "
+		<< m_Budget / 1024 << " KiB, " << m_LoadCount << " loads, " << m_SharedCount << " shared, " << m_EvictedCount << " evicted\n";
+}
@@ -0,0 +1,78 @@
+#pragma once
+#include <string>
+#include <unordered_map>
+#include "DataTypes.h"
+
+class Texture;
+struct ID3D11Device;
+
+// Textures shared by file path, each file is decoded and uploaded once however many materials use it. Packed copies are
+// shared the same way under the paths they were made from.
+// Users are counted, released textures stay cached for the next user until the memory budget needs their space,
+// the longest unused go first. Textures still in use are never evicted, so the budget can be exceeded by them alone.
+class TextureCache final
+{
+public:
+	static constexpr size_t DefaultBudget{ size_t(256) << 20 };
+
+	TextureCache() = default;
+	~TextureCache();
+
+	TextureCache(const TextureCache&) = delete;
+	TextureCache(TextureCache&&) noexcept = delete;
+	TextureCache& operator=(const TextureCache&) = delete;
+	TextureCache& operator=(TextureCache&&) noexcept = delete;
+
+	// Loads the file the first time it is asked for, later calls share that texture and add a user.
+	// Format and compression are taken from the first call.
+	Texture* Acquire(ID3D11Device* pDevice, const std::string& path, TexelFormat format = TexelFormat::color, bool isCompressed = false);
+
+	// Copy of two cached textures packed into one, shared by every material using the same pair and counted in the budget.
+	// The key is the pair of paths, so each ordered pair takes one packing function. Null when pack gives none
+	// or either texture is not from the cache.
+	using PackFunction = Texture* (*)(const Texture&, const Texture&);
+	Texture* AcquirePacked(const Texture& first, const Texture& second, PackFunction pack);
+
+	// Removes a user, null and textures from outside the cache are ignored
+	void Release(const Texture* pTexture);
+
+	// Deletes every texture without users whatever the budget, for when their device is about to go.
+	// Returns how many textures are still in use and stay cached.
+	uint32_t EvictUnused();
+
+	// Bytes of CPU levels, the GPU copies take the same again
+	void SetBudget(size_t budget);
+	size_t GetBudget() const { return m_Budget; }
+	size_t GetMemorySize() const { return m_MemorySize; }
+	size_t GetTextureCount() const { return m_Entries.size(); }
+
+	// Texture count, memory and how many loads were shared, printed to the console
+	void PrintStatistics() const;
+
+private:
+	struct Entry
+	{
+		Texture* pTexture{ nullptr };
+		size_t memorySize{};
+		uint32_t userCount{};
+
+		// Release order of unused textures, the lowest is evicted first
+		uint64_t releaseStamp{};
+	};
+
+	using EntryMap = std::unordered_map<std::string, Entry>;
+
+	EntryMap::iterator Find(const Texture* pTexture);
+	Texture* Add(const std::string& key, Texture* pTexture);
+
+	// Deletes unused textures until the cache fits its budget or none are left
+	void Evict();
+
+	EntryMap m_Entries{};
+	size_t m_Budget{ DefaultBudget };
+	size_t m_MemorySize{};
+	uint64_t m_ReleaseStamp{};
+	uint32_t m_LoadCount{};
+	uint32_t m_SharedCount{};
+	uint32_t m_EvictedCount{};
+};
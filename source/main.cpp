@@ -28,6 +28,9 @@ int main(int argc, char* args[])
 	const uint32_t width = 640;
 	const uint32_t height = 480;
 
+	// Time the software renderer may spend on a frame before it lowers its resolution
+	const float frameTimeBudget = 1.f / 60.f;
+
 	SDL_Window* pWindow = SDL_CreateWindow(
 		"Dual Rasterizer - Robbe Mahieu - 2DAE08",
 		SDL_WINDOWPOS_UNDEFINED,
@@ -40,6 +43,7 @@ int main(int argc, char* args[])
 	//Initialize "framework"
 	const auto pTimer = new Timer();
 	const auto pRenderer = new Renderer(pWindow);
+	pRenderer->SetFrameTimeBudget(frameTimeBudget);
 
 	//Start loop
 	pTimer->Start();
@@ -57,6 +61,9 @@ int main(int argc, char* args[])
 			case SDL_QUIT:
 				isLooping = false;
 				break;
+			case SDL_WINDOWEVENT:
+				pRenderer->InvalidateFrame();
+				break;
 			case SDL_KEYUP:
 				
 				switch (e.key.keysym.scancode) {
@@ -94,6 +101,39 @@ int main(int argc, char* args[])
 						printFPS = !printFPS;
 						std::cout << "Print FPS " << ((printFPS) ? "ON" : "OFF") << "\n";
 						break;
+					case SDL_SCANCODE_F12:
+						pRenderer->ToggleDynamicResolution();
+						break;
+					case SDL_SCANCODE_T:
+						pRenderer->ToggleTemporalReprojection();
+						break;
+					case SDL_SCANCODE_V:
+						pRenderer->ToggleVariableRateShading();
+						break;
+					case SDL_SCANCODE_C:
+						pRenderer->ToggleCheckerboard();
+						break;
+					case SDL_SCANCODE_L:
+						pRenderer->ToggleShadingCache();
+						break;
+					case SDL_SCANCODE_P:
+						pRenderer->ToggleDemoLights();
+						break;
+					case SDL_SCANCODE_H:
+						pRenderer->ToggleShadows();
+						break;
+					case SDL_SCANCODE_I:
+						pRenderer->ToggleInstancing();
+						break;
+					case SDL_SCANCODE_O:
+						pRenderer->ToggleOcclusionCulling();
+						break;
+					case SDL_SCANCODE_M:
+						pRenderer->TogglePackedMaterials();
+						break;
+					case SDL_SCANCODE_B:
+						pRenderer->RunBenchmarks();
+						break;
 				}
 
 				break;
@@ -105,7 +145,11 @@ int main(int argc, char* args[])
 		pRenderer->Update(pTimer);
 
 		//--------- Render ---------
-		pRenderer->Render();
+		// Sleep until the next input when nothing changed this iteration
+		if (!pRenderer->Render())
+		{
+			SDL_WaitEventTimeout(nullptr, 100);
+		}
 
 		//--------- Timer ---------
 		pTimer->Update();
@@ -114,6 +158,7 @@ int main(int argc, char* args[])
 		{
 			printTimer = 0.f;
 			std::cout << "dFPS: " << pTimer->GetdFPS() << std::endl;
+			pRenderer->PrintStatistics();
 		}
 	}
 	pTimer->Stop();